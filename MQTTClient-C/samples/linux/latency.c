@@ -0,0 +1,314 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *   http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/*
+
+ latency benchmark for the socket options in NetworkOptions
+
+ Publishes QoS 1 messages to a topic it is subscribed to, one at a time, timing
+ each from the publish call until the message has come back from the server.
+ Each message arriving is acked with a PUBACK just before the next publish is
+ written, which is the pattern Nagle's algorithm and delayed acks combine to slow
+ down.  Run against a server on the same host to see the cost of the client
+ and the network stack rather than of the network.
+
+ With --unix, the path of a unix domain socket the same server listens on, TCP
+ loopback and the unix domain socket are then compared, for latency as above
+ and for throughput: QoS 0 messages published with up to 100 waiting to come
+ back, counted per second.
+
+ defaulted parameters:
+
+	--host localhost
+	--port 1883
+	--count 200
+	--unix (none)
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "MQTTClient.h"
+
+
+struct config
+{
+	const char* name;
+	NetworkOptions options;
+} configs[] =
+{
+	/* nodelay, quickack, sndbuf, rcvbuf, busy_poll_us, user_timeout_ms, keepalive idle, interval, count,
+	   connect_timeout_ms */
+	{"system defaults (Nagle on)", {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}},
+	{"TCP_NODELAY", {1, 0, 0, 0, 0, 0, 0, 0, 0, 0}},
+	{"TCP_QUICKACK", {0, 1, 0, 0, 0, 0, 0, 0, 0, 0}},
+	{"TCP_NODELAY + TCP_QUICKACK", {1, 1, 0, 0, 0, 0, 0, 0, 0, 0}},
+	{"TCP_NODELAY + 256k SO_SNDBUF/SO_RCVBUF", {1, 0, 262144, 262144, 0, 0, 0, 0, 0, 0}},
+	{"TCP_NODELAY + SO_BUSY_POLL 50us", {1, 0, 0, 0, 50, 0, 0, 0, 0, 0}},
+	{"TCP_NODELAY + TCP_USER_TIMEOUT + keepalive", {1, 0, 0, 0, 0, 10000, 10, 5, 3, 0}},
+};
+
+
+struct opts_struct
+{
+	char* host;
+	int port;
+	int count;
+	char* unix_path;
+} opts =
+{
+	"localhost", 1883, 200, NULL
+};
+
+
+void usage(void)
+{
+	printf("MQTT latency benchmark\n");
+	printf("Usage: latency <options>, where options are:\n");
+	printf("  --host <hostname> (default is localhost)\n");
+	printf("  --port <port> (default is 1883)\n");
+	printf("  --count <messages per socket option setting> (default is 200)\n");
+	printf("  --unix <path of a unix domain socket of the server, to compare with TCP>\n");
+	exit(-1);
+}
+
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--host") == 0)
+		{
+			if (++count < argc)
+				opts.host = argv[count];
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--port") == 0)
+		{
+			if (++count < argc)
+				opts.port = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--unix") == 0)
+		{
+			if (++count < argc)
+				opts.unix_path = argv[count];
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--count") == 0)
+		{
+			if (++count < argc && (opts.count = atoi(argv[count])) > 0)
+				;
+			else
+				usage();
+		}
+		else
+			usage();
+		count++;
+	}
+}
+
+
+volatile int arrived = 0;
+
+void messageArrived(MessageData* md)
+{
+	(void)md; /* unused */
+	arrived++;
+}
+
+
+long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+
+int compare(const void* a, const void* b)
+{
+	long x = *(const long*)a, y = *(const long*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* returns the number of round trips timed, or -1 if the connection could not be made */
+int run(char* host, int port, NetworkOptions* options, long* times)
+{
+	Network n;
+	MQTTClient c;
+	unsigned char buf[200];
+	unsigned char readbuf[200];
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	MQTTMessage message;
+	const char* topic = "latency benchmark";
+	int i = 0;
+	int rc;
+
+	NetworkInit(&n);
+	if ((rc = NetworkConnectWithOptions(&n, host, port, options)) != 0)
+		return -1;
+	MQTTClientInit(&c, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+	data.clientID.cstring = "latency benchmark";
+	data.keepAliveInterval = 60;
+	data.cleansession = 1;
+	if ((rc = MQTTConnect(&c, &data)) != SUCCESS ||
+	    (rc = MQTTSubscribe(&c, topic, QOS1, messageArrived)) != SUCCESS)
+		goto exit;
+
+	memset(&message, '\0', sizeof(message));
+	message.qos = QOS1;
+	message.payload = "0123456789";
+	message.payloadlen = 10;
+	for (i = 0; i < opts.count; ++i)
+	{
+		long start = now_us();
+
+		arrived = 0;
+		if (MQTTPublish(&c, topic, &message) != SUCCESS)
+			break;
+		while (!arrived)
+		{
+			if (MQTTYield(&c, 100) != SUCCESS)
+				goto exit;
+		}
+		times[i] = now_us() - start;
+	}
+	MQTTDisconnect(&c);
+exit:
+	NetworkDisconnect(&n);
+	return i;
+}
+
+
+/* returns the messages per second which came back, or -1 if the connection could not be made */
+long throughput(char* host, int port)
+{
+	const int WINDOW = 100;  /* messages published but not yet back */
+	NetworkOptions options = NetworkOptions_initializer;
+	Network n;
+	MQTTClient c;
+	unsigned char buf[200];
+	unsigned char readbuf[200];
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	MQTTMessage message;
+	const char* topic = "throughput benchmark";
+	long start, elapsed, rate = 0;
+	int sent = 0;
+
+	options.nodelay = 1;
+	NetworkInit(&n);
+	if (NetworkConnectWithOptions(&n, host, port, &options) != 0)
+		return -1;
+	MQTTClientInit(&c, &n, 5000, buf, sizeof(buf), readbuf, sizeof(readbuf));
+
+	data.clientID.cstring = "throughput benchmark";
+	data.keepAliveInterval = 60;
+	data.cleansession = 1;
+	if (MQTTConnect(&c, &data) != SUCCESS || MQTTSubscribe(&c, topic, QOS0, messageArrived) != SUCCESS)
+		goto exit;
+
+	memset(&message, '\0', sizeof(message));
+	message.qos = QOS0;
+	message.payload = "0123456789";
+	message.payloadlen = 10;
+	arrived = 0;
+	start = now_us();
+	while (arrived < opts.count)
+	{
+		if (sent < opts.count && sent - arrived < WINDOW)
+		{
+			if (MQTTPublish(&c, topic, &message) != SUCCESS)
+				goto exit;
+			++sent;
+		}
+		else if (MQTTYield(&c, 1) != SUCCESS) /* which runs for all of its timeout */
+			goto exit;
+	}
+	elapsed = now_us() - start;
+	rate = (elapsed > 0) ? opts.count * 1000000L / elapsed : 0;
+	MQTTDisconnect(&c);
+exit:
+	NetworkDisconnect(&n);
+	return rate;
+}
+
+
+/* the latency and throughput of one transport, to the same server */
+void compareTransport(const char* name, char* host, int port, long* times)
+{
+	NetworkOptions options = NetworkOptions_initializer;
+	int count;
+	long rate;
+
+	options.nodelay = 1;
+	count = run(host, port, &options, times);
+	rate = throughput(host, port);
+
+	if (count <= 0)
+		printf("%-45s could not connect, or no messages round tripped\n", name);
+	else
+	{
+		qsort(times, count, sizeof(long), compare);
+		printf("%-45s %10ld %10ld %10ld %12ld\n", name, times[0], times[count / 2], times[count * 99 / 100], rate);
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	long* times;
+	size_t i;
+
+	getopts(argc, argv);
+	if ((times = malloc(opts.count * sizeof(long))) == NULL)
+		return -1;
+
+	printf("%-45s %10s %10s %10s %10s\n", "socket options", "min us", "median us", "p99 us", "max us");
+	for (i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i)
+	{
+		int count = run(opts.host, opts.port, &configs[i].options, times);
+
+		if (count < 0)
+			printf("%-45s could not set the options, or connect\n", configs[i].name);
+		else if (count == 0)
+			printf("%-45s no messages round tripped\n", configs[i].name);
+		else
+		{
+			qsort(times, count, sizeof(long), compare);
+			printf("%-45s %10ld %10ld %10ld %10ld\n", configs[i].name, times[0], times[count / 2],
+				times[count * 99 / 100], times[count - 1]);
+		}
+	}
+	if (opts.unix_path)
+	{
+		char unix_host[120];
+
+		snprintf(unix_host, sizeof(unix_host), "%s%s", NETWORK_UNIX_PREFIX, opts.unix_path);
+		printf("\n%-45s %10s %10s %10s %12s\n", "transport", "min us", "median us", "p99 us", "messages/s");
+		compareTransport("TCP loopback (TCP_NODELAY)", opts.host, opts.port, times);
+		compareTransport("unix domain socket", unix_host, 0, times);
+	}
+	free(times);
+	return 0;
+}
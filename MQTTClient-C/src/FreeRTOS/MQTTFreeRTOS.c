@@ -71,6 +71,13 @@ int TimerLeftMS(Timer* timer)
 }
 
 
+void TimerWait(Timer* timer)
+{
+	if (xTaskCheckForTimeOut(&timer->xTimeOut, &timer->xTicksToWait) == pdFALSE)
+		vTaskDelay(timer->xTicksToWait); /* the ticks left */
+}
+
+
 char TimerIsExpired(Timer* timer)
 {
 	return xTaskCheckForTimeOut(&timer->xTimeOut, &timer->xTicksToWait) == pdTRUE;
@@ -44,6 +44,7 @@ char TimerIsExpired(Timer*);
 void TimerCountdownMS(Timer*, unsigned int);
 void TimerCountdown(Timer*, unsigned int);
 int TimerLeftMS(Timer*);
+void TimerWait(Timer*); /* block until the timer expires */
 
 typedef struct Mutex
 {
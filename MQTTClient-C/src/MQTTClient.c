@@ -18,6 +18,7 @@
 #include "MQTTClient.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessage) {
@@ -31,29 +32,101 @@ static int getNextPacketId(MQTTClient *c) {
 }
 
 
-static int sendPacket(MQTTClient* c, int length, Timer* timer)
+/**
+ * Write as much of the send queue as the network will take.  Packets are queued back to back at
+ * the start of the send buffer, so any number of them go out in one write.  Whatever is left is
+ * moved to the start of the buffer, ready to be resumed when the socket is writable again.
+ * @param timer bounds the time to wait for the network, or NULL to write only what it accepts now
+ * @return success code - FAILURE only if the write failed, not if some data remains queued
+ */
+static int flushQueue(MQTTClient* c, Timer* timer)
 {
-    int rc = FAILURE,
-        sent = 0;
+    int rc = SUCCESS;
+    size_t sent = 0;
 
-    while (sent < length && !TimerIsExpired(timer))
+    while (sent < c->buf_queued)
     {
-        rc = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], length, TimerLeftMS(timer));
-        if (rc < 0)  // there was an error writing the data
+        int len = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], (int)(c->buf_queued - sent),
+            (timer == NULL) ? 0 : TimerLeftMS(timer));
+        if (len < 0)  // there was an error writing the data
+        {
+            rc = FAILURE;
+            break;
+        }
+        if (len > 0)
+        {
+            sent += len;
+            TimerCountdown(&c->last_sent, c->keepAliveInterval); // record the fact that we have successfully sent data
+        }
+        if ((timer == NULL) ? len == 0 : TimerIsExpired(timer))
             break;
-        sent += rc;
-    }
-    if (sent == length)
-    {
-        TimerCountdown(&c->last_sent, c->keepAliveInterval); // record the fact that we have successfully sent the packet
-        rc = SUCCESS;
     }
-    else
-        rc = FAILURE;
+    if (sent > 0 && sent < c->buf_queued)
+        memmove(c->buf, &c->buf[sent], c->buf_queued - sent);
+    c->buf_queued -= sent;
+    return rc;
+}
+
+
+/**
+ * When a packet does not fit after those already queued, write some of the queue out to make room
+ * @param timer bounds the time to wait for the network, or NULL to write only what it accepts now
+ * @return SUCCESS if there is more room to try again, otherwise FAILURE
+ */
+static int makeRoom(MQTTClient* c, Timer* timer)
+{
+    size_t queued = c->buf_queued;
+
+    if (queued == 0 || flushQueue(c, timer) != SUCCESS)
+        return FAILURE;
+    return (c->buf_queued < queued) ? SUCCESS : FAILURE;
+}
+
+
+/* the return code for a packet which could not be serialized: backpressure, if there was no room for it yet */
+static int queueFailure(MQTTClient* c, int len)
+{
+    return (len == MQTTPACKET_BUFFER_TOO_SHORT && c->buf_queued > 0) ? QUEUE_FULL : FAILURE;
+}
+
+
+/* is a batch being held back?  Once its deadline has passed, it is written with the next packet */
+static int batchOpen(MQTTClient* c)
+{
+    if (c->batching && TimerIsExpired(&c->batch_timer))
+        c->batching = 0;
+    return c->batching;
+}
+
+
+/**
+ * Add the packet which has just been serialized at the end of the send queue, and write it out
+ * unless a batch is open
+ * @param timer bounds the time to wait for the whole queue to be written, or NULL not to wait
+ */
+static int sendPacket(MQTTClient* c, int length, Timer* timer)
+{
+    int rc;
+
+    c->buf_queued += length;
+    if (batchOpen(c))
+        return SUCCESS;
+    rc = flushQueue(c, timer);
+    if (rc == SUCCESS && timer != NULL && c->buf_queued > 0)
+        rc = FAILURE; /* timed out */
     return rc;
 }
 
 
+/* the MQTTTransport getfn: -1 for error, 0 for call again, or the number of bytes read */
+static int getData(void* sck, unsigned char* buf, int count)
+{
+    MQTTClient* c = (MQTTClient*)sck;
+
+    return c->ipstack->mqttread(c->ipstack, buf, count, c->read_timer ? TimerLeftMS(c->read_timer) : 0);
+}
+
+
 void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeout_ms,
 		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size)
 {
@@ -62,9 +135,13 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
 
     for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         c->messageHandlers[i].topicFilter = 0;
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+        c->pendingCommands[i].token = 0;
     c->command_timeout_ms = command_timeout_ms;
     c->buf = sendbuf;
     c->buf_size = sendbuf_size;
+    c->buf_queued = 0;
+    c->batching = 0;
     c->readbuf = readbuf;
     c->readbuf_size = readbuf_size;
     c->isconnected = 0;
@@ -74,73 +151,43 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
 	  c->next_packetid = 1;
     TimerInit(&c->last_sent);
     TimerInit(&c->last_received);
+    TimerInit(&c->ping_timer);
+    c->transport.getfn = getData;
+    c->transport.sck = c;
+    c->transport.state = 0;
+    c->read_timer = NULL;
+    c->reconnect = NULL;
+    c->reconnecting = 0;
+    c->storebuf = NULL;
+    c->storebuf_size = c->storebuf_used = 0;
+    c->offlinebuf = NULL;
+    c->offlinebuf_size = c->offline_head = c->offline_used = 0;
+    memset(&c->offline_stats, '\0', sizeof(c->offline_stats));
+    memset(c->incomingQoS2, '\0', sizeof(c->incomingQoS2));
+    c->persistence = NULL;
 #if defined(MQTT_TASK)
 	  MutexInit(&c->mutex);
 #endif
 }
 
 
-static int decodePacket(MQTTClient* c, int* value, int timeout)
-{
-    unsigned char i;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
-
-    *value = 0;
-    do
-    {
-        int rc = MQTTPACKET_READ_ERROR;
-
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
-        {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
-        }
-        rc = c->ipstack->mqttread(c->ipstack, &i, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (i & 127) * multiplier;
-        multiplier *= 128;
-    } while ((i & 128) != 0);
-exit:
-    return len;
-}
-
-
+/**
+ * Read a packet, continuing from where any previous call left off.
+ * @param timer bounds the time to wait for the rest of the packet, or NULL to read only what is available
+ * @return the MQTT packet type, 0 if the packet is not complete, or -1 on error
+ */
 static int readPacket(MQTTClient* c, Timer* timer)
 {
-    MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
-
-    /* 1. read the header byte.  This has the packet type in it */
-    int rc = c->ipstack->mqttread(c->ipstack, c->readbuf, 1, TimerLeftMS(timer));
-    if (rc != 1)
-        goto exit;
-
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(c, &rem_len, TimerLeftMS(timer));
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
-
-    if (rem_len > (c->readbuf_size - len))
-    {
-        rc = BUFFER_OVERFLOW;
-        goto exit;
-    }
+    int rc;
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (rc = c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, TimerLeftMS(timer)) != rem_len)) {
-        rc = 0;
-        goto exit;
-    }
+    c->read_timer = timer;
+    do
+        rc = MQTTPacket_readnb(c->readbuf, (int)c->readbuf_size, &c->transport);
+    while (rc == 0 && timer != NULL && !TimerIsExpired(timer));
+    c->read_timer = NULL;
 
-    header.byte = c->readbuf[0];
-    rc = header.bits.type;
-    if (c->keepAliveInterval > 0)
+    if (rc > 0 && c->keepAliveInterval > 0)
         TimerCountdown(&c->last_received, c->keepAliveInterval); // record the fact that we have successfully received a packet
-exit:
     return rc;
 }
 
@@ -209,25 +256,28 @@ int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
 }
 
 
-int keepalive(MQTTClient* c)
+int keepalive(MQTTClient* c, Timer* timer)
 {
     int rc = SUCCESS;
 
-    if (c->keepAliveInterval == 0)
+    if (c->keepAliveInterval == 0 || !c->isconnected)
         goto exit;
 
-    if (TimerIsExpired(&c->last_sent) || TimerIsExpired(&c->last_received))
+    if (c->ping_outstanding)
     {
-        if (c->ping_outstanding)
-            rc = FAILURE; /* PINGRESP not received in keepalive interval */
-        else
+        if (TimerIsExpired(&c->ping_timer))
+            rc = FAILURE; /* PINGRESP not received in time */
+    }
+    else if (TimerIsExpired(&c->last_sent) || TimerIsExpired(&c->last_received))
+    {
+        int len;
+        while ((len = MQTTSerialize_pingreq(&c->buf[c->buf_queued], c->buf_size - c->buf_queued))
+                == MQTTPACKET_BUFFER_TOO_SHORT && makeRoom(c, timer) == SUCCESS)
+            ;
+        if (len > 0 && (rc = sendPacket(c, len, timer)) == SUCCESS) // send the ping packet
         {
-            Timer timer;
-            TimerInit(&timer);
-            TimerCountdownMS(&timer, 1000);
-            int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
-            if (len > 0 && (rc = sendPacket(c, len, &timer)) == SUCCESS) // send the ping packet
-                c->ping_outstanding = 1;
+            c->ping_outstanding = 1;
+            TimerCountdownMS(&c->ping_timer, c->command_timeout_ms);
         }
     }
 
@@ -236,131 +286,1125 @@ exit:
 }
 
 
-void MQTTCleanSession(MQTTClient* c)
+static int newCommand(MQTTClient* c, MQTTToken token, unsigned char type, unsigned char ack,
+    commandHandler onComplete, void* context)
 {
-    int i = 0;
+    int i;
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        c->messageHandlers[i].topicFilter = NULL;
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token == 0)
+        {
+            c->pendingCommands[i].token = token;
+            c->pendingCommands[i].type = type;
+            c->pendingCommands[i].ack = ack;
+            c->pendingCommands[i].topicFilter = NULL;
+            c->pendingCommands[i].fp = NULL;
+            c->pendingCommands[i].onComplete = onComplete;
+            c->pendingCommands[i].context = context;
+            c->pendingCommands[i].pubrel = 0;
+            c->pendingCommands[i].stored_len = 0;
+            TimerInit(&c->pendingCommands[i].timer);
+            TimerCountdownMS(&c->pendingCommands[i].timer, c->command_timeout_ms);
+            return i;
+        }
+    }
+    return -1;
 }
 
 
-void MQTTCloseSession(MQTTClient* c)
+static int persist(MQTTClient* c, int type, unsigned short id, unsigned char* data, int len)
 {
-    c->ping_outstanding = 0;
-    c->isconnected = 0;
-    if (c->cleansession)
-        MQTTCleanSession(c);
+    if (c->persistence == NULL)
+        return SUCCESS;
+    return (c->persistence->record(c->persistence->context, type, id, data, len) == 0) ? SUCCESS : FAILURE;
 }
 
 
-int cycle(MQTTClient* c, Timer* timer)
+/* keep a copy of the publish packet just serialized for command i, to resend after reconnecting */
+static int storePublish(MQTTClient* c, int i, unsigned char* packet, int len)
 {
-    int len = 0,
-        rc = SUCCESS;
+    if (c->storebuf_size - c->storebuf_used < (size_t)len ||
+            persist(c, PERSIST_PUBLISH, c->pendingCommands[i].token, packet, len) != SUCCESS)
+        return QUEUE_FULL;
+    memcpy(&c->storebuf[c->storebuf_used], packet, len);
+    c->pendingCommands[i].stored = c->storebuf_used;
+    c->pendingCommands[i].stored_len = len;
+    c->storebuf_used += len;
+    return SUCCESS;
+}
 
-    int packet_type = readPacket(c, timer);     /* read the socket, see what work is due */
 
-    switch (packet_type)
+/* remove the copy of the publish packet for command i, closing up the gap so that storebuf stays in order */
+static void releasePublish(MQTTClient* c, int i)
+{
+    size_t start = c->pendingCommands[i].stored;
+    int len = c->pendingCommands[i].stored_len;
+    int j;
+
+    if (len == 0)
+        return;
+    memmove(&c->storebuf[start], &c->storebuf[start + len], c->storebuf_used - start - len);
+    c->storebuf_used -= len;
+    c->pendingCommands[i].stored_len = 0;
+    for (j = 0; j < MAX_PENDING_COMMANDS; ++j)
     {
-        default:
-            /* no more data to read, unrecoverable. Or read packet fails due to unexpected network error */
-            rc = packet_type;
-            goto exit;
-        case 0: /* timed out reading packet */
-            break;
-        case CONNACK:
-        case PUBACK:
-        case SUBACK:
-        case UNSUBACK:
-            break;
-        case PUBLISH:
+        if (c->pendingCommands[j].token != 0 && c->pendingCommands[j].stored_len > 0 &&
+                c->pendingCommands[j].stored > start)
+            c->pendingCommands[j].stored -= len;
+    }
+}
+
+
+static void freeCommand(MQTTClient* c, int i)
+{
+    if (c->pendingCommands[i].type == PUBLISH && (c->pendingCommands[i].stored_len > 0 || c->pendingCommands[i].pubrel))
+        persist(c, PERSIST_PUBLISH_DONE, c->pendingCommands[i].token, NULL, 0);
+    releasePublish(c, i);
+    c->pendingCommands[i].token = 0;
+}
+
+
+/* free the slot before calling the handler, so that the handler can start a new request */
+static void finishCommand(MQTTClient* c, int i, MQTTCommandResult* result)
+{
+    commandHandler onComplete = c->pendingCommands[i].onComplete;
+
+    result->token = c->pendingCommands[i].token;
+    result->type = c->pendingCommands[i].type;
+    result->context = c->pendingCommands[i].context;
+    freeCommand(c, i);
+    if (onComplete != NULL)
+        onComplete(result);
+}
+
+
+static void failCommand(MQTTClient* c, int i)
+{
+    MQTTCommandResult result;
+
+    memset(&result, '\0', sizeof(result));
+    result.rc = FAILURE;
+    finishCommand(c, i, &result);
+}
+
+
+static void cancelCommand(MQTTClient* c, MQTTToken token)
+{
+    int i;
+
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token == token)
+            freeCommand(c, i);
+    }
+}
+
+
+/* a blocking call has given up waiting for a publish which is kept to be resent: the result must not be
+ * written to its stack any more */
+static void detachCommand(MQTTClient* c, MQTTToken token)
+{
+    int i;
+
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token == token)
         {
-            MQTTString topicName;
-            MQTTMessage msg;
-            int intQoS;
-            msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
-            if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
-               (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
-                goto exit;
-            msg.qos = (enum QoS)intQoS;
-            deliverMessage(c, &topicName, &msg);
-            if (msg.qos != QOS0)
-            {
-                if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK, 0, msg.id);
-                else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC, 0, msg.id);
-                if (len <= 0)
-                    rc = FAILURE;
-                else
-                    rc = sendPacket(c, len, timer);
-                if (rc == FAILURE)
-                    goto exit; // there was a problem
-            }
-            break;
+            c->pendingCommands[i].onComplete = NULL;
+            c->pendingCommands[i].context = NULL;
         }
-        case PUBREC:
-        case PUBREL:
+    }
+}
+
+
+static void timeoutCommands(MQTTClient* c)
+{
+    int i;
+
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token != 0 && TimerIsExpired(&c->pendingCommands[i].timer) &&
+                !(!c->isconnected && c->pendingCommands[i].type == PUBLISH)) /* no acks can come until connected */
+            failCommand(c, i);
+    }
+}
+
+
+/* after a PUBREC, only the PUBREL is resent on reconnecting, so the copy of the publish is not needed */
+static void publishReceived(MQTTClient* c, unsigned short packetid)
+{
+    int i;
+
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token == packetid && c->pendingCommands[i].ack == PUBCOMP && !c->pendingCommands[i].pubrel)
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
-            else if ((len = MQTTSerialize_ack(c->buf, c->buf_size,
-                (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
-                rc = FAILURE;
-            else if ((rc = sendPacket(c, len, timer)) != SUCCESS) // send the PUBREL packet
-                rc = FAILURE; // there was a problem
-            if (rc == FAILURE)
-                goto exit; // there was a problem
-            break;
+            if (c->pendingCommands[i].stored_len > 0)
+                persist(c, PERSIST_PUBREL, packetid, NULL, 0);
+            c->pendingCommands[i].pubrel = 1;
+            releasePublish(c, i);
         }
+    }
+}
 
-        case PUBCOMP:
-            break;
-        case PINGRESP:
-            c->ping_outstanding = 0;
-            break;
+
+static int findIncomingQoS2(MQTTClient* c, unsigned short packetid)
+{
+    int i;
+
+    for (i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    {
+        if (c->incomingQoS2[i] == packetid)
+            return i;
     }
+    return -1;
+}
 
-    if (keepalive(c) != SUCCESS) {
-        //check only keepalive FAILURE status so that previous FAILURE status can be considered as FAULT
-        rc = FAILURE;
+
+/* note an incoming QoS 2 message as delivered, so that it is not delivered again if the PUBREC is lost.
+ * If there is no room, it will be. */
+static void rememberIncomingQoS2(MQTTClient* c, unsigned short packetid)
+{
+    int i;
+
+    if ((i = findIncomingQoS2(c, 0)) >= 0)
+    {
+        c->incomingQoS2[i] = packetid;
+        persist(c, PERSIST_INCOMING_QOS2, packetid, NULL, 0);
     }
+}
 
-exit:
-    if (rc == SUCCESS)
-        rc = packet_type;
-    else if (c->isconnected)
-        MQTTCloseSession(c);
-    return rc;
+
+static void forgetIncomingQoS2(MQTTClient* c, unsigned short packetid)
+{
+    int i;
+
+    if ((i = findIncomingQoS2(c, packetid)) >= 0)
+    {
+        c->incomingQoS2[i] = 0;
+        persist(c, PERSIST_INCOMING_QOS2_DONE, packetid, NULL, 0);
+    }
 }
 
 
-int MQTTYield(MQTTClient* c, int timeout_ms)
+/* the server has no session for us, so no PUBRELs are coming */
+static void forgetAllIncomingQoS2(MQTTClient* c)
 {
-    int rc = SUCCESS;
-    Timer timer;
+    int i;
 
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, timeout_ms);
+    for (i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    {
+        if (c->incomingQoS2[i] != 0)
+            forgetIncomingQoS2(c, c->incomingQoS2[i]);
+    }
+}
 
-	  do
+
+/* record the QoS granted for a subscription, so that it can be made again after reconnecting */
+static void setSubscribedQoS(MQTTClient* c, const char* topicFilter, enum QoS qos)
+{
+    int i;
+
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
     {
-        if (cycle(c, &timer) < 0)
+        if (c->messageHandlers[i].topicFilter != NULL && strcmp(c->messageHandlers[i].topicFilter, topicFilter) == 0)
+            c->messageHandlers[i].qos = qos;
+    }
+}
+
+
+/* the header of each publish in the offline queue, which is followed by the packet itself */
+typedef struct
+{
+    size_t len;                 /* of the packet, which can be more than 64K */
+    unsigned short id;          /* the packet id, for QoS 1 and 2 */
+    unsigned char qos;
+    unsigned char dropped;      /* discarded, but not yet removed from the ring */
+    commandHandler onComplete;
+    void* context;
+} OfflineEntry;
+
+
+static void ringCopyIn(MQTTClient* c, size_t pos, const void* data, size_t len)
+{
+    size_t first;
+
+    pos %= c->offlinebuf_size;
+    first = (len < c->offlinebuf_size - pos) ? len : c->offlinebuf_size - pos;
+    memcpy(&c->offlinebuf[pos], data, first);
+    memcpy(c->offlinebuf, (const unsigned char*)data + first, len - first);
+}
+
+
+static void ringCopyOut(MQTTClient* c, size_t pos, void* data, size_t len)
+{
+    size_t first;
+
+    pos %= c->offlinebuf_size;
+    first = (len < c->offlinebuf_size - pos) ? len : c->offlinebuf_size - pos;
+    memcpy(data, &c->offlinebuf[pos], first);
+    memcpy((unsigned char*)data + first, c->offlinebuf, len - first);
+}
+
+
+/* count an offline message as dropped, and tell the publisher */
+static void dropOffline(MQTTClient* c, OfflineEntry* e)
+{
+    c->offline_stats.queued[e->qos]--;
+    c->offline_stats.dropped[e->qos]++;
+    if (e->onComplete != NULL)
+    {
+        MQTTCommandResult result;
+
+        memset(&result, '\0', sizeof(result));
+        result.token = e->id;
+        result.type = PUBLISH;
+        result.rc = FAILURE;
+        result.context = e->context;
+        e->onComplete(&result);
+    }
+}
+
+
+/* take the oldest entry off the ring */
+static void removeOffline(MQTTClient* c, OfflineEntry* e)
+{
+    ringCopyOut(c, c->offline_head, e, sizeof(*e));
+    c->offline_head = (c->offline_head + sizeof(*e) + e->len) % c->offlinebuf_size;
+    c->offline_used -= sizeof(*e) + e->len;
+}
+
+
+/* mark the oldest message of this QoS as dropped.  Its space is reclaimed when it reaches the head of the ring. */
+static void dropOldestOffline(MQTTClient* c, int qos)
+{
+    size_t pos = c->offline_head,
+        end = c->offline_head + c->offline_used;
+
+    while (pos < end)
+    {
+        OfflineEntry e;
+
+        ringCopyOut(c, pos, &e, sizeof(e));
+        if (!e.dropped && e.qos == qos)
         {
-            rc = FAILURE;
+            e.dropped = 1;
+            ringCopyIn(c, pos, &e, sizeof(e));
+            dropOffline(c, &e);
             break;
         }
-  	} while (!TimerIsExpired(&timer));
+        pos += sizeof(e) + e.len;
+    }
+}
 
-    return rc;
+
+/* add the packet just serialized at the end of the send queue to the offline queue, making room by policy */
+static int queueOffline(MQTTClient* c, int len, int qos, unsigned short id, commandHandler onComplete, void* context)
+{
+    OfflineEntry e;
+    int limit = c->offline_limit[qos];
+
+    e.len = (size_t)len;
+    e.id = id;
+    e.qos = (unsigned char)qos;
+    e.dropped = 0;
+    e.onComplete = onComplete;
+    e.context = context;
+    if (limit == 0 || sizeof(e) + len > c->offlinebuf_size)
+        goto dropped;
+    if (limit > 0 && c->offline_stats.queued[qos] >= limit)
+    {
+        if (c->offline_policy == MQTT_DROP_NEWEST)
+            goto dropped;
+        dropOldestOffline(c, qos);
+    }
+    while (c->offlinebuf_size - c->offline_used < sizeof(e) + len)
+    {
+        OfflineEntry oldest;
+
+        if (c->offline_policy == MQTT_DROP_NEWEST)
+            goto dropped;
+        removeOffline(c, &oldest);
+        if (!oldest.dropped)
+            dropOffline(c, &oldest);
+    }
+    ringCopyIn(c, c->offline_head + c->offline_used, &e, sizeof(e));
+    ringCopyIn(c, c->offline_head + c->offline_used + sizeof(e), &c->buf[c->buf_queued], len);
+    c->offline_used += sizeof(e) + len;
+    c->offline_stats.queued[qos]++;
+    return SUCCESS;
+
+dropped:
+    c->offline_stats.dropped[qos]++;
+    return QUEUE_FULL;
+}
+
+
+/**
+ * Move the offline queue into the send buffer, as much as fits, and write it out in one go.  Repeat
+ * while the socket takes it all.  QoS 1 and 2 messages stop the drain when no command slot is free,
+ * so it is resumed as acks arrive.
+ */
+static void drainOffline(MQTTClient* c)
+{
+    int moved = 1;
+
+    while (moved && c->isconnected && c->offline_used > 0)
+    {
+        moved = 0;
+        while (c->offline_used > 0)
+        {
+            OfflineEntry e;
+            int i = -1;
+
+            ringCopyOut(c, c->offline_head, &e, sizeof(e));
+            if (!e.dropped)
+            {
+                if (c->buf_size - c->buf_queued < e.len)
+                    break;
+                if (e.qos != QOS0 && (i = newCommand(c, e.id, PUBLISH, (e.qos == QOS1) ? PUBACK : PUBCOMP,
+                        e.onComplete, e.context)) < 0)
+                    break;
+                ringCopyOut(c, c->offline_head + sizeof(e), &c->buf[c->buf_queued], e.len);
+                if (i >= 0 && c->storebuf != NULL && storePublish(c, i, &c->buf[c->buf_queued], (int)e.len) != SUCCESS)
+                {
+                    c->pendingCommands[i].token = 0;
+                    break;
+                }
+                c->buf_queued += e.len;
+                c->offline_stats.queued[e.qos]--;
+            }
+            removeOffline(c, &e);
+            moved = 1;
+        }
+        if (batchOpen(c) || flushQueue(c, NULL) != SUCCESS)
+            break; /* a write failure is found by the next read */
+    }
+}
+
+
+/* pick the delay before the next attempt to reconnect at random, between half and all of the retry
+ * interval, then double the interval for the attempt after */
+static void scheduleReconnect(MQTTClient* c)
+{
+    unsigned int interval = c->retry_interval_ms;
+
+    TimerInit(&c->reconnect_timer);
+    TimerCountdownMS(&c->reconnect_timer, interval / 2 + rand() % (interval / 2 + 1));
+    c->retry_interval_ms = (interval >= c->max_retry_ms / 2) ? c->max_retry_ms : interval * 2;
+    c->reconnecting = 1;
+}
+
+
+/* after reconnecting without a session, subscribe again to the topics we had, as many to a packet as fit */
+static void resubscribe(MQTTClient* c)
+{
+    MQTTString topics[MAX_MESSAGE_HANDLERS];
+    int qoss[MAX_MESSAGE_HANDLERS];
+    int count = 0,
+        start = 0,
+        n = 0,
+        len = 0;
+    int i;
+
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (c->messageHandlers[i].topicFilter != NULL && c->messageHandlers[i].qos != SUBFAIL)
+        {
+            MQTTString topic = MQTTString_initializer;
+            topic.cstring = (char*)c->messageHandlers[i].topicFilter;
+            topics[count] = topic;
+            qoss[count++] = c->messageHandlers[i].qos;
+        }
+    }
+
+    /* the SUBACKs are not waited for: the handlers are already set */
+    for (start = 0; start < count; start += n)
+    {
+        n = count - start;
+        while ((len = MQTTSerialize_subscribe(&c->buf[c->buf_queued], c->buf_size - c->buf_queued, 0,
+                getNextPacketId(c), n, &topics[start], &qoss[start])) == MQTTPACKET_BUFFER_TOO_SHORT)
+        {
+            if (makeRoom(c, NULL) != SUCCESS && --n == 0)
+                return; /* not even one topic fits */
+        }
+        if (len <= 0 || sendPacket(c, len, NULL) != SUCCESS)
+            return;
+    }
+}
+
+
+/* queue the PUBRELs and publishes which were not acknowledged on the lost connection, in the order they
+ * were made, and restart their timeouts.  Any which do not fit in the send buffer will time out. */
+static void resendPublishes(MQTTClient* c)
+{
+    size_t offset = 0;
+    int i, len;
+
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token == 0 || !c->pendingCommands[i].pubrel)
+            continue;
+        while ((len = MQTTSerialize_ack(&c->buf[c->buf_queued], c->buf_size - c->buf_queued, PUBREL, 1,
+                c->pendingCommands[i].token)) == MQTTPACKET_BUFFER_TOO_SHORT && makeRoom(c, NULL) == SUCCESS)
+            ;
+        if (len <= 0 || sendPacket(c, len, NULL) != SUCCESS)
+            return;
+        TimerCountdownMS(&c->pendingCommands[i].timer, c->command_timeout_ms);
+    }
+
+    while (offset < c->storebuf_used)
+    {
+        MQTTHeader header = {0};
+
+        for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+        {
+            if (c->pendingCommands[i].token != 0 && c->pendingCommands[i].stored_len > 0 &&
+                    c->pendingCommands[i].stored == offset)
+                break;
+        }
+        len = c->pendingCommands[i].stored_len;
+        while (c->buf_size - c->buf_queued < (size_t)len && makeRoom(c, NULL) == SUCCESS)
+            ;
+        if (c->buf_size - c->buf_queued < (size_t)len)
+            return;
+        header.byte = c->storebuf[offset];
+        header.bits.dup = 1;
+        c->storebuf[offset] = header.byte;
+        memcpy(&c->buf[c->buf_queued], &c->storebuf[offset], len);
+        if (sendPacket(c, len, NULL) != SUCCESS)
+            return;
+        TimerCountdownMS(&c->pendingCommands[i].timer, c->command_timeout_ms);
+        offset += len;
+    }
+}
+
+
+/* match an ack to the request it completes.  Acks for requests we are not waiting for are ignored. */
+static int completeCommand(MQTTClient* c, int packet_type)
+{
+    MQTTCommandResult result;
+    unsigned short mypacketid = 0;
+    int rc = SUCCESS;
+    int i;
+
+    memset(&result, '\0', sizeof(result));
+    switch (packet_type)
+    {
+        case CONNACK:
+            if (MQTTDeserialize_connack(&result.data.connack.sessionPresent, &result.data.connack.rc,
+                    c->readbuf, c->readbuf_size) != 1)
+                rc = FAILURE;
+            result.rc = result.data.connack.rc;
+            break;
+        case SUBACK:
+        {
+            int count = 0;
+            int grantedQoSs[MAX_MESSAGE_HANDLERS]; /* resubscribing asks for several topics at once */
+            if (MQTTDeserialize_suback(&mypacketid, MAX_MESSAGE_HANDLERS, &count, grantedQoSs,
+                    c->readbuf, c->readbuf_size) != 1)
+                rc = FAILURE;
+            result.data.suback.grantedQoS = (count > 0) ? (enum QoS)grantedQoSs[0] : QOS0;
+            break;
+        }
+        case UNSUBACK:
+            if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) != 1)
+                rc = FAILURE;
+            break;
+        default:
+        {
+            unsigned char dup, type;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+                rc = FAILURE;
+            break;
+        }
+    }
+    if (rc == FAILURE)
+        goto exit;
+
+    if (packet_type == CONNACK && c->reconnecting == 2)
+    {
+        if (result.rc == SUCCESS)
+        {
+            c->isconnected = 1;
+            c->reconnecting = 0;
+            c->retry_interval_ms = c->min_retry_ms;
+            if (!result.data.connack.sessionPresent)
+            {
+                resubscribe(c);
+                forgetAllIncomingQoS2(c);
+            }
+            resendPublishes(c);
+            drainOffline(c);
+        }
+        else
+            scheduleReconnect(c); /* refused: the server will close the connection */
+        goto exit;
+    }
+
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token != 0 && c->pendingCommands[i].ack == packet_type &&
+                (packet_type == CONNACK || c->pendingCommands[i].token == mypacketid))
+            break;
+    }
+    if (i == MAX_PENDING_COMMANDS)
+        goto exit;
+
+    if (packet_type == CONNACK && result.rc == SUCCESS)
+    {
+        c->isconnected = 1;
+        c->ping_outstanding = 0;
+    }
+    else if (packet_type == SUBACK && result.data.suback.grantedQoS != SUBFAIL &&
+            (result.rc = MQTTSetMessageHandler(c, c->pendingCommands[i].topicFilter, c->pendingCommands[i].fp)) == SUCCESS)
+        setSubscribedQoS(c, c->pendingCommands[i].topicFilter, result.data.suback.grantedQoS);
+    else if (packet_type == UNSUBACK)
+        /* remove the subscription message handler associated with this topic, if there is one */
+        MQTTSetMessageHandler(c, c->pendingCommands[i].topicFilter, NULL);
+    finishCommand(c, i, &result);
+    if (packet_type == CONNACK && c->isconnected)
+    {
+        if (!result.data.connack.sessionPresent)
+            forgetAllIncomingQoS2(c);
+        resendPublishes(c); /* any restored from persistence */
+        drainOffline(c);
+    }
+
+exit:
+    return rc;
+}
+
+
+void MQTTCleanSession(MQTTClient* c)
+{
+    int i = 0;
+
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+        c->messageHandlers[i].topicFilter = NULL;
+}
+
+
+void MQTTCloseSession(MQTTClient* c)
+{
+    int i;
+
+    c->reconnecting = 0;
+    c->ping_outstanding = 0;
+    c->isconnected = 0;
+    c->buf_queued = 0; /* the connection these were for has gone */
+    c->batching = 0;
+    if (c->cleansession)
+        MQTTCleanSession(c);
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token != 0)
+            failCommand(c, i); /* no acks can arrive now */
+    }
+}
+
+
+/**
+ * The connection has been lost.  Without automatic reconnect, or if the client had not connected, the
+ * session is closed.  Otherwise, the unacknowledged publishes are kept to be resent, all other requests
+ * fail, and a reconnect is scheduled.
+ */
+static void connectionLost(MQTTClient* c)
+{
+    int i;
+
+    if (c->reconnect == NULL || (!c->isconnected && !c->reconnecting))
+    {
+        MQTTCloseSession(c);
+        return;
+    }
+    c->ping_outstanding = 0;
+    c->isconnected = 0;
+    c->buf_queued = 0; /* the connection these were for has gone */
+    c->batching = 0;
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token != 0 && !(c->pendingCommands[i].type == PUBLISH &&
+                (c->pendingCommands[i].stored_len > 0 || c->pendingCommands[i].pubrel)))
+            failCommand(c, i);
+    }
+    if (c->reconnecting != 1)
+        scheduleReconnect(c);
+}
+
+
+/* send the CONNECT packet, starting the connection state afresh */
+static int sendConnect(MQTTClient* c, MQTTPacket_connectData* options, Timer* timer)
+{
+    int len = 0;
+
+    c->keepAliveInterval = options->keepAliveInterval;
+    c->cleansession = options->cleansession;
+    c->ping_outstanding = 0;
+    c->transport.state = 0; /* discard any partial packets from a previous connection */
+    c->buf_queued = 0;
+    c->batching = 0;
+    TimerCountdown(&c->last_received, c->keepAliveInterval);
+    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+        return FAILURE;
+    return sendPacket(c, len, timer);
+}
+
+
+/**
+ * While the connection is down, reconnect once the backoff interval has passed.  The CONNECT is not a
+ * pending command, so that a full table of unacknowledged publishes cannot keep it from being sent.
+ * @return SUCCESS if there is a connection to work on, otherwise FAILURE
+ */
+static int reconnectStep(MQTTClient* c)
+{
+    if (c->reconnecting == 2 && TimerIsExpired(&c->reconnect_timer))
+        scheduleReconnect(c); /* no CONNACK came */
+    if (c->reconnecting != 1)
+        return SUCCESS;
+    if (!TimerIsExpired(&c->reconnect_timer))
+        return FAILURE;
+    if (c->reconnect(c->ipstack, c->reconnect_context) != 0 || sendConnect(c, &c->connectData, NULL) != SUCCESS)
+    {
+        scheduleReconnect(c);
+        return FAILURE;
+    }
+    c->reconnecting = 2;
+    TimerCountdownMS(&c->reconnect_timer, c->command_timeout_ms);
+    return SUCCESS;
+}
+
+
+static int handlePacket(MQTTClient* c, int packet_type, Timer* timer)
+{
+    int len = 0,
+        rc = SUCCESS;
+
+    switch (packet_type)
+    {
+        default:
+            /* no more data to read, unrecoverable. Or read packet fails due to unexpected network error */
+            rc = FAILURE;
+            break;
+        case 0: /* timed out reading packet */
+            break;
+        case CONNACK:
+        case PUBACK:
+        case SUBACK:
+        case UNSUBACK:
+        case PUBCOMP:
+            rc = completeCommand(c, packet_type);
+            break;
+        case PUBLISH:
+        {
+            MQTTString topicName;
+            MQTTMessage msg;
+            int intQoS;
+            msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
+            if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
+               (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
+                break;
+            msg.qos = (enum QoS)intQoS;
+            if (msg.qos != QOS2 || findIncomingQoS2(c, msg.id) < 0) /* else a duplicate, its PUBREC lost */
+            {
+                deliverMessage(c, &topicName, &msg);
+                if (msg.qos == QOS2)
+                    rememberIncomingQoS2(c, msg.id);
+            }
+            if (msg.qos != QOS0)
+            {
+                while ((len = MQTTSerialize_ack(&c->buf[c->buf_queued], c->buf_size - c->buf_queued,
+                        (msg.qos == QOS1) ? PUBACK : PUBREC, 0, msg.id)) == MQTTPACKET_BUFFER_TOO_SHORT &&
+                        makeRoom(c, timer) == SUCCESS)
+                    ;
+                if (len <= 0)
+                    rc = FAILURE;
+                else
+                    rc = sendPacket(c, len, timer);
+            }
+            break;
+        }
+        case PUBREC:
+        case PUBREL:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+                rc = FAILURE;
+            else
+            {
+                if (packet_type == PUBREC)
+                    publishReceived(c, mypacketid);
+                else
+                    forgetIncomingQoS2(c, mypacketid);
+                while ((len = MQTTSerialize_ack(&c->buf[c->buf_queued], c->buf_size - c->buf_queued,
+                        (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) == MQTTPACKET_BUFFER_TOO_SHORT &&
+                        makeRoom(c, timer) == SUCCESS)
+                    ;
+            }
+            if (rc == FAILURE || len <= 0)
+                rc = FAILURE;
+            else if ((rc = sendPacket(c, len, timer)) != SUCCESS) // send the PUBREL packet
+                rc = FAILURE; // there was a problem
+            break;
+        }
+        case PINGRESP:
+            c->ping_outstanding = 0;
+            break;
+    }
+    return rc;
+}
+
+
+/* let the persistence flush its records if they are due, or with check_only just find out when
+ * they are, returning the time until then */
+static int syncPersistence(MQTTClient* c, int check_only)
+{
+    if (c->persistence == NULL || c->persistence->sync == NULL)
+        return -1;
+    return c->persistence->sync(c->persistence->context, check_only);
+}
+
+
+int cycle(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS;
+    int packet_type = 0;
+
+    syncPersistence(c, 0);
+    if ((rc = reconnectStep(c)) != SUCCESS)
+        return rc; /* the connection is down, and it is not time to try again yet */
+
+    if (!batchOpen(c) && (rc = flushQueue(c, timer)) != SUCCESS)    /* finish writing anything queued by the non-blocking calls */
+        goto exit;
+
+    packet_type = readPacket(c, timer);     /* read the socket, see what work is due */
+
+    if ((rc = handlePacket(c, packet_type, timer)) != SUCCESS)
+        goto exit;
+
+    timeoutCommands(c);
+    drainOffline(c);    /* resume if it was waiting for command slots */
+
+    if (keepalive(c, timer) != SUCCESS) {
+        //check only keepalive FAILURE status so that previous FAILURE status can be considered as FAULT
+        rc = FAILURE;
+    }
+
+exit:
+    if (rc == SUCCESS)
+        rc = packet_type;
+    else if (c->isconnected || c->reconnecting)
+        connectionLost(c);
+    return rc;
+}
+
+
+int MQTTYield(MQTTClient* c, int timeout_ms)
+{
+    int rc = SUCCESS;
+    Timer timer;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, timeout_ms);
+
+	  do
+    {
+        if (cycle(c, &timer) < 0)
+        {
+            rc = FAILURE;
+            break;
+        }
+  	} while (!TimerIsExpired(&timer));
+
+    return rc;
+}
+
+
+int MQTTClient_process(MQTTClient* c, int events)
+{
+    int rc = SUCCESS;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    syncPersistence(c, 0);
+    if ((rc = reconnectStep(c)) != SUCCESS)
+        goto exit; /* the connection is down, and it is not time to try again yet */
+    if (c->batching && !batchOpen(c))
+        events |= MQTT_EVENT_WRITE; /* the batch deadline has passed: try to write it now */
+    if ((events & MQTT_EVENT_WRITE) && !batchOpen(c))
+        rc = flushQueue(c, NULL);
+
+    if (rc == SUCCESS && (events & MQTT_EVENT_READ))
+    {
+        int first = 1;
+
+        for (;; first = 0)
+        {
+            char state = c->transport.state;
+            int len = c->transport.len;
+            int packet_type;
+
+            if (c->buf_size - c->buf_queued < 4)
+                break; /* no room to queue an ack for another packet - wait for the queue to drain */
+            packet_type = readPacket(c, NULL);
+
+            if (packet_type == 0)
+            {
+                if (state == c->transport.state && len == c->transport.len)
+                {
+                    if (first)
+                        rc = FAILURE; /* readable, but no data: the connection has been closed */
+                    break;
+                }
+            }
+            else if (handlePacket(c, packet_type, NULL) != SUCCESS)
+            {
+                rc = FAILURE;
+                break;
+            }
+        }
+    }
+
+    if (rc == SUCCESS)
+    {
+        timeoutCommands(c);
+        drainOffline(c);
+        rc = keepalive(c, NULL);
+    }
+
+    if (rc != SUCCESS)
+        connectionLost(c);
+exit:
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTWantsWrite(MQTTClient* c)
+{
+    return c->buf_queued > 0 && !batchOpen(c);
+}
+
+
+/* keep the earliest of the deadlines, where -1 means none */
+static int earliest(int next, int left_ms)
+{
+    return (next == -1 || left_ms < next) ? left_ms : next;
+}
+
+
+int MQTTNextTimeoutMs(MQTTClient* c)
+{
+    int next = -1;
+    int i;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    if (c->keepAliveInterval > 0 && c->isconnected)
+    {
+        if (c->ping_outstanding)
+            next = TimerLeftMS(&c->ping_timer);
+        else
+            next = earliest(TimerLeftMS(&c->last_sent), TimerLeftMS(&c->last_received));
+    }
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token != 0)
+            next = earliest(next, TimerLeftMS(&c->pendingCommands[i].timer));
+    }
+    if (c->batching)
+        next = earliest(next, TimerLeftMS(&c->batch_timer));
+    if (c->reconnecting)
+        next = earliest(next, TimerLeftMS(&c->reconnect_timer));
+    if ((i = syncPersistence(c, 1)) != -1)
+        next = earliest(next, i);
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return next;
+}
+
+
+#if defined(MQTTCLIENT_NETWORK_POLL)
+int MQTTGetFd(MQTTClient* c)
+{
+    return NetworkGetFd(c->ipstack);
+}
+
+
+int MQTTProcessIO(MQTTClient* c)
+{
+    int events = MQTT_EVENT_READ;
+
+    if (MQTTWantsWrite(c))
+        events |= MQTT_EVENT_WRITE;
+    if ((events = NetworkPoll(c->ipstack, events, 0)) < 0)
+        return FAILURE;
+    return MQTTClient_process(c, events);
+}
+#endif
+
+
+int MQTTIsConnected(MQTTClient* client)
+{
+  return client->isconnected;
+}
+
+
+int MQTTBeginBatch(MQTTClient* c, int timeout_ms)
+{
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    if (!c->batching)
+    {
+        TimerInit(&c->batch_timer);
+        TimerCountdownMS(&c->batch_timer, timeout_ms);
+        c->batching = 1;
+    }
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return SUCCESS;
+}
+
+
+int MQTTFlush(MQTTClient* c)
+{
+    int rc = SUCCESS;
+    Timer timer;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    c->batching = 0;
+    if (c->buf_queued > 0)
+    {
+        TimerInit(&timer);
+        TimerCountdownMS(&timer, c->command_timeout_ms);
+        if ((rc = flushQueue(c, &timer)) == SUCCESS && c->buf_queued > 0)
+            rc = FAILURE; /* timed out */
+        if (rc != SUCCESS)
+            connectionLost(c);
+    }
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+void MQTTSetOfflineQueue(MQTTClient* c, unsigned char* buf, size_t size,
+    enum MQTTOfflinePolicy policy, int max_qos0, int max_qos1, int max_qos2)
+{
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    c->offlinebuf = buf;
+    c->offlinebuf_size = (buf == NULL) ? 0 : size;
+    c->offline_head = c->offline_used = 0;
+    c->offline_policy = policy;
+    c->offline_limit[QOS0] = max_qos0;
+    c->offline_limit[QOS1] = max_qos1;
+    c->offline_limit[QOS2] = max_qos2;
+    memset(&c->offline_stats, '\0', sizeof(c->offline_stats));
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+}
+
+
+/* rebuild the in-flight state from a record the persistence kept */
+static void restoreRecord(void* client, int type, unsigned short id, unsigned char* data, int len)
+{
+    MQTTClient* c = (MQTTClient*)client;
+
+    if (type == PERSIST_INCOMING_QOS2)
+        rememberIncomingQoS2(c, id);
+    else if (type == PERSIST_PUBLISH || type == PERSIST_PUBREL)
+    {
+        MQTTHeader header = {0};
+        int i;
+
+        if (type == PERSIST_PUBLISH)
+            header.byte = data[0];
+        if ((i = newCommand(c, id, PUBLISH, (type == PERSIST_PUBLISH && header.bits.qos == QOS1) ? PUBACK : PUBCOMP,
+                NULL, NULL)) < 0)
+            return;
+        if (type == PERSIST_PUBREL)
+            c->pendingCommands[i].pubrel = 1;
+        else if (storePublish(c, i, data, len) != SUCCESS)
+        {
+            c->pendingCommands[i].token = 0;
+            return;
+        }
+        c->next_packetid = id;
+    }
+}
+
+
+int MQTTSetPersistence(MQTTClient* c, MQTTPersistence* persistence)
+{
+    int rc = 0;
+    int i;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    c->persistence = NULL; /* so that what is restored is not recorded again */
+    if (persistence != NULL)
+    {
+        if (persistence->restore(persistence->context, restoreRecord, c) != 0)
+            rc = FAILURE;
+        for (i = 0; rc != FAILURE && i < MAX_PENDING_COMMANDS; ++i)
+            rc += (c->pendingCommands[i].token != 0);
+        for (i = 0; rc != FAILURE && i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+            rc += (c->incomingQoS2[i] != 0);
+    }
+    c->persistence = persistence;
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+void MQTTGetOfflineStats(MQTTClient* c, MQTTOfflineStats* stats)
+{
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    *stats = c->offline_stats;
+    stats->size = c->offlinebuf_size;
+    stats->bytes = c->offline_used;
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
 }
 
-int MQTTIsConnected(MQTTClient* client)
+
+void MQTTSetAutoReconnect(MQTTClient* c, networkReconnect reconnect, void* context,
+    unsigned char* storebuf, size_t storebuf_size, unsigned int min_retry_ms, unsigned int max_retry_ms)
 {
-  return client->isconnected;
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    c->reconnect = reconnect;
+    c->reconnect_context = context;
+    c->storebuf = storebuf;
+    c->storebuf_size = (storebuf == NULL) ? 0 : storebuf_size;
+    c->storebuf_used = 0;
+    c->min_retry_ms = c->retry_interval_ms = min_retry_ms;
+    c->max_retry_ms = max_retry_ms;
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
 }
 
 void MQTTRun(void* parm)
@@ -372,14 +1416,26 @@ void MQTTRun(void* parm)
 
 	while (1)
 	{
+		Timer until;
+		int wait = 0;
+
 #if defined(MQTT_TASK)
 		MutexLock(&c->mutex);
 #endif
 		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
-		cycle(c, &timer);
+		if (cycle(c, &timer) < 0)
+		{
+			/* the connection is down: wait for the next reconnect attempt, rather than spin */
+			until = timer;
+			if (c->reconnecting == 1 && TimerLeftMS(&c->reconnect_timer) < TimerLeftMS(&timer))
+				until = c->reconnect_timer; /* a copy, as the timer may be changed once the mutex is released */
+			wait = 1;
+		}
 #if defined(MQTT_TASK)
 		MutexUnlock(&c->mutex);
 #endif
+		if (wait)
+			TimerWait(&until);
 	}
 }
 
@@ -392,71 +1448,90 @@ int MQTTStartTask(MQTTClient* client)
 #endif
 
 
-int waitfor(MQTTClient* c, int packet_type, Timer* timer)
+/* the command handler used by the blocking calls - the context is where to store the result */
+static void commandComplete(MQTTCommandResult* result)
+{
+    *(MQTTCommandResult*)result->context = *result;
+}
+
+
+/* only used by the blocking calls, which process incoming packets until their own request completes */
+static int waitfor(MQTTClient* c, MQTTToken token, MQTTCommandResult* result, Timer* timer)
 {
     int rc = FAILURE;
 
-    do
+    if (flushQueue(c, timer) == SUCCESS) // the ack won't come while the request is held back in a batch
     {
-        if (TimerIsExpired(timer))
-            break; // we timed out
-        rc = cycle(c, timer);
+        while (result->token != token)
+        {
+            if (TimerIsExpired(timer) || cycle(c, timer) < 0)
+                break; // we timed out, or the connection was lost
+        }
     }
-    while (rc != packet_type && rc >= 0);
-
+    if (result->token == token)
+        rc = result->rc;
+    else if (c->reconnecting)
+        detachCommand(c, token); // a publish kept to be resent after reconnecting
+    else
+        cancelCommand(c, token);
     return rc;
 }
 
 
+static int connectNB(MQTTClient* c, MQTTPacket_connectData* options, Timer* timer, commandHandler handler, void* context)
+{
+    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
+    int rc = FAILURE;
+    int i;
+
+	  if (c->isconnected || c->reconnecting) /* don't send connect packet again if we are already connected, or reconnecting */
+		  goto exit;
+
+    for (i = 0; i < MAX_PENDING_COMMANDS; ++i)
+    {
+        if (c->pendingCommands[i].token != 0 && c->pendingCommands[i].ack == CONNACK)
+            goto exit; /* nor if one is already on its way */
+    }
+
+    if (options == 0)
+        options = &default_options; /* set default options if none were supplied */
+    c->connectData = *options; /* for reconnecting */
+
+    if ((i = newCommand(c, getNextPacketId(c), CONNECT, CONNACK, handler, context)) < 0)
+        goto exit;
+    if ((rc = sendConnect(c, options, timer)) != SUCCESS)  // send the connect packet
+    {
+        c->pendingCommands[i].token = 0;
+        goto exit; // there was a problem
+    }
+    rc = c->pendingCommands[i].token;
+
+exit:
+    return rc;
+}
 
 
 int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTConnackData* data)
 {
     Timer connect_timer;
+    MQTTCommandResult result;
     int rc = FAILURE;
-    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
-    int len = 0;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
 #endif
-	  if (c->isconnected) /* don't send connect packet again if we are already connected */
-		  goto exit;
-
     TimerInit(&connect_timer);
     TimerCountdownMS(&connect_timer, c->command_timeout_ms);
 
-    if (options == 0)
-        options = &default_options; /* set default options if none were supplied */
-
-    c->keepAliveInterval = options->keepAliveInterval;
-    c->cleansession = options->cleansession;
-    TimerCountdown(&c->last_received, c->keepAliveInterval);
-    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+    result.token = 0;
+    if ((rc = connectNB(c, options, &connect_timer, commandComplete, &result)) < 0)
         goto exit;
-    if ((rc = sendPacket(c, len, &connect_timer)) != SUCCESS)  // send the connect packet
-        goto exit; // there was a problem
 
     // this will be a blocking call, wait for the connack
-    if (waitfor(c, CONNACK, &connect_timer) == CONNACK)
-    {
-        data->rc = 0;
-        data->sessionPresent = 0;
-        if (MQTTDeserialize_connack(&data->sessionPresent, &data->rc, c->readbuf, c->readbuf_size) == 1)
-            rc = data->rc;
-        else
-            rc = FAILURE;
-    }
-    else
-        rc = FAILURE;
+    if ((rc = waitfor(c, rc, &result, &connect_timer)) != FAILURE)
+        *data = result.data.connack;
 
 exit:
-    if (rc == SUCCESS)
-    {
-        c->isconnected = 1;
-        c->ping_outstanding = 0;
-    }
-
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
 #endif
@@ -472,6 +1547,21 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
 }
 
 
+int MQTTConnectNB(MQTTClient* c, MQTTPacket_connectData* options, commandHandler handler, void* context)
+{
+    int rc = FAILURE;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    rc = connectNB(c, options, NULL, handler, context);
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
 int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler)
 {
     int rc = FAILURE;
@@ -506,6 +1596,8 @@ int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler
         }
         if (i < MAX_MESSAGE_HANDLERS)
         {
+            if (c->messageHandlers[i].topicFilter == NULL)
+                c->messageHandlers[i].qos = SUBFAIL; /* not subscribed until a SUBACK says so */
             c->messageHandlers[i].topicFilter = topicFilter;
             c->messageHandlers[i].fp = messageHandler;
         }
@@ -514,47 +1606,66 @@ int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler
 }
 
 
-int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qos,
-       messageHandler messageHandler, MQTTSubackData* data)
+static int subscribeNB(MQTTClient* c, const char* topicFilter, enum QoS qos,
+       messageHandler messageHandler, Timer* timer, commandHandler handler, void* context)
 {
     int rc = FAILURE;
-    Timer timer;
     int len = 0;
+    int i;
     MQTTString topic = MQTTString_initializer;
     topic.cstring = (char *)topicFilter;
 
-#if defined(MQTT_TASK)
-	  MutexLock(&c->mutex);
-#endif
 	  if (!c->isconnected)
 		    goto exit;
 
+    if ((i = newCommand(c, getNextPacketId(c), SUBSCRIBE, SUBACK, handler, context)) < 0)
+        goto exit;
+    c->pendingCommands[i].topicFilter = topicFilter;
+    c->pendingCommands[i].fp = messageHandler;
+
+    while ((len = MQTTSerialize_subscribe(&c->buf[c->buf_queued], c->buf_size - c->buf_queued, 0,
+            c->pendingCommands[i].token, 1, &topic, (int*)&qos)) == MQTTPACKET_BUFFER_TOO_SHORT &&
+            makeRoom(c, timer) == SUCCESS)
+        ;
+    if (len <= 0)
+        rc = queueFailure(c, len);
+    else
+        rc = sendPacket(c, len, timer); // send the subscribe packet
+    if (rc != SUCCESS)
+    {
+        c->pendingCommands[i].token = 0;
+        goto exit;             // there was a problem
+    }
+    rc = c->pendingCommands[i].token;
+
+exit:
+    return rc;
+}
+
+
+int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qos,
+       messageHandler messageHandler, MQTTSubackData* data)
+{
+    int rc = FAILURE;
+    Timer timer;
+    MQTTCommandResult result;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (int*)&qos);
-    if (len <= 0)
+    result.token = 0;
+    if ((rc = subscribeNB(c, topicFilter, qos, messageHandler, &timer, commandComplete, &result)) < 0)
         goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
-        goto exit;             // there was a problem
 
-    if (waitfor(c, SUBACK, &timer) == SUBACK)      // wait for suback
-    {
-        int count = 0;
-        unsigned short mypacketid;
-        data->grantedQoS = QOS0;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, (int*)&data->grantedQoS, c->readbuf, c->readbuf_size) == 1)
-        {
-            if (data->grantedQoS != 0x80)
-                rc = MQTTSetMessageHandler(c, topicFilter, messageHandler);
-        }
-    }
-    else
-        rc = FAILURE;
+    if ((rc = waitfor(c, rc, &result, &timer)) == SUCCESS)      // wait for suback
+        *data = result.data.suback;
 
 exit:
     if (rc == FAILURE)
-        MQTTCloseSession(c);
+        connectionLost(c);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
 #endif
@@ -570,43 +1681,78 @@ int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos,
 }
 
 
-int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
+int MQTTSubscribeNB(MQTTClient* c, const char* topicFilter, enum QoS qos,
+       messageHandler messageHandler, commandHandler handler, void* context)
 {
     int rc = FAILURE;
-    Timer timer;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
-    int len = 0;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
 #endif
+    rc = subscribeNB(c, topicFilter, qos, messageHandler, NULL, handler, context);
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+static int unsubscribeNB(MQTTClient* c, const char* topicFilter, Timer* timer, commandHandler handler, void* context)
+{
+    int rc = FAILURE;
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char *)topicFilter;
+    int len = 0;
+    int i;
+
 	  if (!c->isconnected)
 		  goto exit;
 
+    if ((i = newCommand(c, getNextPacketId(c), UNSUBSCRIBE, UNSUBACK, handler, context)) < 0)
+        goto exit;
+    c->pendingCommands[i].topicFilter = topicFilter;
+
+    while ((len = MQTTSerialize_unsubscribe(&c->buf[c->buf_queued], c->buf_size - c->buf_queued, 0,
+            c->pendingCommands[i].token, 1, &topic)) == MQTTPACKET_BUFFER_TOO_SHORT &&
+            makeRoom(c, timer) == SUCCESS)
+        ;
+    if (len <= 0)
+        rc = queueFailure(c, len);
+    else
+        rc = sendPacket(c, len, timer); // send the unsubscribe packet
+    if (rc != SUCCESS)
+    {
+        c->pendingCommands[i].token = 0;
+        goto exit; // there was a problem
+    }
+    rc = c->pendingCommands[i].token;
+
+exit:
+    return rc;
+}
+
+
+int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
+{
+    int rc = FAILURE;
+    Timer timer;
+    MQTTCommandResult result;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
+    result.token = 0;
+    if ((rc = unsubscribeNB(c, topicFilter, &timer, commandComplete, &result)) < 0)
         goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
-        goto exit; // there was a problem
 
-    if (waitfor(c, UNSUBACK, &timer) == UNSUBACK)
-    {
-        unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
-        {
-            /* remove the subscription message handler associated with this topic, if there is one */
-            MQTTSetMessageHandler(c, topicFilter, NULL);
-        }
-    }
-    else
-        rc = FAILURE;
+    rc = waitfor(c, rc, &result, &timer);
 
 exit:
     if (rc == FAILURE)
-        MQTTCloseSession(c);
+        connectionLost(c);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
 #endif
@@ -614,61 +1760,124 @@ exit:
 }
 
 
-int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+int MQTTUnsubscribeNB(MQTTClient* c, const char* topicFilter, commandHandler handler, void* context)
 {
     int rc = FAILURE;
-    Timer timer;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicName;
-    int len = 0;
 
 #if defined(MQTT_TASK)
 	  MutexLock(&c->mutex);
 #endif
-	  if (!c->isconnected)
-		    goto exit;
-
-    TimerInit(&timer);
-    TimerCountdownMS(&timer, c->command_timeout_ms);
+    rc = unsubscribeNB(c, topicFilter, NULL, handler, context);
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
 
-    if (message->qos == QOS1 || message->qos == QOS2)
-        message->id = getNextPacketId(c);
 
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
-              topic, (unsigned char*)message->payload, message->payloadlen);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
-        goto exit; // there was a problem
+static int publishNB(MQTTClient* c, const char* topicName, MQTTMessage* message, Timer* timer,
+    commandHandler handler, void* context)
+{
+    int rc = FAILURE;
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char *)topicName;
+    int len = 0;
+    int i = -1;
 
-    if (message->qos == QOS1)
+	  if (!c->isconnected)
     {
-        if (waitfor(c, PUBACK, &timer) == PUBACK)
+        if (c->offlinebuf != NULL) /* keep it until we are connected */
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
+            if (message->qos == QOS1 || message->qos == QOS2)
+                message->id = getNextPacketId(c);
+            while ((len = MQTTSerialize_publish(&c->buf[c->buf_queued], c->buf_size - c->buf_queued, 0, message->qos,
+                      message->retained, message->id, topic, (unsigned char*)message->payload, message->payloadlen))
+                      == MQTTPACKET_BUFFER_TOO_SHORT && makeRoom(c, timer) == SUCCESS)
+                ;
+            if (len <= 0)
+                rc = queueFailure(c, len);
+            else if ((rc = queueOffline(c, len, message->qos, message->id, handler, context)) == SUCCESS)
+                rc = (message->qos == QOS0) ? getNextPacketId(c) : message->id;
         }
-        else
-            rc = FAILURE;
+        goto exit;
     }
-    else if (message->qos == QOS2)
+
+    if (message->qos == QOS1 || message->qos == QOS2)
     {
-        if (waitfor(c, PUBCOMP, &timer) == PUBCOMP)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
-        }
-        else
-            rc = FAILURE;
+        if ((i = newCommand(c, getNextPacketId(c), PUBLISH, (message->qos == QOS1) ? PUBACK : PUBCOMP,
+                handler, context)) < 0)
+            goto exit;
+        message->id = c->pendingCommands[i].token;
+    }
+
+    while ((len = MQTTSerialize_publish(&c->buf[c->buf_queued], c->buf_size - c->buf_queued, 0, message->qos,
+              message->retained, message->id, topic, (unsigned char*)message->payload, message->payloadlen))
+              == MQTTPACKET_BUFFER_TOO_SHORT && makeRoom(c, timer) == SUCCESS)
+        ;
+    if (len <= 0)
+        rc = queueFailure(c, len);
+    else if (i >= 0 && c->storebuf != NULL && (rc = storePublish(c, i, &c->buf[c->buf_queued], len)) != SUCCESS)
+        ; // no room to keep a copy to resend
+    else
+        rc = sendPacket(c, len, timer); // send the publish packet
+    if (rc != SUCCESS)
+    {
+        if (i >= 0)
+            freeCommand(c, i);
+        goto exit; // there was a problem
+    }
+    rc = (i >= 0) ? c->pendingCommands[i].token : getNextPacketId(c);
+
+exit:
+    return rc;
+}
+
+
+int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    int rc = FAILURE;
+    Timer timer;
+    MQTTCommandResult result;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    result.token = 0;
+    if (!c->isconnected) /* it can only go on the offline queue, where its outcome is not waited for */
+    {
+        if ((rc = publishNB(c, topicName, message, &timer, NULL, NULL)) >= 0)
+            rc = SUCCESS;
+        goto exit;
     }
+    if ((rc = publishNB(c, topicName, message, &timer, commandComplete, &result)) < 0)
+        goto exit;
+
+    if (message->qos == QOS1 || message->qos == QOS2)
+        rc = waitfor(c, rc, &result, &timer);
+    else
+        rc = SUCCESS;
 
 exit:
     if (rc == FAILURE)
-        MQTTCloseSession(c);
+        connectionLost(c);
+#if defined(MQTT_TASK)
+	  MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
+int MQTTPublishNB(MQTTClient* c, const char* topicName, MQTTMessage* message, commandHandler handler, void* context)
+{
+    int rc = FAILURE;
+
+#if defined(MQTT_TASK)
+	  MutexLock(&c->mutex);
+#endif
+    rc = publishNB(c, topicName, message, NULL, handler, context);
 #if defined(MQTT_TASK)
 	  MutexUnlock(&c->mutex);
 #endif
@@ -688,7 +1897,10 @@ int MQTTDisconnect(MQTTClient* c)
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-	  len = MQTTSerialize_disconnect(c->buf, c->buf_size);
+    c->batching = 0; /* write anything held back along with the disconnect */
+    while ((len = MQTTSerialize_disconnect(&c->buf[c->buf_queued], c->buf_size - c->buf_queued))
+            == MQTTPACKET_BUFFER_TOO_SHORT && makeRoom(c, &timer) == SUCCESS)
+        ;
     if (len > 0)
         rc = sendPacket(c, len, &timer);            // send the disconnect packet
     MQTTCloseSession(c);
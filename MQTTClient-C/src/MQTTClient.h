@@ -51,10 +51,18 @@
 #define MAX_MESSAGE_HANDLERS 5 /* redefinable - how many subscriptions do you want? */
 #endif
 
+#if !defined(MAX_PENDING_COMMANDS)
+#define MAX_PENDING_COMMANDS 5 /* redefinable - how many non-blocking requests can be awaiting their acks? */
+#endif
+
+#if !defined(MAX_INCOMING_QOS2_MESSAGES)
+#define MAX_INCOMING_QOS2_MESSAGES 10 /* redefinable - how many incoming QoS 2 messages can be awaiting PUBREL? */
+#endif
+
 enum QoS { QOS0, QOS1, QOS2, SUBFAIL=0x80 };
 
 /* all failure return codes must be negative */
-enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
+enum returnCode { QUEUE_FULL = -3, BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
 
 /* The Platform specific header must define the Network and Timer structures and functions
  * which operate on them.
@@ -102,11 +110,77 @@ typedef struct MQTTSubackData
 
 typedef void (*messageHandler)(MessageData*);
 
+/* socket readiness, as passed to MQTTClient_process.  Platforms which supply NetworkPoll use the same values. */
+enum MQTTEvents { MQTT_EVENT_READ = 1, MQTT_EVENT_WRITE = 2 };
+
+/* identifies a non-blocking request - always greater than 0 */
+typedef int MQTTToken;
+
+typedef struct MQTTCommandResult
+{
+    MQTTToken token;
+    int type;       /* the request packet type: CONNECT, PUBLISH, SUBSCRIBE or UNSUBSCRIBE */
+    int rc;         /* SUCCESS, FAILURE, or the connack return code for CONNECT */
+    union
+    {
+        MQTTConnackData connack;
+        MQTTSubackData suback;
+    } data;
+    void* context;
+} MQTTCommandResult;
+
+typedef void (*commandHandler)(MQTTCommandResult*);
+
+/* which message to discard when the offline queue is full */
+enum MQTTOfflinePolicy { MQTT_DROP_NEWEST, MQTT_DROP_OLDEST };
+
+/* the changes to in-flight state which are passed to an MQTTPersistence */
+enum MQTTPersistenceRecord
+{
+    PERSIST_PUBLISH = 1,        /* a QoS 1 or 2 PUBLISH packet was sent: data is the packet */
+    PERSIST_PUBREL,             /* a QoS 2 publish was PUBRECed, so only the PUBREL is to be resent */
+    PERSIST_PUBLISH_DONE,       /* the publish is complete, or has been given up */
+    PERSIST_INCOMING_QOS2,      /* an incoming QoS 2 message was delivered and PUBRECed */
+    PERSIST_INCOMING_QOS2_DONE  /* its PUBREL has arrived */
+};
+
+/* called by restore for each record of the state which is still live, oldest first */
+typedef void (*persistenceRestorer)(void* client, int type, unsigned short id, unsigned char* data, int len);
+
+/* somewhere to keep the in-flight state so that it survives a restart */
+typedef struct MQTTPersistence
+{
+    /* note an MQTTPersistenceRecord.  Called as messages flow, so it must not wait for the disk every
+     * time.  Returns 0 on success. */
+    int (*record)(void* context, int type, unsigned short id, unsigned char* data, int len);
+    /* call fn for each live record.  Returns 0 on success. */
+    int (*restore)(void* context, persistenceRestorer fn, void* client);
+    void* context;
+    /* optional, called from the client's timer path so that records are flushed to the disk when due
+     * even if no more are written.  With check_only, it only reports when that is, without waiting
+     * for the disk.  Returns the time in ms until it is next due, 0 if it is due now, or -1 if
+     * nothing is waiting. */
+    int (*sync)(void* context, int check_only);
+} MQTTPersistence;
+
+typedef struct MQTTOfflineStats
+{
+    size_t size;                /* the size of the queue buffer */
+    size_t bytes;               /* how much of it is in use */
+    int queued[3];              /* messages waiting to be sent, by QoS */
+    unsigned int dropped[3];    /* messages discarded because the queue was full, by QoS */
+} MQTTOfflineStats;
+
+/* reopens the network connection for an automatic reconnect: closes the old connection, then connects
+ * again.  Returns 0 when the network is connected. */
+typedef int (*networkReconnect)(Network*, void* context);
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
       command_timeout_ms;
     size_t buf_size,
+      buf_queued,     /* bytes at the start of buf which are waiting to be written */
       readbuf_size;
     unsigned char *buf,
       *readbuf;
@@ -119,19 +193,59 @@ typedef struct MQTTClient
     {
         const char* topicFilter;
         void (*fp) (MessageData*);
+        enum QoS qos;               /* the granted QoS, or SUBFAIL if not subscribed by this client */
     } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
 
     void (*defaultMessageHandler) (MessageData*);
 
+    struct PendingCommands
+    {
+        MQTTToken token;            /* 0 if the slot is free */
+        unsigned char type;         /* the request packet type */
+        unsigned char ack;          /* the packet type which completes the request */
+        Timer timer;
+        const char* topicFilter;
+        messageHandler fp;
+        commandHandler onComplete;
+        void* context;
+        unsigned char pubrel;       /* a QoS 2 publish which has been PUBRECed: resend PUBREL, not the PUBLISH */
+        size_t stored;              /* offset of the copy of the PUBLISH packet in storebuf */
+        int stored_len;             /* 0 if there is no copy */
+    } pendingCommands[MAX_PENDING_COMMANDS];      /* Requests awaiting acknowledgement, indexed by token */
+
     Network* ipstack;
-    Timer last_sent, last_received;
+    Timer last_sent, last_received, ping_timer;
+    MQTTTransport transport;    /* state of the packet being read, so that reads can be resumed */
+    Timer* read_timer;          /* bounds blocking reads, NULL when reading non-blocking */
+    int batching;               /* packets are held in buf until MQTTFlush or batch_timer expires */
+    Timer batch_timer;
+    networkReconnect reconnect;     /* NULL unless the client reconnects by itself */
+    void* reconnect_context;
+    int reconnecting;               /* 1 while waiting for reconnect_timer, 2 while waiting for the CONNACK */
+    Timer reconnect_timer;
+    unsigned int retry_interval_ms,
+      min_retry_ms,
+      max_retry_ms;
+    MQTTPacket_connectData connectData;    /* the options of the last connect, used to reconnect */
+    unsigned char* storebuf;        /* copies of the unacknowledged publishes, to resend after reconnecting */
+    size_t storebuf_size,
+      storebuf_used;
+    unsigned char* offlinebuf;      /* ring of the publishes made while disconnected, to send on connecting */
+    size_t offlinebuf_size,
+      offline_head,                 /* offset of the oldest entry */
+      offline_used;
+    int offline_policy;             /* an MQTTOfflinePolicy */
+    int offline_limit[3];           /* the most messages of each QoS to queue, negative for no limit */
+    MQTTOfflineStats offline_stats;
+    unsigned short incomingQoS2[MAX_INCOMING_QOS2_MESSAGES];   /* ids delivered and awaiting PUBREL, 0 if free */
+    MQTTPersistence* persistence;
 #if defined(MQTT_TASK)
     Mutex mutex;
     Thread thread;
 #endif
 } MQTTClient;
 
-#define DefaultClient {0, 0, 0, 0, NULL, NULL, 0, 0, 0}
+#define DefaultClient {0, 0, 0, 0, 0, NULL, NULL, 0, 0, 0}
 
 
 /**
@@ -218,6 +332,172 @@ DLLExport int MQTTYield(MQTTClient* client, int time);
  */
 DLLExport int MQTTIsConnected(MQTTClient* client);
 
+/** MQTT BeginBatch - hold back the packets which follow in the send buffer, so that a burst of
+ *  small publishes is written with one call to the network rather than one call each.
+ *  The batch is written by MQTTFlush, when the send buffer has no room for the next packet, when
+ *  timeout_ms has passed, or when waiting for an ack, so it should be at most one send buffer long.
+ *  @param client - the client object to use
+ *  @param timeout_ms - the longest time to hold a packet back, in milliseconds
+ *  @return success code
+ */
+DLLExport int MQTTBeginBatch(MQTTClient* client, int timeout_ms);
+
+/** MQTT Flush - end the batch started by MQTTBeginBatch, and write out the packets in it
+ *  @param client - the client object to use
+ *  @return success code - FAILURE if the batch could not be written within the command timeout
+ */
+DLLExport int MQTTFlush(MQTTClient* client);
+
+/** MQTT SetAutoReconnect - reconnect by itself when the connection is lost, rather than leaving it to
+ *  the application.  Attempts are spaced by an exponential backoff from min_retry_ms to max_retry_ms,
+ *  each delay picked at random between half and all of the interval so that many clients dropped
+ *  together do not all come back at once.  The client connects again with the options of the last
+ *  MQTTConnect, so the strings in them must stay valid.  If the server has no session for the client,
+ *  all the message handlers are subscribed again, several topics to a SUBSCRIBE packet.  QoS 1 and 2
+ *  publishes which had not been acknowledged are resent with the DUP flag set, from copies kept in
+ *  storebuf, so a blocking MQTTPublish which fails because the connection was lost may still complete.
+ *  While the connection is down, MQTTYield and MQTTClient_process return FAILURE without waiting until
+ *  the next attempt is due: MQTTNextTimeoutMs includes it.  The socket may change after a reconnect.
+ *  MQTTDisconnect ends reconnecting, and fails the unacknowledged publishes.
+ *  @param client - the client object to use
+ *  @param reconnect - closes the network and connects it again, NULL to turn automatic reconnect off
+ *  @param context - passed to reconnect
+ *  @param storebuf - holds the copies of unacknowledged QoS 1 and 2 publishes.  When it is full,
+ *  such publishes fail with QUEUE_FULL.  NULL not to resend publishes.
+ *  @param storebuf_size - the size of storebuf
+ *  @param min_retry_ms - the interval before the first attempt to reconnect
+ *  @param max_retry_ms - the longest interval between attempts
+ */
+DLLExport void MQTTSetAutoReconnect(MQTTClient* client, networkReconnect reconnect, void* context,
+    unsigned char* storebuf, size_t storebuf_size, unsigned int min_retry_ms, unsigned int max_retry_ms);
+
+/** MQTT SetOfflineQueue - keep the publishes made while the client is not connected, rather than
+ *  failing them, in a fixed size ring of serialized packets.  When the connection is made, they are
+ *  copied into the send buffer, as many as fit, and written together.  QoS 1 and 2 messages wait for
+ *  a free pending command slot, so that their acks are tracked like any other publish.  MQTTPublish
+ *  returns SUCCESS as soon as the message is queued, MQTTPublishNB its token.  When a message is
+ *  discarded, the command handler it was published with is called with FAILURE.
+ *  @param client - the client object to use
+ *  @param buf - the memory for the queue, NULL to stop queueing
+ *  @param size - the size of buf.  Each message takes the length of its PUBLISH packet plus a few words.
+ *  @param policy - MQTT_DROP_NEWEST to fail a publish which does not fit with QUEUE_FULL, or
+ *  MQTT_DROP_OLDEST to discard the oldest messages to make room for it
+ *  @param max_qos0 - the most QoS 0 messages to queue, 0 not to queue them, negative for no limit
+ *  @param max_qos1 - the most QoS 1 messages to queue, 0 not to queue them, negative for no limit
+ *  @param max_qos2 - the most QoS 2 messages to queue, 0 not to queue them, negative for no limit
+ */
+DLLExport void MQTTSetOfflineQueue(MQTTClient* client, unsigned char* buf, size_t size,
+    enum MQTTOfflinePolicy policy, int max_qos0, int max_qos1, int max_qos2);
+
+/** MQTT SetPersistence - keep the in-flight state somewhere which survives a restart: the
+ *  unacknowledged QoS 1 and 2 publishes, and the ids of incoming QoS 2 messages awaiting PUBREL, so
+ *  that they are neither lost nor delivered twice.  Any state already kept is restored into the
+ *  client, to be resent when it connects, so call this after MQTTSetAutoReconnect has supplied the
+ *  store buffer, and before connecting.  Only as many publishes as there are pending command slots
+ *  are restored.
+ *  @param client - the client object to use
+ *  @param persistence - the store to use, NULL for none
+ *  @return the number of records restored, or failure code
+ */
+DLLExport int MQTTSetPersistence(MQTTClient* client, MQTTPersistence* persistence);
+
+/** MQTT GetOfflineStats - how full the offline queue is, and how many messages have been dropped
+ *  @param client - the client object to use
+ *  @param stats - filled in with the counts
+ */
+DLLExport void MQTTGetOfflineStats(MQTTClient* client, MQTTOfflineStats* stats);
+
+/* Non-blocking API.  Each of these calls queues its request in the send buffer, writes as much
+ * as the socket will take without waiting, and returns at once with a token or a negative failure
+ * code.  QUEUE_FULL means that there is no room in the send buffer until more has been written:
+ * call MQTTClient_process when the socket is writable and try again.  When the ack arrives, or
+ * the command timeout expires, the command handler is called from within MQTTClient_process
+ * with the outcome.
+ */
+
+/** MQTT Connect - send an MQTT connect packet without waiting for the Connack
+ *  The nework object must be connected to the network endpoint before calling this
+ *  @param client - the client object to use
+ *  @param options - connect options, or NULL for the defaults
+ *  @param handler - called with the connack data when the request completes, can be NULL
+ *  @param context - passed to the handler in the result
+ *  @return token, or failure code
+ */
+DLLExport int MQTTConnectNB(MQTTClient* client, MQTTPacket_connectData* options, commandHandler handler, void* context);
+
+/** MQTT Publish - send an MQTT publish packet without waiting for its acks.  As there are no acks
+ *  for QoS 0, the handler is not called for those messages.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send.  It is serialized immediately, so need not be kept.
+ *  @param handler - called when the PUBACK or PUBCOMP arrives, can be NULL
+ *  @param context - passed to the handler in the result
+ *  @return token, or failure code
+ */
+DLLExport int MQTTPublishNB(MQTTClient* client, const char*, MQTTMessage*, commandHandler handler, void* context);
+
+/** MQTT Subscribe - send an MQTT subscribe packet without waiting for the suback.
+ *  The message handler is set when the suback arrives.
+ *  @param client - the client object to use
+ *  @param topicFilter - the topic filter to subscribe to
+ *  @param handler - called with the granted QoS when the request completes, can be NULL
+ *  @param context - passed to the handler in the result
+ *  @return token, or failure code
+ */
+DLLExport int MQTTSubscribeNB(MQTTClient* client, const char* topicFilter, enum QoS, messageHandler,
+    commandHandler handler, void* context);
+
+/** MQTT Unsubscribe - send an MQTT unsubscribe packet without waiting for the unsuback.
+ *  @param client - the client object to use
+ *  @param topicFilter - the topic filter to unsubscribe from
+ *  @param handler - called when the request completes, can be NULL
+ *  @param context - passed to the handler in the result
+ *  @return token, or failure code
+ */
+DLLExport int MQTTUnsubscribeNB(MQTTClient* client, const char* topicFilter, commandHandler handler, void* context);
+
+/** MQTT Process - do the work made possible by the socket being ready, without blocking.
+ *  Reads and handles all the packets available, resuming any partially read packet, then
+ *  expires timed out requests and maintains the keepalive.  Call this whenever the socket is
+ *  readable, and at least once a second otherwise.  Only pass MQTT_EVENT_READ when the socket
+ *  has been reported readable: reading nothing then means the connection has been closed.
+ *  With MQTT_EVENT_WRITE, the rest of the send queue is written.
+ *  @param client - the client object to use
+ *  @param events - the MQTTEvents the socket is ready for, or 0 just to service the timers
+ *  @return success code - on failure, the connection has been lost
+ */
+DLLExport int MQTTClient_process(MQTTClient* client, int events);
+
+/** MQTT WantsWrite - whether the client has queued data waiting for the socket to become
+ *  writable, so that MQTT_EVENT_WRITE should be waited for as well as MQTT_EVENT_READ.
+ *  @param client - the client object to use
+ *  @return truth value
+ */
+DLLExport int MQTTWantsWrite(MQTTClient* client);
+
+/** MQTT NextTimeoutMs - the time until MQTTClient_process next has timer work to do: a keepalive
+ *  ping to send, a batch to write, a PINGRESP or ack to time out, persisted records to sync.  Use
+ *  it as the timeout for poll, epoll_wait etc.
+ *  @param client - the client object to use
+ *  @return the time in milliseconds, 0 if the work is due now, or -1 if nothing is scheduled
+ */
+DLLExport int MQTTNextTimeoutMs(MQTTClient* client);
+
+#if defined(MQTTCLIENT_NETWORK_POLL)
+/** MQTT GetFd - the socket descriptor to register with an event loop
+ *  @param client - the client object to use
+ *  @return the file descriptor
+ */
+DLLExport int MQTTGetFd(MQTTClient* client);
+
+/** MQTT ProcessIO - check which events the socket is ready for, without waiting, and
+ *  do only the work which that allows, plus any timer work which is due.
+ *  @param client - the client object to use
+ *  @return success code - on failure, the connection has been lost
+ */
+DLLExport int MQTTProcessIO(MQTTClient* client);
+#endif
+
 #if defined(MQTT_TASK)
 /** MQTT start background thread for a client.  After this, MQTTYield should not be called.
 *  @param client - the client object to use
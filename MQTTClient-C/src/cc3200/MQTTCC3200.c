@@ -44,6 +44,13 @@ int left_ms(Timer* timer) {
 }
 
 
+/* there is no thread to yield to, so wait for the systick to pass the end time */
+void TimerWait(Timer* timer) {
+	while (!expired(timer))
+		;
+}
+
+
 void InitTimer(Timer* timer) {
 	timer->end_time = 0;
 }
@@ -44,6 +44,7 @@ char expired(Timer*);
 void countdown_ms(Timer*, unsigned int);
 void countdown(Timer*, unsigned int);
 int left_ms(Timer*);
+void TimerWait(Timer*); /* block until the timer expires */
 
 void InitTimer(Timer*);
 
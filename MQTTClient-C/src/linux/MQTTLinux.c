@@ -15,6 +15,11 @@
  *    Ian Craggs - return codes from linux_read
  *******************************************************************************/
 
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for struct ucred */
+#endif
+
+#include <stddef.h>
 #include "MQTTLinux.h"
 
 void TimerInit(Timer* timer)
@@ -59,6 +64,20 @@ int TimerLeftMS(Timer* timer)
 }
 
 
+void TimerWait(Timer* timer)
+{
+	struct timeval now, res;
+	gettimeofday(&now, NULL);
+	timersub(&timer->end_time, &now, &res);
+	if (res.tv_sec >= 0)
+	{
+		struct timespec ts = {res.tv_sec, res.tv_usec * 1000};
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+}
+
+
 int linux_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
 {
 	struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
@@ -82,25 +101,36 @@ int linux_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
 		}
 		else if (rc == 0)
 		{
-			bytes = 0;
+			bytes = -1; /* the connection has been closed */
 			break;
 		}
 		else
 			bytes += rc;
 	}
+#if defined(TCP_QUICKACK)
+	if (n->quickack)
+	{
+		int opt = 1;
+		setsockopt(n->my_socket, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+	}
+#endif
 	return bytes;
 }
 
 
+/* returns -1 on error, or the number of bytes written, which is 0 if the socket is full */
 int linux_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
 {
-	struct timeval tv;
-
-	tv.tv_sec = 0;  /* 30 Secs Timeout */
-	tv.tv_usec = timeout_ms * 1000;  // Not init'ing this can cause strange errors
+	struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+	int flags = 0;
 
-	setsockopt(n->my_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv,sizeof(struct timeval));
-	int	rc = write(n->my_socket, buffer, len);
+	if (timeout_ms > 0)
+		setsockopt(n->my_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv,sizeof(struct timeval));
+	else
+		flags = MSG_DONTWAIT; /* write only what the socket will take now */
+	int	rc = send(n->my_socket, buffer, len, flags);
+	if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		rc = 0;
 	return rc;
 }
 
@@ -109,57 +139,384 @@ void NetworkInit(Network* n)
 {
 	signal(SIGPIPE, SIG_IGN);
 	n->my_socket = 0;
+	n->quickack = 0;
 	n->mqttread = linux_read;
 	n->mqttwrite = linux_write;
 }
 
 
+/* set one socket option if it is wanted, returning -1 if it could not be set */
+static int setOption(int sock, int level, int name, int value)
+{
+	if (value == 0)
+		return 0;
+	return setsockopt(sock, level, name, &value, sizeof(value));
+}
+
+
+/* options which this platform does not have are ignored */
+static int setOptions(int sock, NetworkOptions* options)
+{
+	int rc = 0;
+
+	rc |= setOption(sock, IPPROTO_TCP, TCP_NODELAY, options->nodelay);
+	rc |= setOption(sock, SOL_SOCKET, SO_SNDBUF, options->sndbuf);
+	rc |= setOption(sock, SOL_SOCKET, SO_RCVBUF, options->rcvbuf);
+#if defined(TCP_QUICKACK)
+	rc |= setOption(sock, IPPROTO_TCP, TCP_QUICKACK, options->quickack);
+#endif
+#if defined(SO_BUSY_POLL)
+	rc |= setOption(sock, SOL_SOCKET, SO_BUSY_POLL, options->busy_poll_us);
+#endif
+#if defined(TCP_USER_TIMEOUT)
+	rc |= setOption(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, options->user_timeout_ms);
+#endif
+	if (options->keepalive_idle_s > 0)
+	{
+		rc |= setOption(sock, SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+		rc |= setOption(sock, IPPROTO_TCP, TCP_KEEPIDLE, options->keepalive_idle_s);
+		rc |= setOption(sock, IPPROTO_TCP, TCP_KEEPINTVL, options->keepalive_interval_s);
+		rc |= setOption(sock, IPPROTO_TCP, TCP_KEEPCNT, options->keepalive_count);
+#endif
+	}
+	return rc;
+}
+
+
+/* start a non-blocking connect: returns the socket, or -1 if this address has failed already */
+static int startConnect(struct addrinfo* address, NetworkOptions* options, int* connected)
+{
+	int sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+	if (sock == -1)
+		return -1;
+	/* options before connect, so that the buffer sizes set the window */
+	if (setOptions(sock, options) != 0 || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+	{
+		close(sock);
+		return -1;
+	}
+	*connected = (connect(sock, address->ai_addr, address->ai_addrlen) == 0);
+	if (!*connected && errno != EINPROGRESS)
+	{
+		close(sock);
+		sock = -1;
+	}
+	return sock;
+}
+
+
+static int isUnixAddress(const char* addr)
+{
+	return strncmp(addr, NETWORK_UNIX_PREFIX, sizeof(NETWORK_UNIX_PREFIX) - 1) == 0;
+}
+
+
+/* a server on this host, with no TCP/IP.  A connect waits only if the server's listen backlog is full,
+ * for at most SO_SNDTIMEO, which is set to the connect timeout */
+static int connectUnix(Network* n, const char* path, NetworkOptions* options)
+{
+	struct sockaddr_un address;
+	size_t pathlen = strlen(path);
+	int timeout_ms = (options->connect_timeout_ms > 0) ? options->connect_timeout_ms : 30000;
+	struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+	socklen_t len;
+	int sock;
+
+	if (pathlen == 0 || pathlen >= sizeof(address.sun_path))
+		return -1;
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path, pathlen);
+	if (path[0] == '@')
+		address.sun_path[0] = '\0'; /* the abstract namespace, whose names are not null terminated */
+	len = offsetof(struct sockaddr_un, sun_path) + pathlen + (path[0] != '@');
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (setOption(sock, SOL_SOCKET, SO_SNDBUF, options->sndbuf) != 0 ||
+		setOption(sock, SOL_SOCKET, SO_RCVBUF, options->rcvbuf) != 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv)) != 0 ||
+		connect(sock, (struct sockaddr*)&address, len) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	n->my_socket = sock;
+	n->quickack = 0;
+	return 0;
+}
+
+
+int NetworkPeerCredentials(Network* n, pid_t* pid, uid_t* uid, gid_t* gid)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	/* a TCP socket has no credentials, which it returns as a pid of 0 */
+	if (getsockopt(n->my_socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.pid == 0)
+		return -1;
+	if (pid)
+		*pid = cred.pid;
+	if (uid)
+		*uid = cred.uid;
+	if (gid)
+		*gid = cred.gid;
+	return 0;
+}
+
+
 int NetworkConnect(Network* n, char* addr, int port)
 {
-	int type = SOCK_STREAM;
-	struct sockaddr_in address;
-	int rc = -1;
-	sa_family_t family = AF_INET;
-	struct addrinfo *result = NULL;
-	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	NetworkOptions options = NetworkOptions_initializer;
+
+	return NetworkConnectWithOptions(n, addr, port, &options);
+}
+
+
+/* RFC 8305 ordering: alternate the address families, starting with the one that getaddrinfo prefers */
+static int orderAddresses(struct addrinfo* result, struct addrinfo** addresses)
+{
+	struct addrinfo* preferred[NETWORK_MAX_ADDRESSES];
+	struct addrinfo* other[NETWORK_MAX_ADDRESSES];
+	struct addrinfo* res;
+	int npreferred = 0, nother = 0, count = 0, i;
 
-	if ((rc = getaddrinfo(addr, NULL, &hints, &result)) == 0)
+	for (res = result; res; res = res->ai_next)
 	{
-		struct addrinfo* res = result;
+		if (res->ai_family == result->ai_family)
+		{
+			if (npreferred < NETWORK_MAX_ADDRESSES)
+				preferred[npreferred++] = res;
+		}
+		else if (nother < NETWORK_MAX_ADDRESSES)
+			other[nother++] = res;
+	}
+	for (i = 0; i < npreferred || i < nother; ++i)
+	{
+		if (i < npreferred && count < NETWORK_MAX_ADDRESSES)
+			addresses[count++] = preferred[i];
+		if (i < nother && count < NETWORK_MAX_ADDRESSES)
+			addresses[count++] = other[i];
+	}
+	return count;
+}
+
+
+static int resolve(char* addr, int port, struct addrinfo** result)
+{
+	struct addrinfo hints = {AI_NUMERICSERV, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	char service[8];
 
-		/* prefer ip4 addresses */
-		while (res)
+	snprintf(service, sizeof(service), "%d", port);
+	return getaddrinfo(addr, service, &hints, result) == 0 ? 0 : -1;
+}
+
+
+/* Happy Eyeballs (RFC 8305): start a connect to each address in turn, without waiting for the one
+ * before to fail for longer than NETWORK_CONNECT_ATTEMPT_DELAY_MS, and keep the first to succeed */
+static int connectAddresses(Network* n, struct addrinfo* result, NetworkOptions* options)
+{
+	struct addrinfo* addresses[NETWORK_MAX_ADDRESSES];
+	struct pollfd fds[NETWORK_MAX_ADDRESSES];
+	int count = orderAddresses(result, addresses), started = 0, pending = 0;
+	int sock = -1;
+	Timer deadline, next_attempt;
+	int i;
+
+	TimerInit(&deadline);
+	TimerCountdownMS(&deadline, (options->connect_timeout_ms > 0) ? options->connect_timeout_ms : 30000);
+	TimerInit(&next_attempt);
+	while (sock == -1 && (started < count || pending > 0) && !TimerIsExpired(&deadline))
+	{
+		int wait_ms = TimerLeftMS(&deadline);
+
+		if (started < count && (pending == 0 || TimerIsExpired(&next_attempt)))
 		{
-			if (res->ai_family == AF_INET)
+			int connected = 0;
+			int attempt = startConnect(addresses[started++], options, &connected);
+
+			if (connected)
+				sock = attempt;
+			else if (attempt != -1)
 			{
-				result = res;
-				break;
+				fds[pending].fd = attempt;
+				fds[pending].events = POLLOUT;
+				fds[pending++].revents = 0;
+				TimerCountdownMS(&next_attempt, NETWORK_CONNECT_ATTEMPT_DELAY_MS);
 			}
-			res = res->ai_next;
+			else
+				TimerInit(&next_attempt); /* failed already, so go straight on to the next */
+			continue;
 		}
-
-		if (result->ai_family == AF_INET)
+		if (started < count && TimerLeftMS(&next_attempt) < wait_ms)
+			wait_ms = TimerLeftMS(&next_attempt);
+		if (poll(fds, pending, wait_ms) == -1 && errno != EINTR)
+			break;
+		for (i = 0; i < pending && sock == -1; ++i)
 		{
-			address.sin_port = htons(port);
-			address.sin_family = family = AF_INET;
-			address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
+			int error = 0;
+			socklen_t len = sizeof(error);
+
+			if (fds[i].revents == 0)
+				continue;
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+				sock = fds[i].fd;
+			else
+				close(fds[i].fd);
+			fds[i--] = fds[--pending]; /* this attempt has finished */
 		}
-		else
-			rc = -1;
+		if (sock == -1 && pending == 0)
+			TimerInit(&next_attempt); /* they have all failed, so start the next one now */
+	}
+	for (i = 0; i < pending; ++i)
+		close(fds[i].fd);
+
+	if (sock == -1)
+		return -1;
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK); /* the read and write timeouts rely on blocking mode */
+	n->my_socket = sock;
+	n->quickack = options->quickack;
+	return 0;
+}
+
 
+int NetworkConnectWithOptions(Network* n, char* addr, int port, NetworkOptions* options)
+{
+	struct addrinfo* result = NULL;
+	int rc;
+
+	if (isUnixAddress(addr))
+		return connectUnix(n, addr + sizeof(NETWORK_UNIX_PREFIX) - 1, options);
+	if ((rc = resolve(addr, port, &result)) == 0)
+	{
+		rc = connectAddresses(n, result, options);
 		freeaddrinfo(result);
 	}
+	return rc;
+}
+
+
+void NetworkEndpointsInit(NetworkEndpoints* e, int dns_ttl_s)
+{
+	e->count = 0;
+	e->current = -1;
+	e->dns_ttl_s = dns_ttl_s;
+}
+
+
+int NetworkEndpointsAdd(NetworkEndpoints* e, char* host, int port)
+{
+	NetworkEndpoint* endpoint = &e->endpoints[e->count];
 
-	if (rc == 0)
+	if (e->count == NETWORK_MAX_ENDPOINTS)
+		return -1;
+	endpoint->host = host;
+	endpoint->port = port;
+	endpoint->addresses = NULL;
+	endpoint->rtt_ms = 0;
+	endpoint->failures = 0;
+	TimerInit(&endpoint->retry);
+	return e->count++;
+}
+
+
+void NetworkEndpointsFree(NetworkEndpoints* e)
+{
+	int i;
+
+	for (i = 0; i < e->count; ++i)
 	{
-		n->my_socket = socket(family, type, 0);
-		if (n->my_socket != -1)
-			rc = connect(n->my_socket, (struct sockaddr*)&address, sizeof(address));
-		else
-			rc = -1;
+		if (e->endpoints[i].addresses)
+			freeaddrinfo(e->endpoints[i].addresses);
+		e->endpoints[i].addresses = NULL;
 	}
+}
 
-	return rc;
+
+/* the healthy endpoint with the lowest connect time, or if none is healthy, the one which will be soonest */
+static int chooseEndpoint(NetworkEndpoints* e, int* tried)
+{
+	int best = -1, best_wait = 0, i;
+
+	for (i = 0; i < e->count; ++i)
+	{
+		NetworkEndpoint* endpoint = &e->endpoints[i];
+		int wait = TimerLeftMS(&endpoint->retry);
+
+		if (tried[i])
+			continue;
+		if (best == -1 || wait < best_wait || (wait == best_wait && endpoint->rtt_ms < e->endpoints[best].rtt_ms))
+		{
+			best = i;
+			best_wait = wait;
+		}
+	}
+	return best;
+}
+
+
+/* cached addresses are used until the TTL expires, and after that too if the name can't be resolved */
+static struct addrinfo* endpointAddresses(NetworkEndpoints* e, NetworkEndpoint* endpoint)
+{
+	if (endpoint->addresses == NULL || TimerIsExpired(&endpoint->expires))
+	{
+		struct addrinfo* result = NULL;
+
+		if (resolve(endpoint->host, endpoint->port, &result) == 0)
+		{
+			if (endpoint->addresses)
+				freeaddrinfo(endpoint->addresses);
+			endpoint->addresses = result;
+			TimerCountdown(&endpoint->expires, e->dns_ttl_s);
+		}
+	}
+	return endpoint->addresses;
+}
+
+
+int NetworkConnectEndpoints(Network* n, NetworkEndpoints* e, NetworkOptions* options)
+{
+	int tried[NETWORK_MAX_ENDPOINTS] = {0};
+	int i;
+
+	e->current = -1;
+	while ((i = chooseEndpoint(e, tried)) >= 0)
+	{
+		NetworkEndpoint* endpoint = &e->endpoints[i];
+		struct timeval start, now, res;
+		int connected;
+
+		tried[i] = 1;
+		gettimeofday(&start, NULL);
+		if (isUnixAddress(endpoint->host))
+			connected = (connectUnix(n, endpoint->host + sizeof(NETWORK_UNIX_PREFIX) - 1, options) == 0);
+		else
+		{
+			struct addrinfo* addresses = endpointAddresses(e, endpoint);
+
+			connected = (addresses && connectAddresses(n, addresses, options) == 0);
+		}
+		if (connected)
+		{
+			int rtt;
+
+			gettimeofday(&now, NULL);
+			timersub(&now, &start, &res);
+			rtt = res.tv_sec * 1000 + res.tv_usec / 1000 + 1; /* never 0, which means untried */
+
+			endpoint->rtt_ms = (endpoint->failures > 0 || endpoint->rtt_ms == 0) ? rtt : (7 * endpoint->rtt_ms + rtt) / 8;
+			endpoint->failures = 0;
+			e->current = i;
+			return 0;
+		}
+		/* back off exponentially from a failing endpoint, up to about a minute */
+		if (endpoint->failures < 7)
+			++endpoint->failures;
+		TimerCountdownMS(&endpoint->retry, 1000 << (endpoint->failures - 1));
+	}
+	return -1;
 }
 
 
@@ -167,3 +524,32 @@ void NetworkDisconnect(Network* n)
 {
 	close(n->my_socket);
 }
+
+
+int NetworkGetFd(Network* n)
+{
+	return n->my_socket;
+}
+
+
+int NetworkPoll(Network* n, int events, int timeout_ms)
+{
+	struct pollfd pfd = {n->my_socket, 0, 0};
+	int rc;
+
+	if (events & 1) /* MQTT_EVENT_READ */
+		pfd.events |= POLLIN;
+	if (events & 2) /* MQTT_EVENT_WRITE */
+		pfd.events |= POLLOUT;
+
+	if ((rc = poll(&pfd, 1, timeout_ms)) > 0)
+	{
+		rc = 0;
+		/* errors and hangups are reported as readable, so that the read finds them */
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			rc |= 1;
+		if (pfd.revents & POLLOUT)
+			rc |= 2;
+	}
+	return rc;
+}
@@ -32,7 +32,9 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/select.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -41,6 +43,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -56,19 +59,122 @@ char TimerIsExpired(Timer*);
 void TimerCountdownMS(Timer*, unsigned int);
 void TimerCountdown(Timer*, unsigned int);
 int TimerLeftMS(Timer*);
+void TimerWait(Timer*); /* block until the timer expires */
 
 typedef struct Network
 {
 	int my_socket;
 	int (*mqttread) (struct Network*, unsigned char*, int, int);
 	int (*mqttwrite) (struct Network*, unsigned char*, int, int);
+	int quickack;	/* TCP_QUICKACK has to be set again after each read */
 } Network;
 
+/* socket options for NetworkConnectWithOptions.  0 leaves the system default.  The connect fails
+ * if an option can't be set: SO_BUSY_POLL, for instance, can need CAP_NET_ADMIN. */
+typedef struct NetworkOptions
+{
+	int nodelay;              /* TCP_NODELAY: write small packets at once rather than waiting for acks (Nagle) */
+	int quickack;             /* TCP_QUICKACK: ack incoming data at once rather than delaying the ack */
+	int sndbuf;               /* SO_SNDBUF, in bytes */
+	int rcvbuf;               /* SO_RCVBUF, in bytes */
+	int busy_poll_us;         /* SO_BUSY_POLL: time to busy wait for data on a blocking read */
+	int user_timeout_ms;      /* TCP_USER_TIMEOUT: how long written data can stay unacked before the connection fails */
+	int keepalive_idle_s;     /* TCP keepalive probes start after this much idle time... */
+	int keepalive_interval_s; /* ...are sent this often... */
+	int keepalive_count;      /* ...and this many can be unanswered before the connection fails */
+	int connect_timeout_ms;   /* time allowed for the TCP connect to all the addresses, 0 for 30 seconds */
+} NetworkOptions;
+
+#define NetworkOptions_initializer {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+
+#if !defined(NETWORK_MAX_ADDRESSES)
+#define NETWORK_MAX_ADDRESSES 16 /* addresses of a host name which are tried in a connect */
+#endif
+#if !defined(NETWORK_CONNECT_ATTEMPT_DELAY_MS)
+#define NETWORK_CONNECT_ATTEMPT_DELAY_MS 250 /* RFC 8305: before starting the connect to the next address */
+#endif
+
 int linux_read(Network*, unsigned char*, int, int);
 int linux_write(Network*, unsigned char*, int, int);
 
+/* an address of "unix:" followed by a path connects to a server on this host over a unix domain socket,
+ * without TCP/IP, and the port is not used.  "unix:@name" is a name in the Linux abstract namespace.
+ * Of the NetworkOptions, only the buffer sizes and the connect timeout apply. */
+#define NETWORK_UNIX_PREFIX "unix:"
+
 DLLExport void NetworkInit(Network*);
 DLLExport int NetworkConnect(Network*, char*, int);
+DLLExport int NetworkConnectWithOptions(Network*, char*, int, NetworkOptions*);
+/* the process, user and group of the other end of a unix domain socket, from SO_PEERCRED.  Any of
+ * them can be NULL.  Returns 0 on success, -1 on error, which it is for a TCP connection */
+DLLExport int NetworkPeerCredentials(Network*, pid_t* pid, uid_t* uid, gid_t* gid);
+
+#if !defined(NETWORK_MAX_ENDPOINTS)
+#define NETWORK_MAX_ENDPOINTS 4
+#endif
+
+typedef struct NetworkEndpoint
+{
+	char* host;
+	int port;
+	struct addrinfo* addresses;  /* resolved addresses, NULL until the first connect */
+	Timer expires;               /* when the addresses are to be resolved again */
+	int rtt_ms;                  /* smoothed time to connect, 0 until the first connect */
+	int failures;                /* connects which have failed since the last one to succeed */
+	Timer retry;                 /* a failed endpoint is tried only after the others until this expires */
+} NetworkEndpoint;
+
+/* a set of servers to connect to, such as the nodes of a cluster */
+typedef struct NetworkEndpoints
+{
+	NetworkEndpoint endpoints[NETWORK_MAX_ENDPOINTS];
+	int count;
+	int current;                 /* the endpoint of the last successful connect, or -1 */
+	int dns_ttl_s;               /* how long resolved addresses are used for */
+} NetworkEndpoints;
+
+DLLExport void NetworkEndpointsInit(NetworkEndpoints*, int dns_ttl_s);
+/* the host name is not copied, so must be kept.  Returns the index of the endpoint, or -1 if the set is full */
+DLLExport int NetworkEndpointsAdd(NetworkEndpoints*, char* host, int port);
+DLLExport void NetworkEndpointsFree(NetworkEndpoints*);
+/* connect to the endpoint with the lowest connect time which has not failed recently, trying the others in turn.
+ * An endpoint's host can be a "unix:" address */
+DLLExport int NetworkConnectEndpoints(Network*, NetworkEndpoints*, NetworkOptions*);
 DLLExport void NetworkDisconnect(Network*);
 
+/* an append-only log of the client's in-flight state, in a memory mapped file, for MQTTSetPersistence.
+ * Records are copied into the mapping, so nothing is lost if the process dies.  The file is synced at
+ * most every sync_interval_ms: as records are written, and from the client's timer path through
+ * PersistenceLogTimer, so a system crash loses at most that long's.
+ * When the file is full, the live records are copied to a new file, which replaces it. */
+typedef struct PersistenceLog
+{
+	int fd;
+	char* path;
+	unsigned char* base;    /* the mapping of the whole file */
+	size_t size;
+	size_t end;             /* where the next record goes */
+	unsigned int seq;       /* the sequence number of the next record */
+	int sync_interval_ms;   /* 0 to sync after every record */
+	Timer sync_timer;
+	int unsynced;           /* records written since the last sync */
+} PersistenceLog;
+
+/* open the log, restoring what it holds, or create it with the given size.  Returns 0 on success */
+DLLExport int PersistenceLogOpen(PersistenceLog*, const char* path, size_t size, int sync_interval_ms);
+/* the MQTTPersistence record, restore and sync functions, with the PersistenceLog as the context */
+DLLExport int PersistenceLogRecord(void* log, int type, unsigned short id, unsigned char* data, int len);
+DLLExport int PersistenceLogRestore(void* log, void (*fn)(void* client, int type, unsigned short id,
+	unsigned char* data, int len), void* client);
+DLLExport int PersistenceLogTimer(void* log, int check_only);
+DLLExport int PersistenceLogSync(PersistenceLog*);
+DLLExport void PersistenceLogClose(PersistenceLog*);
+
+/* event loop integration: this platform supplies MQTTGetFd and MQTTProcessIO */
+#define MQTTCLIENT_NETWORK_POLL 1
+
+DLLExport int NetworkGetFd(Network*);
+/* events and the return value are combinations of MQTT_EVENT_READ (1) and MQTT_EVENT_WRITE (2), or -1 on error */
+DLLExport int NetworkPoll(Network*, int events, int timeout_ms);
+
 #endif
@@ -0,0 +1,325 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTClient.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* each record is this header followed by len bytes of data */
+typedef struct
+{
+	unsigned int seq;       /* one more than the record before, so stale records are not taken for new ones */
+	unsigned int check;     /* FNV-1a hash of the header, with this field 0, and the data */
+	unsigned int len;
+	unsigned short id;
+	unsigned short type;
+} LogRecord;
+
+
+static unsigned int hash(unsigned int h, const unsigned char* data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		h = (h ^ data[i]) * 16777619u;
+	return h;
+}
+
+
+static unsigned int checksum(LogRecord* r, const unsigned char* data)
+{
+	LogRecord copy = *r;
+
+	copy.check = 0;
+	return hash(hash(2166136261u, (unsigned char*)&copy, sizeof(copy)), data, r->len);
+}
+
+
+/* is there a whole record at pos, following the one numbered seq - 1?  first accepts any number */
+static int readRecord(PersistenceLog* log, size_t pos, unsigned int seq, int first, LogRecord* r)
+{
+	if (log->size - pos < sizeof(LogRecord))
+		return 0;
+	memcpy(r, &log->base[pos], sizeof(LogRecord));
+	if ((!first && r->seq != seq) || r->len > log->size - pos - sizeof(LogRecord))
+		return 0;
+	return checksum(r, &log->base[pos + sizeof(LogRecord)]) == r->check;
+}
+
+
+static void appendRecord(PersistenceLog* log, int type, unsigned short id, unsigned char* data, int len)
+{
+	LogRecord r;
+
+	r.seq = log->seq++;
+	r.check = 0;
+	r.len = len;
+	r.id = id;
+	r.type = (unsigned short)type;
+	memcpy(&log->base[log->end + sizeof(r)], data, len);
+	r.check = checksum(&r, &log->base[log->end + sizeof(r)]);
+	memcpy(&log->base[log->end], &r, sizeof(r));
+	log->end += sizeof(r) + len;
+}
+
+
+/**
+ * Call fn for each record which is still live, in the order they were written.  A publish which has
+ * been PUBRECed is passed as its PUBREL record.
+ */
+static int forEachLive(PersistenceLog* log, void (*fn)(void* context, LogRecord* r, unsigned char* data), void* context)
+{
+	unsigned int* latest; /* offset + 1 of the record which makes each publish, then each incoming id, live */
+	unsigned char* pubrel;
+	size_t pos;
+	LogRecord r;
+
+	latest = calloc(2 * 65536, sizeof(unsigned int));
+	pubrel = calloc(65536, 1);
+	if (latest == NULL || pubrel == NULL)
+	{
+		free(latest);
+		free(pubrel);
+		return -1;
+	}
+
+	for (pos = 0; pos < log->end; pos += sizeof(r) + r.len)
+	{
+		memcpy(&r, &log->base[pos], sizeof(r));
+		switch (r.type)
+		{
+			case PERSIST_PUBLISH:
+				latest[r.id] = pos + 1;
+				pubrel[r.id] = 0;
+				break;
+			case PERSIST_PUBREL:
+				if (latest[r.id] == 0)
+					latest[r.id] = pos + 1;
+				pubrel[r.id] = 1;
+				break;
+			case PERSIST_PUBLISH_DONE:
+				latest[r.id] = 0;
+				break;
+			case PERSIST_INCOMING_QOS2:
+				latest[65536 + r.id] = pos + 1;
+				break;
+			case PERSIST_INCOMING_QOS2_DONE:
+				latest[65536 + r.id] = 0;
+				break;
+		}
+	}
+
+	for (pos = 0; pos < log->end; pos += sizeof(r) + r.len)
+	{
+		memcpy(&r, &log->base[pos], sizeof(r));
+		if ((r.type == PERSIST_PUBLISH || r.type == PERSIST_PUBREL) && latest[r.id] == pos + 1)
+		{
+			LogRecord live = r;
+
+			if (pubrel[r.id])
+			{
+				live.type = PERSIST_PUBREL;
+				live.len = 0;
+			}
+			fn(context, &live, &log->base[pos + sizeof(r)]);
+		}
+		else if (r.type == PERSIST_INCOMING_QOS2 && latest[65536 + r.id] == pos + 1)
+			fn(context, &r, &log->base[pos + sizeof(r)]);
+	}
+	free(latest);
+	free(pubrel);
+	return 0;
+}
+
+
+static void copyLive(void* context, LogRecord* r, unsigned char* data)
+{
+	appendRecord((PersistenceLog*)context, r->type, r->id, data, r->len);
+}
+
+
+/* flush the directory entries of the directory holding path */
+static void syncDir(const char* path)
+{
+	char* dir = strdup(path);
+	char* slash;
+	int fd;
+
+	if (dir == NULL)
+		return;
+	if ((slash = strrchr(dir, '/')) == NULL)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+
+/* copy the live records to a new file, then put it in place of the old one */
+static int compact(PersistenceLog* log)
+{
+	PersistenceLog new_log = *log;
+	char* tmp_path = NULL;
+	int rc = -1;
+
+	if ((tmp_path = malloc(strlen(log->path) + 5)) == NULL)
+		return -1;
+	sprintf(tmp_path, "%s.tmp", log->path);
+	if ((new_log.fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		goto exit;
+	if (ftruncate(new_log.fd, log->size) != 0 ||
+		(new_log.base = mmap(NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED, new_log.fd, 0)) == MAP_FAILED)
+	{
+		close(new_log.fd);
+		goto exit;
+	}
+	new_log.end = 0;
+	if (forEachLive(log, copyLive, &new_log) != 0 || msync(new_log.base, log->size, MS_SYNC) != 0 ||
+		rename(tmp_path, log->path) != 0)
+	{
+		munmap(new_log.base, log->size);
+		close(new_log.fd);
+		goto exit;
+	}
+	syncDir(log->path); /* so that the rename itself survives a crash */
+	munmap(log->base, log->size);
+	close(log->fd);
+	log->fd = new_log.fd;
+	log->base = new_log.base;
+	log->end = new_log.end;
+	log->seq = new_log.seq;
+	log->unsynced = 0;
+	rc = 0;
+exit:
+	free(tmp_path);
+	return rc;
+}
+
+
+int PersistenceLogOpen(PersistenceLog* log, const char* path, size_t size, int sync_interval_ms)
+{
+	struct stat st;
+	LogRecord r;
+	int first = 1;
+
+	if ((log->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+		return -1;
+	if (fstat(log->fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(log->fd, size) != 0))
+		goto error;
+	log->size = ((size_t)st.st_size > size) ? (size_t)st.st_size : size;
+	if ((log->base = mmap(NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0)) == MAP_FAILED)
+		goto error;
+	if ((log->path = strdup(path)) == NULL)
+	{
+		munmap(log->base, log->size);
+		goto error;
+	}
+
+	/* find the end of the records which were written whole */
+	log->seq = 1;
+	for (log->end = 0; readRecord(log, log->end, log->seq, first, &r); log->end += sizeof(r) + r.len, first = 0)
+		log->seq = r.seq + 1;
+	memset(&log->base[log->end], '\0', log->size - log->end); /* in case any later records did reach the disk */
+
+	log->sync_interval_ms = sync_interval_ms;
+	log->unsynced = 0;
+	TimerInit(&log->sync_timer);
+	return 0;
+
+error:
+	close(log->fd);
+	return -1;
+}
+
+
+int PersistenceLogRecord(void* context, int type, unsigned short id, unsigned char* data, int len)
+{
+	PersistenceLog* log = (PersistenceLog*)context;
+
+	if (log->size - log->end < sizeof(LogRecord) + len &&
+		(compact(log) != 0 || log->size - log->end < sizeof(LogRecord) + len))
+		return -1;
+	appendRecord(log, type, id, data, len);
+	++log->unsynced;
+	if (TimerIsExpired(&log->sync_timer))
+		return PersistenceLogSync(log); /* this and any records since the last sync, together */
+	return 0;
+}
+
+
+int PersistenceLogTimer(void* context, int check_only)
+{
+	PersistenceLog* log = (PersistenceLog*)context;
+
+	if (log->unsynced == 0)
+		return -1;
+	if (!TimerIsExpired(&log->sync_timer))
+		return TimerLeftMS(&log->sync_timer);
+	if (check_only)
+		return 0;
+	PersistenceLogSync(log);
+	return -1;
+}
+
+
+struct restoreContext
+{
+	void (*fn)(void* client, int type, unsigned short id, unsigned char* data, int len);
+	void* client;
+};
+
+
+static void restoreLive(void* context, LogRecord* r, unsigned char* data)
+{
+	struct restoreContext* rc = (struct restoreContext*)context;
+
+	rc->fn(rc->client, r->type, r->id, data, r->len);
+}
+
+
+int PersistenceLogRestore(void* context, void (*fn)(void* client, int type, unsigned short id,
+	unsigned char* data, int len), void* client)
+{
+	struct restoreContext rc = {fn, client};
+
+	return forEachLive((PersistenceLog*)context, restoreLive, &rc);
+}
+
+
+int PersistenceLogSync(PersistenceLog* log)
+{
+	int rc = 0;
+
+	if (log->unsynced > 0)
+		rc = msync(log->base, log->size, MS_SYNC);
+	log->unsynced = 0;
+	TimerCountdownMS(&log->sync_timer, log->sync_interval_ms);
+	return rc;
+}
+
+
+void PersistenceLogClose(PersistenceLog* log)
+{
+	PersistenceLogSync(log);
+	munmap(log->base, log->size);
+	close(log->fd);
+	free(log->path);
+}
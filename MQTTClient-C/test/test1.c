@@ -28,6 +28,9 @@
 #if !defined(_WINDOWS)
   #include <sys/time.h>
   #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <sys/wait.h>
+  #include <poll.h>
   #include <unistd.h>
   #include <errno.h>
 #else
@@ -764,6 +767,720 @@ exit:
   return failures;
 }
 
+/*********************************************************************
+
+Test 4: non-blocking API driven by MQTTClient_process
+
+*********************************************************************/
+static volatile int test4_completed = 0;
+static volatile int test4_failed = 0;
+
+void test4_commandComplete(MQTTCommandResult* result)
+{
+    int* expected_type = (int*)result->context;
+
+    assert("Good rc in command result", result->rc == SUCCESS, "rc was %d", result->rc);
+    assert("Good type in command result", result->type == *expected_type,
+           "type was %d", result->type);
+    if (result->rc != SUCCESS)
+        ++test4_failed;
+    ++test4_completed;
+}
+
+
+/* process until the given number of requests have completed, waiting on the socket as an event loop would */
+int test4_wait(MQTTClient* c, int count)
+{
+    int wait_ms = 5000;
+
+    while (test4_completed < count && wait_ms > 0)
+    {
+        fd_set readfds;
+        int fd = MQTTGetFd(c);
+        int timeout_ms = MQTTNextTimeoutMs(c);
+        struct timeval tv = {0, 100000L};
+        int events = 0;
+
+        if (timeout_ms >= 0 && timeout_ms < 100)
+            tv.tv_usec = timeout_ms * 1000L;
+        FD_ZERO(&readfds);
+        FD_SET(fd, &readfds);
+        if (select(fd + 1, &readfds, NULL, NULL, &tv) > 0)
+            events = MQTT_EVENT_READ;
+        else
+            wait_ms -= 100;
+        if (MQTTClient_process(c, events) != SUCCESS)
+            break;
+    }
+    return test4_completed == count && test4_failed == 0;
+}
+
+
+int test4(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  int rc;
+  int i;
+  int token;
+  int timeout;
+  const char* test_topic = "C client test4";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  int connect_type = CONNECT, publish_type = PUBLISH,
+      subscribe_type = SUBSCRIBE, unsubscribe_type = UNSUBSCRIBE;
+
+  fprintf(xml, "<testcase classname=\"test4\" name=\"non-blocking API\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 4 - non-blocking API");
+
+  NetworkInit(&n);
+  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"non-blocking-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = NetworkConnect(&n, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  test4_completed = test4_failed = 0;
+  token = MQTTConnectNB(&c, &data, test4_commandComplete, &connect_type);
+  assert("Good token from connect", token > 0, "token was %d", token);
+  assert("Not connected until connack", MQTTIsConnected(&c) == 0,
+         "isconnected was %d", MQTTIsConnected(&c));
+  rc = test4_wait(&c, 1);
+  assert("Connect completed", rc, "completed was %d", test4_completed);
+  assert("Connected", MQTTIsConnected(&c) == 1, "isconnected was %d", MQTTIsConnected(&c));
+  if (!MQTTIsConnected(&c))
+    goto exit;
+
+  test4_completed = test4_failed = 0;
+  token = MQTTSubscribeNB(&c, test_topic, QOS2, messageArrived, test4_commandComplete, &subscribe_type);
+  assert("Good token from subscribe", token > 0, "token was %d", token);
+  rc = test4_wait(&c, 1);
+  assert("Subscribe completed", rc, "completed was %d", test4_completed);
+
+  /* several publishes in progress at once, to be completed in any order */
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = (void*)"a much longer message that we can shorten to the extent that we need to payload up to 11";
+  pubmsg.payloadlen = 11;
+  test4_completed = test4_failed = 0;
+  for (i = 0; i < 4; ++i)
+  {
+    pubmsg.qos = (i % 2) ? QOS2 : QOS1;
+    token = MQTTPublishNB(&c, test_topic, &pubmsg, test4_commandComplete, &publish_type);
+    assert("Good token from publish", token > 0, "token was %d", token);
+  }
+  rc = test4_wait(&c, 4);
+  assert("Publishes completed", rc, "completed was %d", test4_completed);
+
+  /* a burst of QoS 0 publishes is queued in the send buffer until the socket takes it */
+  pubmsg.qos = QOS0;
+  for (i = 0; i < 10; ++i)
+  {
+    token = MQTTPublishNB(&c, test_topic, &pubmsg, NULL, NULL);
+    if (token == QUEUE_FULL)
+      MQTTClient_process(&c, MQTT_EVENT_WRITE);
+    assert("Good token from publish", token >= 0 || token == QUEUE_FULL, "token was %d", token);
+  }
+  for (i = 0; i < 10 && MQTTWantsWrite(&c); ++i)
+    MQTTClient_process(&c, MQTT_EVENT_WRITE);
+  assert("Send queue drained", MQTTWantsWrite(&c) == 0, "wantswrite was %d", MQTTWantsWrite(&c));
+
+  /* publishes in a batch are held back until the flush */
+  rc = MQTTBeginBatch(&c, 5000);
+  assert("Good rc from begin batch", rc == SUCCESS, "rc was %d", rc);
+  for (i = 0; i < 3; ++i)
+  {
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  }
+  assert("Batch held back", c.buf_queued > 0 && MQTTWantsWrite(&c) == 0,
+         "buf_queued was %d", (int)c.buf_queued);
+  timeout = MQTTNextTimeoutMs(&c);
+  assert("Batch deadline is the next deadline", timeout >= 0 && timeout <= 5000, "timeout was %d", timeout);
+  rc = MQTTFlush(&c);
+  assert("Good rc from flush", rc == SUCCESS, "rc was %d", rc);
+  assert("Batch written", c.buf_queued == 0, "buf_queued was %d", (int)c.buf_queued);
+
+  test4_completed = test4_failed = 0;
+  token = MQTTUnsubscribeNB(&c, test_topic, test4_commandComplete, &unsubscribe_type);
+  assert("Good token from unsubscribe", token > 0, "token was %d", token);
+  rc = test4_wait(&c, 1);
+  assert("Unsubscribe completed", rc, "completed was %d", test4_completed);
+
+  timeout = MQTTNextTimeoutMs(&c);
+  assert("Keepalive is the next deadline", timeout > 0 && timeout <= 20000, "timeout was %d", timeout);
+  for (i = 0; i < 10; ++i)
+  {
+    rc = MQTTProcessIO(&c);
+    assert("Good rc from processIO", rc == SUCCESS, "rc was %d", rc);
+  }
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  NetworkDisconnect(&n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST4: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+/*********************************************************************
+
+Test 5: endpoint sets
+
+*********************************************************************/
+int test5(struct Options options)
+{
+  Network n;
+  NetworkEndpoints endpoints;
+  NetworkOptions network_options = NetworkOptions_initializer;
+  int rc;
+  int dead, live;
+
+  fprintf(xml, "<testcase classname=\"test5\" name=\"endpoint sets\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 5 - endpoint sets");
+
+  NetworkInit(&n);
+  NetworkEndpointsInit(&endpoints, 60);
+  dead = NetworkEndpointsAdd(&endpoints, options.host, 1); /* nothing listening */
+  live = NetworkEndpointsAdd(&endpoints, options.host, options.port);
+  assert1("Good endpoint indexes", dead == 0 && live == 1, "indexes were %d %d", dead, live);
+
+  rc = NetworkConnectEndpoints(&n, &endpoints, &network_options);
+  assert("Good rc from connect", rc == 0, "rc was %d", rc);
+  assert("Connected to the live endpoint", endpoints.current == live, "current was %d", endpoints.current);
+  assert("Dead endpoint failure recorded", endpoints.endpoints[dead].failures == 1,
+         "failures were %d", endpoints.endpoints[dead].failures);
+  assert("Connect time recorded", endpoints.endpoints[live].rtt_ms > 0,
+         "rtt was %d", endpoints.endpoints[live].rtt_ms);
+  NetworkDisconnect(&n);
+
+  /* the dead endpoint is backed off, so the live one is tried first */
+  rc = NetworkConnectEndpoints(&n, &endpoints, &network_options);
+  assert("Good rc from connect", rc == 0, "rc was %d", rc);
+  assert("Connected to the live endpoint", endpoints.current == live, "current was %d", endpoints.current);
+  assert("Dead endpoint not retried", endpoints.endpoints[dead].failures == 1,
+         "failures were %d", endpoints.endpoints[dead].failures);
+  NetworkDisconnect(&n);
+  NetworkEndpointsFree(&endpoints);
+
+  MyLog(LOGA_INFO, "TEST5: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 6: automatic reconnect
+
+*********************************************************************/
+static volatile int test6_arrived = 0;
+
+void test6_messageArrived(MessageData* md)
+{
+    ++test6_arrived;
+}
+
+
+int test6_reconnect(Network* n, void* context)
+{
+    struct Options* options = (struct Options*)context;
+
+    NetworkDisconnect(n);
+    return NetworkConnect(n, options->host, options->port);
+}
+
+
+/* yield until connected again, sleeping until the next attempt to reconnect is due as an application would */
+int test6_waitConnected(MQTTClient* c)
+{
+    int wait_ms = 5000;
+
+    while (!MQTTIsConnected(c) && wait_ms > 0)
+    {
+        int timeout_ms = MQTTNextTimeoutMs(c);
+        struct timeval tv = {0, 100000L};
+
+        if (timeout_ms >= 0 && timeout_ms < 100)
+            tv.tv_usec = (timeout_ms + 1) * 1000L; /* the time left is rounded down */
+        wait_ms -= tv.tv_usec / 1000;
+        select(0, NULL, NULL, NULL, &tv);
+        MQTTYield(c, 10);
+    }
+    return MQTTIsConnected(c);
+}
+
+
+int test6(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  int rc;
+  int i;
+  int token;
+  int timeout;
+  const char* test_topic = "C client test6";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  unsigned char storebuf[100];
+  int publish_type = PUBLISH;
+
+  fprintf(xml, "<testcase classname=\"test6\" name=\"automatic reconnect\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 6 - automatic reconnect");
+
+  NetworkInit(&n);
+  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  MQTTSetAutoReconnect(&c, test6_reconnect, &options, storebuf, sizeof(storebuf), 100, 1000);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"reconnect-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = NetworkConnect(&n, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test6_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  /* the connection is lost, and made again after the backoff */
+  shutdown(n.my_socket, SHUT_RDWR);
+  rc = MQTTYield(&c, 100);
+  assert("Connection loss detected", rc == FAILURE && !MQTTIsConnected(&c), "rc was %d", rc);
+  timeout = MQTTNextTimeoutMs(&c);
+  assert("Reconnect is the next deadline", timeout >= 0 && timeout <= 100, "timeout was %d", timeout);
+  rc = test6_waitConnected(&c);
+  assert("Reconnected", rc == 1, "isconnected was %d", rc);
+
+  /* the session was clean, so messages only arrive if the subscription has been made again */
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = (void*)"reconnect test";
+  pubmsg.payloadlen = 14;
+  pubmsg.qos = QOS1;
+  test6_arrived = 0;
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  for (i = 0; i < 10 && test6_arrived == 0; ++i)
+    MQTTYield(&c, 100);
+  assert("Resubscribed", test6_arrived == 1, "arrived was %d", test6_arrived);
+
+  /* a publish held back in a batch is lost with the connection, then resent after reconnecting */
+  test6_arrived = 0;
+  test4_completed = test4_failed = 0;
+  MQTTBeginBatch(&c, 5000);
+  token = MQTTPublishNB(&c, test_topic, &pubmsg, test4_commandComplete, &publish_type);
+  assert("Good token from publish", token > 0, "token was %d", token);
+  assert("Publish stored", c.storebuf_used > 0, "storebuf_used was %d", (int)c.storebuf_used);
+  shutdown(n.my_socket, SHUT_RDWR);
+  MQTTYield(&c, 100);
+  rc = test6_waitConnected(&c);
+  assert("Reconnected", rc == 1, "isconnected was %d", rc);
+  for (i = 0; i < 10 && (test6_arrived == 0 || test4_completed == 0); ++i)
+    MQTTYield(&c, 100);
+  assert("Publish resent", test6_arrived == 1, "arrived was %d", test6_arrived);
+  assert("Publish completed", test4_completed == 1 && test4_failed == 0, "completed was %d", test4_completed);
+  assert("Store emptied", c.storebuf_used == 0, "storebuf_used was %d", (int)c.storebuf_used);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  NetworkDisconnect(&n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST6: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 7: offline publish queue
+
+*********************************************************************/
+int test7(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  MQTTOfflineStats stats;
+  int rc;
+  int i;
+  const char* test_topic = "C client test7";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  unsigned char storebuf[100];
+  unsigned char offlinebuf[1000];
+
+  fprintf(xml, "<testcase classname=\"test7\" name=\"offline publish queue\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 7 - offline publish queue");
+
+  NetworkInit(&n);
+  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  MQTTSetAutoReconnect(&c, test6_reconnect, &options, storebuf, sizeof(storebuf), 100, 1000);
+  MQTTSetOfflineQueue(&c, offlinebuf, sizeof(offlinebuf), MQTT_DROP_OLDEST, 2, -1, 0);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"offline-queue-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = NetworkConnect(&n, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test6_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  shutdown(n.my_socket, SHUT_RDWR);
+  rc = MQTTYield(&c, 100);
+  assert("Connection loss detected", rc == FAILURE && !MQTTIsConnected(&c), "rc was %d", rc);
+
+  /* three QoS 0 messages with a limit of two, so the first is dropped.  No QoS 2 messages are allowed. */
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = (void*)"offline queue test";
+  pubmsg.payloadlen = 18;
+  for (i = 0; i < 5; ++i)
+  {
+    pubmsg.qos = (i < 3) ? QOS0 : QOS1;
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  }
+  pubmsg.qos = QOS2;
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("QoS 2 not queued", rc == QUEUE_FULL, "rc was %d", rc);
+
+  MQTTGetOfflineStats(&c, &stats);
+  assert1("Messages queued", stats.queued[0] == 2 && stats.queued[1] == 2 && stats.queued[2] == 0,
+         "queued were %d %d", stats.queued[0], stats.queued[1]);
+  assert1("Messages dropped", stats.dropped[0] == 1 && stats.dropped[1] == 0 && stats.dropped[2] == 1,
+         "dropped were %d %d", stats.dropped[0], stats.dropped[2]);
+  assert("Queue in use", stats.bytes > 0 && stats.bytes <= stats.size, "bytes were %d", (int)stats.bytes);
+
+  /* the queue is sent when the connection has been made again */
+  test6_arrived = 0;
+  rc = test6_waitConnected(&c);
+  assert("Reconnected", rc == 1, "isconnected was %d", rc);
+  for (i = 0; i < 10 && test6_arrived < 4; ++i)
+    MQTTYield(&c, 100);
+  assert("Queued messages arrived", test6_arrived == 4, "arrived was %d", test6_arrived);
+  MQTTGetOfflineStats(&c, &stats);
+  assert1("Queue emptied", stats.bytes == 0 && stats.queued[0] + stats.queued[1] == 0,
+         "bytes were %d, queued %d", (int)stats.bytes, stats.queued[0] + stats.queued[1]);
+  assert("Acks received", c.storebuf_used == 0, "storebuf_used was %d", (int)c.storebuf_used);
+
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  NetworkDisconnect(&n);
+
+exit:
+  MyLog(LOGA_INFO, "TEST7: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 8: persistence of in-flight state
+
+*********************************************************************/
+int test8(struct Options options)
+{
+  Network n;
+  MQTTClient c;
+  PersistenceLog log;
+  MQTTPersistence persistence = {PersistenceLogRecord, PersistenceLogRestore, &log, PersistenceLogTimer};
+  int rc;
+  int i;
+  int token;
+  const char* test_topic = "C client test8";
+  const char* log_path = "/tmp/paho-c-test8.log";
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+  unsigned char storebuf[100];
+
+  fprintf(xml, "<testcase classname=\"test8\" name=\"persistence\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 8 - persistence");
+
+  /* small enough that the log is compacted many times */
+  unlink(log_path);
+  rc = PersistenceLogOpen(&log, log_path, 4096, 0);
+  assert("Good rc from log open", rc == 0, "rc was %d", rc);
+  if (rc != 0)
+    goto exit;
+
+  NetworkInit(&n);
+  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  MQTTSetAutoReconnect(&c, NULL, NULL, storebuf, sizeof(storebuf), 100, 1000);
+  rc = MQTTSetPersistence(&c, &persistence);
+  assert("Nothing restored", rc == 0, "rc was %d", rc);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"persistence-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  /* remove any session left by an earlier run, then start one which lasts */
+  rc = NetworkConnect(&n, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  MQTTDisconnect(&c);
+  NetworkDisconnect(&n);
+  data.cleansession = 0;
+  NetworkConnect(&n, options.host, options.port);
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test6_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = (void*)"persistence test";
+  pubmsg.payloadlen = 16;
+  pubmsg.qos = QOS1;
+  test6_arrived = 0;
+  for (i = 0; i < 200; ++i)
+  {
+    rc = MQTTPublish(&c, test_topic, &pubmsg);
+    if (rc != SUCCESS)
+      break;
+  }
+  assert("Good rc from publishes through log compaction", rc == SUCCESS, "rc was %d", rc);
+  for (i = 0; i < 10 && test6_arrived < 200; ++i)
+    MQTTYield(&c, 100);
+  assert("Messages arrived", test6_arrived == 200, "arrived was %d", test6_arrived);
+
+  /* a publish held back in a batch is in flight when the process ends */
+  MQTTBeginBatch(&c, 5000);
+  token = MQTTPublishNB(&c, test_topic, &pubmsg, NULL, NULL);
+  assert("Good token from publish", token > 0, "token was %d", token);
+  NetworkDisconnect(&n);
+  PersistenceLogClose(&log);
+
+  /* so is restored by the next one, and sent when it connects */
+  rc = PersistenceLogOpen(&log, log_path, 4096, 100);
+  assert("Good rc from log open", rc == 0, "rc was %d", rc);
+  if (rc != 0)
+    goto exit;
+  NetworkInit(&n);
+  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  MQTTSetAutoReconnect(&c, NULL, NULL, storebuf, sizeof(storebuf), 100, 1000);
+  MQTTSetMessageHandler(&c, test_topic, test6_messageArrived);
+  rc = MQTTSetPersistence(&c, &persistence);
+  assert("Publish restored", rc == 1 && c.storebuf_used > 0, "rc was %d", rc);
+
+  test6_arrived = 0;
+  NetworkConnect(&n, options.host, options.port);
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  for (i = 0; i < 10 && (test6_arrived == 0 || c.storebuf_used > 0); ++i)
+    MQTTYield(&c, 100);
+  assert("Publish resent", test6_arrived == 1, "arrived was %d", test6_arrived);
+  assert("Store emptied", c.storebuf_used == 0, "storebuf_used was %d", (int)c.storebuf_used);
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  NetworkDisconnect(&n);
+  PersistenceLogClose(&log);
+
+  /* and once acknowledged, is not restored again */
+  rc = PersistenceLogOpen(&log, log_path, 4096, 100);
+  assert("Good rc from log open", rc == 0, "rc was %d", rc);
+  if (rc != 0)
+    goto exit;
+  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  MQTTSetAutoReconnect(&c, NULL, NULL, storebuf, sizeof(storebuf), 100, 1000);
+  rc = MQTTSetPersistence(&c, &persistence);
+  assert("Nothing restored", rc == 0, "rc was %d", rc);
+  PersistenceLogClose(&log);
+  unlink(log_path);
+
+exit:
+  MyLog(LOGA_INFO, "TEST8: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 9: unix domain socket transport
+
+*********************************************************************/
+/* a child process relays one connection from a unix domain socket to the server */
+pid_t test9_relay(int listener, int server)
+{
+  pid_t pid = fork();
+
+  if (pid == 0)
+  {
+    unsigned char buf[1024];
+    struct pollfd fds[2];
+    int done = 0;
+
+    fds[0].fd = listener;
+    fds[0].events = fds[1].events = POLLIN;
+    fds[0].fd = (poll(fds, 1, 10000) == 1) ? accept(listener, NULL, NULL) : -1;
+    fds[1].fd = server;
+    while (!done && fds[0].fd != -1 && poll(fds, 2, 10000) > 0)
+    {
+      int i;
+
+      for (i = 0; i < 2 && !done; ++i)
+      {
+        int rc;
+
+        if (fds[i].revents == 0)
+          continue;
+        rc = read(fds[i].fd, buf, sizeof(buf));
+        done = (rc <= 0 || write(fds[1 - i].fd, buf, rc) != rc);
+      }
+    }
+    _exit(0);
+  }
+  return pid;
+}
+
+int test9(struct Options options)
+{
+  Network n, server;
+  MQTTClient c;
+  struct sockaddr_un address;
+  int listener = -1;
+  int rc;
+  int i;
+  pid_t relay = -1, pid;
+  uid_t uid;
+  gid_t gid;
+  const char* test_topic = "C client test9";
+  const char* path = "/tmp/paho-c-test9.sock";
+  char host[100];
+  unsigned char buf[100];
+  unsigned char readbuf[100];
+
+  fprintf(xml, "<testcase classname=\"test9\" name=\"unix domain socket\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 9 - unix domain socket transport");
+
+  unlink(path);
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  rc = bind(listener, (struct sockaddr*)&address, sizeof(address));
+  assert("Good rc from bind", rc == 0, "rc was %d", rc);
+  if (rc != 0)
+    goto exit;
+  listen(listener, 1);
+
+  NetworkInit(&server);
+  rc = NetworkConnect(&server, options.host, options.port);
+  assert("Good rc from TCP connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = NetworkPeerCredentials(&server, &pid, &uid, &gid);
+  assert("No peer credentials over TCP", rc == -1, "rc was %d", rc);
+  relay = test9_relay(listener, server.my_socket);
+
+  /* the credentials are of the process which listened, this one */
+  NetworkInit(&n);
+  sprintf(host, "%s%s", NETWORK_UNIX_PREFIX, path);
+  rc = NetworkConnect(&n, host, 0);
+  assert("Good rc from unix domain socket connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = NetworkPeerCredentials(&n, &pid, &uid, &gid);
+  assert("Good rc from peer credentials", rc == 0, "rc was %d", rc);
+  assert("Peer credentials", pid == getpid() && uid == getuid() && gid == getgid(), "pid was %d", (int)pid);
+
+  MQTTClientInit(&c, &n, 1000, buf, 100, readbuf, 100);
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"unix-domain-socket-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+  rc = MQTTConnect(&c, &data);
+  assert("Good rc from connect", rc == SUCCESS, "rc was %d", rc);
+  if (rc != SUCCESS)
+    goto exit;
+  rc = MQTTSubscribe(&c, test_topic, QOS1, test6_messageArrived);
+  assert("Good rc from subscribe", rc == SUCCESS, "rc was %d", rc);
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = (void*)"unix domain socket test";
+  pubmsg.payloadlen = 23;
+  pubmsg.qos = QOS1;
+  test6_arrived = 0;
+  rc = MQTTPublish(&c, test_topic, &pubmsg);
+  assert("Good rc from publish", rc == SUCCESS, "rc was %d", rc);
+  for (i = 0; i < 10 && test6_arrived == 0; ++i)
+    MQTTYield(&c, 100);
+  assert("Message arrived", test6_arrived == 1, "arrived was %d", test6_arrived);
+  rc = MQTTDisconnect(&c);
+  assert("Disconnect successful", rc == SUCCESS, "rc was %d", rc);
+  NetworkDisconnect(&n);
+
+  /* too long for a unix domain socket address */
+  memset(host, 'a', sizeof(host) - 1);
+  host[sizeof(host) - 1] = '\0';
+  memcpy(host, NETWORK_UNIX_PREFIX, sizeof(NETWORK_UNIX_PREFIX) - 1);
+  rc = NetworkConnect(&n, host, 0);
+  assert("Path too long", rc == -1, "rc was %d", rc);
+
+exit:
+  if (relay > 0)
+  {
+    NetworkDisconnect(&server);
+    waitpid(relay, NULL, 0);
+  }
+  if (listener != -1)
+    close(listener);
+  unlink(path);
+  MyLog(LOGA_INFO, "TEST9: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
 #if 0
 /*********************************************************************
 
@@ -1020,7 +1737,7 @@ exit:
 int main(int argc, char** argv)
 {
 	int rc = 0;
- 	int (*tests[])() = {NULL, test1, test2, test3};
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test7, test8, test9};
 	int i;
 
 	xml = fopen("TEST-test1.xml", "w");
@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/*
+
+ codec - benchmark of packet serialization and deserialization
+
+ Times the packets a client sends and receives most - publishes and their acks - through the
+ C functions of MQTTPacket, and through the typed C++ codec in MQTTCodec.h.
+
+ defaulted parameters:
+
+	--count 10000000
+	--payloadlen 32
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "MQTTPacket.h"
+#include "MQTTCodec.h"
+
+
+long count = 10000000L;
+int payloadlen = 32;
+long checksum = 0;
+
+static const char* topic = "sensors/building 1/floor 2/temperature";
+unsigned char buf[1000];
+unsigned char payload[500];
+
+
+double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// ns per call of fn
+template<class Fn>
+double run(Fn fn)
+{
+    double start = now_ns();
+
+    for (long i = 0; i < count; ++i)
+    {
+        __asm__ __volatile__("" : : "g"(buf) : "memory"); // as if the buffer could have changed
+        checksum += fn(i);
+    }
+    return (now_ns() - start) / count;
+}
+
+
+int main(int argc, char** argv)
+{
+    MQTTString topicName = MQTTString_initializer;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "--count") == 0)
+            count = atol(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--payloadlen") == 0)
+            payloadlen = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: codec [--count <calls for each function>] [--payloadlen <bytes, up to 500>]\n");
+            return -1;
+        }
+    }
+    if (payloadlen > (int)sizeof(payload))
+        payloadlen = sizeof(payload);
+    topicName.cstring = (char*)topic;
+
+    printf("%-40s %10s\n", "function", "ns per call");
+    printf("%-40s %10.2f\n", "MQTTSerialize_publish", run([&](long i) {
+        return MQTTSerialize_publish(buf, sizeof(buf), 0, 1, 0, (unsigned short)i, topicName, payload, payloadlen);
+    }));
+    printf("%-40s %10.2f\n", "Codec::serialize(Publish)", run([&](long i) {
+        return MQTT::Codec::serialize(buf, MQTT::Codec::Publish{.qos = 1, .id = (unsigned short)i, .topic = topic,
+            .payload = std::span<const unsigned char>(payload, payloadlen)});
+    }));
+    printf("%-40s %10.2f\n", "MQTTSerialize_ack", run([&](long i) {
+        return MQTTSerialize_ack(buf, sizeof(buf), PUBACK, 0, (unsigned short)i);
+    }));
+    printf("%-40s %10.2f\n", "Codec::serialize(Ack)", run([&](long i) {
+        return MQTT::Codec::serialize(buf, MQTT::Codec::Ack{.type = PUBACK, .id = (unsigned short)i});
+    }));
+
+    int len = MQTTSerialize_publish(buf, sizeof(buf), 0, 1, 0, 1, topicName, payload, payloadlen);
+    printf("%-40s %10.2f\n", "MQTTDeserialize_publish", run([&](long) {
+        unsigned char dup, retained;
+        unsigned short id;
+        int qos, received_len;
+        unsigned char* received;
+        MQTTString received_topic;
+        MQTTDeserialize_publish(&dup, &qos, &retained, &id, &received_topic, &received, &received_len, buf, len);
+        return received_len;
+    }));
+    printf("%-40s %10.2f\n", "Codec::deserialize(Publish)", run([&](long) {
+        MQTT::Codec::Publish received;
+        MQTT::Codec::deserialize(received, std::span<const unsigned char>(buf, len));
+        return (int)received.payload.size();
+    }));
+
+    return (checksum != 0) ? 0 : -1;
+}
@@ -0,0 +1,120 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/*
+
+ handlers - benchmark of message handler dispatch
+
+ Times the call of a message handler as Client::deliverMessage makes it, through the
+ FP class which the client used to hold its handlers in, and through Delegate, which it
+ holds them in now.  The handlers are reloaded from memory for every call, as they are
+ from the client's table.
+
+ defaulted parameters:
+
+	--count 100000000
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "MQTTClient.h"
+#include "FP.h"
+
+
+long count = 100000000L;
+long arrived = 0;
+
+
+void messageArrived(MQTT::MessageData& md)
+{
+    arrived += md.message.payloadlen;
+}
+
+
+class Subscriber
+{
+public:
+    Subscriber() : arrived(0) { }
+
+    void messageArrived(MQTT::MessageData& md)
+    {
+        arrived += md.message.payloadlen;
+    }
+
+    long arrived;
+};
+
+
+double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// ns per call of handler
+template<class Handler>
+double run(Handler& handler, MQTT::MessageData& md)
+{
+    double start = now_ns();
+
+    for (long i = 0; i < count; ++i)
+    {
+        __asm__ __volatile__("" : : "g"(&handler) : "memory"); // as if the handler could have changed
+        handler(md);
+    }
+    return (now_ns() - start) / count;
+}
+
+
+int main(int argc, char** argv)
+{
+    MQTTString topicName = MQTTString_initializer;
+    MQTT::Message message;
+    Subscriber subscriber;
+    long local_arrived = 0;
+
+    if (argc > 2 && strcmp(argv[1], "--count") == 0)
+        count = atol(argv[2]);
+    else if (argc > 1)
+    {
+        printf("Usage: handlers [--count <calls for each handler>]\n");
+        return -1;
+    }
+
+    memset(&message, '\0', sizeof(message));
+    message.payloadlen = 1;
+    MQTT::MessageData md(topicName, message);
+
+    FP<void, MQTT::MessageData&> fp_function, fp_method;
+    fp_function.attach(messageArrived);
+    fp_method.attach(&subscriber, &Subscriber::messageArrived);
+
+    MQTT::MessageDelegate function(messageArrived);
+    MQTT::MessageDelegate method(&subscriber, &Subscriber::messageArrived);
+    MQTT::MessageDelegate lambda([&local_arrived](MQTT::MessageData& md) { local_arrived += md.message.payloadlen; });
+
+    printf("%-30s %10s\n", "handler", "ns per call");
+    printf("%-30s %10.2f\n", "FP, global function", run(fp_function, md));
+    printf("%-30s %10.2f\n", "Delegate, global function", run(function, md));
+    printf("%-30s %10.2f\n", "FP, member function", run(fp_method, md));
+    printf("%-30s %10.2f\n", "Delegate, member function", run(method, md));
+    printf("%-30s %10.2f\n", "Delegate, lambda with capture", run(lambda, md));
+
+    return (arrived + subscriber.arrived + local_arrived == 5 * count) ? 0 : -1;
+}
@@ -0,0 +1,237 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(DELEGATE_H)
+#define DELEGATE_H
+
+#include <new>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#endif
+
+// has a type member only for types which are not integers, so that a literal 0 is not taken for a
+// function object, but goes to the function pointer overloads
+#if __cplusplus >= 201103L
+template<class T>
+struct DelegateNotIntegral : std::enable_if<!std::is_integral<T>::value> { };
+#else
+template<class T> struct DelegateNotIntegral { typedef void type; };
+template<> struct DelegateNotIntegral<bool> { };
+template<> struct DelegateNotIntegral<char> { };
+template<> struct DelegateNotIntegral<signed char> { };
+template<> struct DelegateNotIntegral<unsigned char> { };
+template<> struct DelegateNotIntegral<short> { };
+template<> struct DelegateNotIntegral<unsigned short> { };
+template<> struct DelegateNotIntegral<int> { };
+template<> struct DelegateNotIntegral<unsigned int> { };
+template<> struct DelegateNotIntegral<long> { };
+template<> struct DelegateNotIntegral<unsigned long> { };
+#endif
+
+/** Example using the Delegate class with a lambda which captures a variable
+ * @code
+ *  int count = 0;
+ *  Delegate<void, int> d([&count](int value) { count += value; });
+ *
+ *  d(1);
+ * @endcode
+ */
+
+/**
+ *  @class Delegate
+ *  @brief A callback which can be a global function, a member function of an object, or any function
+ *  object, such as a lambda with captures.  It is held in SIZE bytes inside the delegate, so no
+ *  memory is allocated.  The attach, attached and detach methods are those of FP.
+ */
+template<class retT, class argT, int SIZE = 4 * sizeof(void*)>
+class Delegate
+{
+public:
+    /** Create a Delegate with nothing attached
+     */
+    Delegate() : invoker(0), manager(0)
+    {
+    }
+
+    /** Create a Delegate for a global function
+     *  @param function - The address of a globally defined function, or 0 for nothing
+     */
+    Delegate(retT (*function)(argT)) : invoker(0), manager(0)
+    {
+        attach(function);
+    }
+
+    /** Create a Delegate for a member function
+     *  @param item - Address of the initialized object
+     *  @param method - Address of the member function
+     */
+    template<class T>
+    Delegate(T* item, retT (T::*method)(argT)) : invoker(0), manager(0)
+    {
+        attach(item, method);
+    }
+
+    /** Create a Delegate for a function object, such as a lambda.  A lambda without captures
+     *  converts to a global function, so is taken by that constructor instead.
+     *  @param functor - the function object, which is copied into the Delegate
+     */
+#if __cplusplus >= 201103L
+    template<class F, class = typename std::enable_if<!std::is_convertible<F, retT (*)(argT)>::value>::type>
+#else
+    template<class F>
+#endif
+    Delegate(F functor, typename DelegateNotIntegral<F>::type* = 0) : invoker(0), manager(0)
+    {
+        attach(functor);
+    }
+
+    Delegate(const Delegate& other) : invoker(0), manager(0)
+    {
+        *this = other;
+    }
+
+    Delegate& operator=(const Delegate& other)
+    {
+        if (this != &other)
+        {
+            detach();
+            if (other.manager)
+                other.manager(&storage, &other.storage);
+            invoker = other.invoker;
+            manager = other.manager;
+        }
+        return *this;
+    }
+
+    ~Delegate()
+    {
+        detach();
+    }
+
+    /** Add a callback function to the object
+     *  @param function - The address of a globally defined function
+     */
+    void attach(retT (*function)(argT))
+    {
+        if (function == 0)
+            detach();
+        else
+            attach(Function(function));
+    }
+
+    /** Add a callback function to the object
+     *  @param item - Address of the initialized object
+     *  @param method - Address of the member function (dont forget the scope that the function is defined in)
+     */
+    template<class T>
+    void attach(T* item, retT (T::*method)(argT))
+    {
+        attach(Method<T>(item, method));
+    }
+
+    /** Add a function object as the callback
+     *  @param functor - the function object, which must fit in SIZE bytes
+     */
+    template<class F>
+    typename DelegateNotIntegral<F>::type attach(F functor)
+    {
+        typedef char functor_must_fit[(sizeof(F) <= sizeof(Storage)) ? 1 : -1];
+
+        detach();
+        new (&storage) F(functor);
+        invoker = &invoke<F>;
+        manager = &manage<F>;
+        (void)sizeof(functor_must_fit);
+    }
+
+    /** Invoke the function attached to the class
+     *  @param arg - An argument that is passed into the function handler that is called
+     *  @return The return from the function handler called by this class
+     */
+    retT operator()(argT arg) const
+    {
+        if (invoker)
+            return invoker(&storage, arg);
+        return (retT)0;
+    }
+
+    /** Determine if an callback is currently hooked
+     *  @return 1 if a method is hooked, 0 otherwise
+     */
+    bool attached() const
+    {
+        return invoker != 0;
+    }
+
+    /** Release a function from the callback hook
+     */
+    void detach()
+    {
+        if (manager)
+            manager(0, &storage);   // destroy the function object
+        invoker = 0;
+        manager = 0;
+    }
+
+private:
+
+    union Storage
+    {
+        void* pointer;
+        void (*function)();
+        double number;
+        unsigned char bytes[SIZE];
+    };
+
+    class Function
+    {
+    public:
+        Function(retT (*function)(argT)) : function(function) { }
+        retT operator()(argT arg) const { return function(arg); }
+    private:
+        retT (*function)(argT);
+    };
+
+    template<class T>
+    class Method
+    {
+    public:
+        Method(T* item, retT (T::*method)(argT)) : item(item), method(method) { }
+        retT operator()(argT arg) const { return (item->*method)(arg); }
+    private:
+        T* item;
+        retT (T::*method)(argT);
+    };
+
+    template<class F>
+    static retT invoke(const Storage* storage, argT arg)
+    {
+        return (*const_cast<F*>(reinterpret_cast<const F*>(storage)))(arg);
+    }
+
+    // copy the function object in src to dst, or destroy the one in src if dst is 0
+    template<class F>
+    static void manage(Storage* dst, const Storage* src)
+    {
+        if (dst)
+            new (dst) F(*reinterpret_cast<const F*>(src));
+        else
+            reinterpret_cast<const F*>(src)->~F();
+    }
+
+    retT (*invoker)(const Storage* storage, argT arg);
+    void (*manager)(Storage* dst, const Storage* src);
+    Storage storage;
+};
+
+#endif
@@ -0,0 +1,444 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTT_ASYNC_LOGGING_H)
+#define MQTT_ASYNC_LOGGING_H
+
+#if __cplusplus < 201103L
+    #error "MQTTAsyncLogging.h needs a C++11 compiler"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#if !defined(MQTT_ASYNC_LOG_RECORD_SIZE)
+    #define MQTT_ASYNC_LOG_RECORD_SIZE 192  // bytes in each record, including the copies of strings
+#endif
+#if !defined(MQTT_ASYNC_LOG_RECORDS)
+    #define MQTT_ASYNC_LOG_RECORDS 128      // records in the queue of each thread, a power of 2
+#endif
+#if !defined(MQTT_ASYNC_LOG_INTERVAL_MS)
+    #define MQTT_ASYNC_LOG_INTERVAL_MS 10   // how often the queues are written out
+#endif
+
+/** Log a record, without formatting it, for the logging thread to write out.  The format string
+ *  must be a string literal.  The call to fprintf is never made, but lets the compiler check the
+ *  arguments against the format.
+ */
+#define MQTT_ASYNC_LOG(prefix, format, ...) \
+    { \
+    static const MQTT::AsyncLogging::Site mqtt_log_site = {prefix, format, __PRETTY_FUNCTION__, __LINE__}; \
+    if (0) \
+        fprintf(stdout, format, ##__VA_ARGS__); \
+    MQTT::AsyncLogging::log(mqtt_log_site, ##__VA_ARGS__); \
+    }
+
+namespace MQTT
+{
+
+namespace AsyncLogging
+{
+
+
+// where a record was logged from, which identifies its format
+struct Site
+{
+    const char* prefix;
+    const char* format;
+    const char* function;
+    int line;
+};
+
+
+struct Record
+{
+    void (*print)(FILE* stream, const Site& site, const unsigned char* args);
+    const Site* site;
+    unsigned char args[MQTT_ASYNC_LOG_RECORD_SIZE - 2 * sizeof(void*)];
+};
+
+
+// how an argument is stored in a record: scalars are copied as they are
+template<typename T>
+struct Arg
+{
+    static_assert(std::is_trivially_copyable<T>::value, "log arguments must be scalars or strings");
+
+    typedef T Type;
+    static const int SIZE = sizeof(T);
+
+    static void put(unsigned char*& cur, unsigned char*, T value)
+    {
+        memcpy(cur, &value, sizeof(T));
+        cur += sizeof(T);
+    }
+
+    static T get(const unsigned char*& cur)
+    {
+        T value;
+
+        memcpy(&value, cur, sizeof(T));
+        cur += sizeof(T);
+        return value;
+    }
+};
+
+// strings are copied, as they may not last until the record is written out, truncated to the
+// space left for them
+template<>
+struct Arg<const char*>
+{
+    typedef const char* Type;
+    static const int SIZE = 1;  // at least the terminating null
+
+    static void put(unsigned char*& cur, unsigned char* end, const char* value)
+    {
+        size_t len = (value == 0) ? 0 : strnlen(value, end - cur - 1);
+
+        if (len > 0)
+            memcpy(cur, value, len);
+        cur[len] = '\0';
+        cur += len + 1;
+    }
+
+    static const char* get(const unsigned char*& cur)
+    {
+        const char* value = (const char*)cur;
+
+        cur += strlen(value) + 1;
+        return value;
+    }
+};
+
+template<>
+struct Arg<char*> : public Arg<const char*>
+{
+};
+
+
+// the least space the arguments need
+template<typename... Args>
+struct Size
+{
+    static const int value = 0;
+};
+
+template<typename T, typename... Rest>
+struct Size<T, Rest...>
+{
+    static const int value = Arg<T>::SIZE + Size<Rest...>::value;
+};
+
+
+inline void put(unsigned char*&, unsigned char*)
+{
+}
+
+template<typename T, typename... Rest>
+void put(unsigned char*& cur, unsigned char* end, T value, Rest... rest)
+{
+    Arg<T>::put(cur, end - Size<Rest...>::value, value);
+    put(cur, end, rest...);
+}
+
+
+template<int...>
+struct Indexes
+{
+};
+
+template<int N, int... I>
+struct MakeIndexes : MakeIndexes<N - 1, N - 1, I...>
+{
+};
+
+template<int... I>
+struct MakeIndexes<0, I...>
+{
+    typedef Indexes<I...> type;
+};
+
+
+template<typename Values>
+void print(FILE* stream, const Site& site, const Values&, Indexes<>)
+{
+    fputs(site.format, stream);
+}
+
+template<typename Values, int... I>
+void print(FILE* stream, const Site& site, const Values& values, Indexes<I...>)
+{
+    fprintf(stream, site.format, std::get<I>(values)...);
+}
+
+// the format id of a record: unpacks the arguments of one call site and writes them out
+template<typename... Args>
+void print(FILE* stream, const Site& site, const unsigned char* args)
+{
+    const unsigned char* cur = args;
+    std::tuple<typename Arg<Args>::Type...> values{Arg<Args>::get(cur)...};   // in order
+
+    (void)cur;
+    fprintf(stream, "%s%s L#%d ", site.prefix, site.function, site.line);
+    print(stream, site, values, typename MakeIndexes<sizeof...(Args)>::type());
+}
+
+
+/**
+ * @class Queue
+ * @brief The records logged by one thread, waiting to be written out.  Only that thread adds
+ * records, and only the logging thread removes them, so no lock is needed.
+ */
+class Queue
+{
+public:
+    Queue() : retired(false), head(0), pad(), tail(0)
+    {
+    }
+
+    // the next free record, or 0 if the queue is full
+    Record* reserve()
+    {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+
+        if (t - head.load(std::memory_order_acquire) == MQTT_ASYNC_LOG_RECORDS)
+            return 0;
+        return &records[t % MQTT_ASYNC_LOG_RECORDS];
+    }
+
+    void commit()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // the oldest record, or 0 if the queue is empty
+    Record* front()
+    {
+        unsigned int h = head.load(std::memory_order_relaxed);
+
+        if (h == tail.load(std::memory_order_acquire))
+            return 0;
+        return &records[h % MQTT_ASYNC_LOG_RECORDS];
+    }
+
+    void pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    std::atomic<bool> retired;  // the thread has ended, so the queue can go when it is empty
+
+private:
+    static_assert((MQTT_ASYNC_LOG_RECORDS & (MQTT_ASYNC_LOG_RECORDS - 1)) == 0, "MQTT_ASYNC_LOG_RECORDS must be a power of 2");
+
+    std::atomic<unsigned int> head;
+    char pad[64];   // so that the two threads don't share a cache line for head and tail
+    std::atomic<unsigned int> tail;
+    Record records[MQTT_ASYNC_LOG_RECORDS];
+};
+
+
+/**
+ * @class Logger
+ * @brief Writes out the records in the queues of all the threads, from a thread of its own, which
+ * is started when the first record is logged.  If a queue is full, its records are dropped rather
+ * than the thread waiting, and the number dropped is written out.
+ */
+class Logger
+{
+public:
+    static Logger& instance()
+    {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger()
+    {
+        stop();
+    }
+
+    // the queue of the calling thread
+    Queue* queue()
+    {
+        static thread_local QueueHolder holder;
+
+        if (holder.queue == 0)
+            holder.queue = add();
+        return holder.queue;
+    }
+
+    void setStream(FILE* aStream)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stream = aStream;
+    }
+
+    // write out all the records logged so far, from the calling thread
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        drain();
+    }
+
+    // write out the records left, and end the logging thread
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (thread.joinable())
+            thread.join();
+        flush();
+    }
+
+    void dropRecord()
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    unsigned long droppedRecords()
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct QueueHolder
+    {
+        QueueHolder() : queue(0)
+        {
+        }
+
+        ~QueueHolder()
+        {
+            if (queue)
+                queue->retired = true;
+        }
+
+        Queue* queue;
+    };
+
+    Logger() : stream(stdout), stopping(false), dropped(0), reported(0)
+    {
+    }
+
+    Queue* add()
+    {
+        Queue* q = new Queue();
+        std::lock_guard<std::mutex> lock(mutex);
+
+        queues.push_back(q);
+        if (!stopping && !thread.joinable())
+            thread = std::thread(&Logger::run, this);
+        return q;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!stopping)
+        {
+            drain();
+            wake.wait_for(lock, std::chrono::milliseconds(MQTT_ASYNC_LOG_INTERVAL_MS));
+        }
+    }
+
+    // called with the mutex held, which makes this the only reader of the queues
+    void drain()
+    {
+        bool written = false;
+
+        for (size_t i = 0; i < queues.size(); )
+        {
+            Queue* q = queues[i];
+            Record* record;
+            bool retired = q->retired;   // before emptying it, so no record is left behind
+
+            while ((record = q->front()) != 0)
+            {
+                record->print(stream, *record->site, record->args);
+                q->pop();
+                written = true;
+            }
+            if (retired)
+            {
+                delete q;
+                queues.erase(queues.begin() + i);
+            }
+            else
+                ++i;
+        }
+        unsigned long now_dropped = dropped.load(std::memory_order_relaxed);
+        if (now_dropped != reported)
+        {
+            fprintf(stream, "WARN:  %lu log records dropped\n", now_dropped - reported);
+            reported = now_dropped;
+            written = true;
+        }
+        if (written)
+            fflush(stream);
+    }
+
+    FILE* stream;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+    std::vector<Queue*> queues;
+    bool stopping;
+    std::atomic<unsigned long> dropped;
+    unsigned long reported;
+};
+
+
+/** Add a record to the queue of the calling thread.  The arguments are copied into it, but not
+ *  formatted until the logging thread writes it out.
+ *  @param site - the call site, which must last as long as the program
+ */
+template<typename... Args>
+void log(const Site& site, Args... args)
+{
+    static_assert(Size<Args...>::value <= (int)sizeof(Record::args), "the log arguments do not fit in a record");
+
+    Logger& logger = Logger::instance();
+    Queue* queue = logger.queue();
+    Record* record = queue->reserve();
+
+    if (record == 0)
+    {
+        logger.dropRecord();
+        return;
+    }
+    record->print = &print<Args...>;
+    record->site = &site;
+    unsigned char* cur = record->args;
+    put(cur, record->args + sizeof(record->args), args...);
+    queue->commit();
+}
+
+
+}
+
+}
+
+#endif
@@ -24,10 +24,19 @@
 #if !defined(MQTTCLIENT_H)
 #define MQTTCLIENT_H
 
-#include "FP.h"
+#include "Delegate.h"
+#include "TopicFilter.h"
 #include "MQTTPacket.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include "MQTTLogging.h"
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L
+#include <span>
+#endif
 
 #if !defined(MQTTCLIENT_QOS1)
     #define MQTTCLIENT_QOS1 1
@@ -35,6 +44,21 @@
 #if !defined(MQTTCLIENT_QOS2)
     #define MQTTCLIENT_QOS2 0
 #endif
+#if !defined(MAX_INCOMING_QOS2_MESSAGES)
+    // how many incoming QoS 2 messages can be awaiting their PUBRELs, unless MQTTCLIENT_QOS2_BITMAP
+    // is defined, when there is a bit for each packet id (8 KB) and no limit
+    #define MAX_INCOMING_QOS2_MESSAGES 10
+#endif
+#if !defined(MQTTCLIENT_KEEPALIVE_JITTER)
+    // a PINGREQ is sent after the keepalive interval less up to this percentage of it, chosen at random
+    // for each connection, so that clients which connected together do not all ping together
+    #define MQTTCLIENT_KEEPALIVE_JITTER 25
+#endif
+#if !defined(MQTTCLIENT_WRITEV_PAYLOAD)
+    // publishes with payloads of at least this many bytes are written with the network's writev, if
+    // it has one, rather than copied into the send buffer.  Larger payloads than fit are, regardless.
+    #define MQTTCLIENT_WRITEV_PAYLOAD 256
+#endif
 
 namespace MQTT
 {
@@ -57,13 +81,105 @@ struct Message
 };
 
 
+/**
+ * A source of buffers for a client to read packets into, so that a message handler can keep the
+ * buffer its message is in, rather than copy the message (see OwnedMessage).  get and put can be
+ * called from different threads.
+ */
+class BufferPool
+{
+public:
+    virtual unsigned char* get() = 0;   // a free buffer, or 0 if there are none
+    virtual void put(unsigned char* buffer) = 0;
+    virtual int size() = 0;             // of each buffer
+
+protected:
+    ~BufferPool()
+    {
+    }
+};
+
+
 struct MessageData
 {
-    MessageData(MQTTString &aTopicName, struct Message &aMessage)  : message(aMessage), topicName(aTopicName)
+    MessageData(MQTTString &aTopicName, struct Message &aMessage, BufferPool* aPool = 0, unsigned char** aBuffer = 0)
+        : message(aMessage), topicName(aTopicName), pool(aPool), buffer(aBuffer)
     { }
 
+    /** Take the buffer the message is in from the client, which reads into another from its pool
+     *  from then on.  The message is not passed to any more handlers.
+     *  @return the buffer, which is to be put back in the pool, or 0 if the client has no pool or
+     *      the pool has no free buffer
+     */
+    unsigned char* takeBuffer()
+    {
+        unsigned char* replacement = 0;
+        unsigned char* taken = 0;
+
+        if (pool != 0 && !bufferTaken() && (replacement = pool->get()) != 0)
+        {
+            taken = *buffer;
+            *buffer = replacement;
+            buffer = 0;
+        }
+        return taken;
+    }
+
+    bool bufferTaken() const
+    {
+        return pool != 0 && buffer == 0;
+    }
+
+#if __cplusplus >= 201703L
+    // the topic name, in the client's read buffer, so only valid until the handler returns
+    std::string_view topic() const
+    {
+        return std::string_view(topicName.lenstring.data, topicName.lenstring.len);
+    }
+#endif
+#if __cplusplus >= 202002L
+    // the payload, in the client's read buffer, so only valid until the handler returns
+    std::span<const unsigned char> payload() const
+    {
+        return std::span<const unsigned char>((const unsigned char*)message.payload, message.payloadlen);
+    }
+#endif
+
     struct Message &message;
     MQTTString &topicName;
+    BufferPool* pool;           // the pool the client's read buffer is from, if it has one
+    unsigned char** buffer;     // the client's read buffer, until it is taken
+};
+
+
+// a message handler: a global function, a member function, or a function object such as a lambda
+typedef Delegate<void, MessageData&> MessageDelegate;
+
+
+// a client's read buffer from a pool, which is put back when the client is destroyed.  A copy of
+// the client has none, and reads into the buffer the client had before the pool was set, so that
+// the buffer is neither shared nor put back twice.
+struct PooledReadBuffer
+{
+    PooledReadBuffer() : pool(0), buffer(0)
+    {
+    }
+
+    PooledReadBuffer(const PooledReadBuffer&) : pool(0), buffer(0)
+    {
+    }
+
+    ~PooledReadBuffer()
+    {
+        if (pool != 0)
+            pool->put(buffer);
+    }
+
+    BufferPool* pool;
+    unsigned char* buffer;      // 0 if there is no pool
+
+private:
+    PooledReadBuffer& operator=(const PooledReadBuffer&);
 };
 
 
@@ -80,6 +196,94 @@ struct subackData
 };
 
 
+// buffers of a size fixed when the client is compiled, or none if the size is 0
+template<int SIZE, int COUNT>
+struct PacketBuffers
+{
+    unsigned char* get(int i)
+    {
+        return data[i];
+    }
+
+    unsigned char data[COUNT][SIZE];
+};
+
+
+template<int COUNT>
+struct PacketBuffers<0, COUNT>
+{
+    unsigned char* get(int /*i*/)
+    {
+        return 0;
+    }
+};
+
+
+// assume topic filter and name is in correct format
+// # can only be at end
+// + and # can only be next to separator
+inline bool isTopicMatched(const char* topicFilter, const MQTTString& topicName)
+{
+    const char* curf = topicFilter;
+    const char* curn = topicName.lenstring.data;
+    const char* curn_end = curn + topicName.lenstring.len;
+
+    while (*curf && curn < curn_end)
+    {
+        if (*curn == '/' && *curf != '/')
+            break;
+        if (*curf != '+' && *curf != '#' && *curf != *curn)
+            break;
+        if (*curf == '+')
+        {   // skip until we meet the next separator, or end of string
+            const char* nextpos = curn + 1;
+            while (nextpos < curn_end && *nextpos != '/')
+                nextpos = ++curn + 1;
+        }
+        else if (*curf == '#')
+            curn = curn_end - 1;    // skip until end of string
+        curf++;
+        curn++;
+    };
+
+    return (curn == curn_end) && (*curf == '\0');
+}
+
+
+// a buffer for Network::writev to write, one of several written with one call
+struct IOBuffer
+{
+    const unsigned char* data;
+    int len;
+};
+
+
+/**
+ * Does the Network have a method to write several buffers with one call?
+ * @code
+ *  int writev(const MQTT::IOBuffer* buffers, int count, int timeout_ms);   // returns the bytes written, or -1
+ * @endcode
+ * It can be a template, for buffers of any type with data and len members, so that the network
+ * class need not include this header.
+ */
+template<class Network>
+class HasWritev
+{
+    typedef char Yes;
+    typedef char No[2];
+
+    template<int> struct Test { };
+
+    template<class N> static Yes& test(Test<sizeof(((N*)0)->writev((const IOBuffer*)0, 0, 0))>*);
+    template<class N> static No& test(...);
+
+public:
+    enum { value = (sizeof(test<Network>(0)) == sizeof(Yes)) };
+};
+
+template<bool> struct Bool { };
+
+
 class PacketId
 {
 public:
@@ -99,16 +303,127 @@ private:
 };
 
 
+// the random part of the keepalive interval, from a generator for each client (xorshift), so that
+// rand()'s state is neither shared between threads nor disturbed for the application
+class KeepaliveJitter
+{
+public:
+    explicit KeepaliveJitter(const void* client)
+    {
+        state = ((unsigned long)(size_t)client ^ ((unsigned long)time(0) * 2654435761UL)) & 0xFFFFFFFFUL;
+        if (state == 0)
+            state = 1;
+    }
+
+    // keepalive_ms less up to MQTTCLIENT_KEEPALIVE_JITTER percent of it
+    long apply(long keepalive_ms)
+    {
+        if (keepalive_ms <= 0)
+            return keepalive_ms;
+        state ^= (state << 13) & 0xFFFFFFFFUL;
+        state ^= state >> 17;
+        state ^= (state << 5) & 0xFFFFFFFFUL;
+        return keepalive_ms - (long)(state % (unsigned long)(keepalive_ms * MQTTCLIENT_KEEPALIVE_JITTER / 100 + 1));
+    }
+
+private:
+    unsigned long state;    // 32 bits, never 0
+};
+
+
+// the ids of the incoming QoS 2 messages which have been delivered and are awaiting their PUBRELs
+class IncomingQoS2Ids
+{
+public:
+    IncomingQoS2Ids()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        memset(ids, '\0', sizeof(ids));
+    }
+
+#if defined(MQTTCLIENT_QOS2_BITMAP)
+    bool isFree(unsigned short id)
+    {
+        return (ids[id >> 3] & (1 << (id & 7))) == 0;
+    }
+
+    bool use(unsigned short id)
+    {
+        ids[id >> 3] |= (unsigned char)(1 << (id & 7));
+        return true;
+    }
+
+    void release(unsigned short id)
+    {
+        ids[id >> 3] &= (unsigned char)~(1 << (id & 7));
+    }
+
+private:
+    unsigned char ids[65536 / 8];   // a bit for each packet id
+#else
+    bool isFree(unsigned short id)
+    {
+        for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+        {
+            if (ids[i] == id)
+                return false;
+        }
+        return true;
+    }
+
+    bool use(unsigned short id)     // false if there is no room
+    {
+        for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+        {
+            if (ids[i] == 0)
+            {
+                ids[i] = id;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void release(unsigned short id)
+    {
+        for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+        {
+            if (ids[i] == id)
+            {
+                ids[i] = 0;
+                return;
+            }
+        }
+    }
+
+private:
+    unsigned short ids[MAX_INCOMING_QOS2_MESSAGES];  // 0 if free
+#endif
+};
+
+
 /**
  * @class Client
  * @brief blocking, non-threaded MQTT client API
  *
  * This version of the API blocks on all method calls, until they are complete.  This means that only one
- * MQTT request can be in process at any one time.
- * @param Network a network class which supports send, receive
+ * MQTT request can be in process at any one time, except that up to MAX_INFLIGHT QoS 1 and 2 publishes
+ * can be waiting for their acks.
+ * @param Network a network class which supports send, receive, and optionally writev (see HasWritev)
  * @param Timer a timer class with the methods:
+ * @param MAX_MQTT_PACKET_SIZE the size of the send buffer, and of each buffer which keeps a publish in
+ *     flight.  0 if the buffers are supplied to the constructor.
+ * @param MAX_INFLIGHT the number of QoS 1 and 2 publishes which can be waiting for their acks.  publish
+ *     returns when there is room for another, so with the default of 1 it waits for its own acks.
+ * @param MAX_READ_PACKET_SIZE the size of the read buffer, which is the largest packet that can be
+ *     received.  0 if the buffer is supplied to the constructor.
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5>
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5, int MAX_INFLIGHT = 1,
+    int MAX_READ_PACKET_SIZE = MAX_MQTT_PACKET_SIZE>
 class Client
 {
 
@@ -123,22 +438,81 @@ public:
      */
     Client(Network& network, unsigned int command_timeout_ms = 30000);
 
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    static const int SEND_BUFFERS = 1 + MAX_INFLIGHT;   // the send buffer, and one for each publish in flight
+#else
+    static const int SEND_BUFFERS = 1;
+#endif
+
+    /** Construct the client, with buffers supplied by the caller, from whichever allocator suits.  This
+     *  is for a client whose buffer sizes are set at run time, with MAX_MQTT_PACKET_SIZE and
+     *  MAX_READ_PACKET_SIZE 0, so that it has no buffers of its own.
+     *  @param network - pointer to an instance of the Network class - must be connected to the endpoint
+     *      before calling MQTT connect
+     *  @param send_buffers - SEND_BUFFERS * sendbuf_size bytes, which the client uses until it is destroyed
+     *  @param sendbuf_size - the size of each send buffer, which is the largest packet that can be sent
+     *  @param read_buffer - readbuf_size bytes, which the client uses until it is destroyed
+     *  @param readbuf_size - the largest packet that can be received
+     */
+    Client(Network& network, unsigned int command_timeout_ms, unsigned char* send_buffers, int sendbuf_size,
+        unsigned char* read_buffer, int readbuf_size);
+
+    /** Read packets into buffers from a pool, so that a message handler can keep the buffer its
+     *  message is in, with MessageData::takeBuffer or an OwnedMessage, to pass to another thread.
+     *  The client's buffer is taken from the pool now, and replaced whenever a handler takes it.
+     *  The pool must outlive the client, which puts its buffer back when it is destroyed.  A copy of
+     *  the client has no pool, and uses the buffer the client had before.
+     *  @param pool - buffers the size of the largest packet that can be received, or 0 to put the
+     *      client's buffer back in the pool, and use the buffer it had before
+     *  @return success code, or FAILURE if the pool has no free buffer
+     */
+    int setBufferPool(BufferPool* pool);
+
     /** Set the default message handling callback - used for any message which does not match a subscription message handler
      *  @param mh - pointer to the callback function.  Set to 0 to remove.
      */
     void setDefaultMessageHandler(messageHandler mh)
     {
-        if (mh != 0)
-            defaultMessageHandler.attach(mh);
-        else
-            defaultMessageHandler.detach();
+        defaultMessageHandler = MessageDelegate(mh);
+    }
+
+    /** Set the default message handling callback - used for any message which does not match a subscription message handler
+     *  @param mh - the callback.  Set to MessageDelegate() to remove.
+     */
+    void setDefaultMessageHandler(const MessageDelegate& mh)
+    {
+        defaultMessageHandler = mh;
     }
 
     /** Set a message handling callback.  This can be used outside of the the subscribe method.
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param mh - pointer to the callback function. If 0, removes the callback if any
      */
-    int setMessageHandler(const char* topicFilter, messageHandler mh);
+    int setMessageHandler(const char* topicFilter, messageHandler mh)
+    {
+        return setMessageHandler(topicFilter, MessageDelegate(mh));
+    }
+
+    /** Set a message handling callback.  This can be used outside of the the subscribe method.
+     *  @param topicFilter - a topic pattern which can include wildcards
+     *  @param mh - the callback: a member function, or a lambda, for instance.  If it has nothing
+     *      attached, removes the callback if any
+     */
+    int setMessageHandler(const char* topicFilter, const MessageDelegate& mh)
+    {
+        return setMessageHandler(topicFilter, 0, mh);
+    }
+
+    /** Set a message handling callback, for a topic filter already split into levels, which
+     *  messages are matched against more quickly.
+     *  @param topicFilter - the filter, which must last as long as the callback is set
+     *  @param mh - the callback.  If it has nothing attached, removes the callback if any
+     *  @return success code, or FAILURE if the filter is not valid
+     */
+    int setMessageHandler(const TopicFilter& topicFilter, const MessageDelegate& mh)
+    {
+        return topicFilter.valid() ? setMessageHandler(topicFilter.c_str(), &topicFilter, mh) : FAILURE;
+    }
 
     /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
      *  The nework object must be connected to the network endpoint before calling this
@@ -207,12 +581,51 @@ public:
      */
     int subscribe(const char* topicFilter, enum QoS qos, messageHandler mh, subackData &data);
 
+    /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
+     *  @param topicFilter - a topic pattern which can include wildcards
+     *  @param qos - the MQTT QoS to subscribe at
+     *  @param mh - the callback to be invoked when a message is received for this subscription: a
+     *      member function, or a lambda, for instance
+     *  @return success code -
+     */
+    int subscribe(const char* topicFilter, enum QoS qos, const MessageDelegate& mh);
+
+    /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
+     *  @param topicFilter - a topic pattern which can include wildcards
+     *  @param qos - the MQTT QoS to subscribe at
+     *  @param mh - the callback to be invoked when a message is received for this subscription
+     *  @param data - suback data to be returned
+     *  @return success code -
+     */
+    int subscribe(const char* topicFilter, enum QoS qos, const MessageDelegate& mh, subackData &data)
+    {
+        return subscribe(topicFilter, 0, qos, mh, data);
+    }
+
+    /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
+     *  @param topicFilter - a topic filter already split into levels, which messages are matched
+     *      against more quickly.  It must last as long as the subscription.
+     *  @param qos - the MQTT QoS to subscribe at
+     *  @param mh - the callback to be invoked when a message is received for this subscription
+     *  @return success code, or FAILURE if the filter is not valid
+     */
+    int subscribe(const TopicFilter& topicFilter, enum QoS qos, const MessageDelegate& mh)
+    {
+        subackData data;
+        return topicFilter.valid() ? subscribe(topicFilter.c_str(), &topicFilter, qos, mh, data) : FAILURE;
+    }
+
     /** MQTT Unsubscribe - send an MQTT unsubscribe packet and wait for the unsuback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @return success code -
      */
     int unsubscribe(const char* topicFilter);
 
+    int unsubscribe(const TopicFilter& topicFilter)
+    {
+        return unsubscribe(topicFilter.c_str());
+    }
+
     /** MQTT Disconnect - send an MQTT disconnect packet, and clean up any state
      *  @return success code -
      */
@@ -226,6 +639,20 @@ public:
      */
     int yield(unsigned long timeout_ms = 1000L);
 
+    /** Begin a batch - hold back the QoS 0 publishes which follow, so that a burst of small messages
+     *  is written with one call to the network rather than one call each.  The batch is written by
+     *  flush, when the send buffer has no room for the next publish, when timeout_ms has passed, or
+     *  along with any other packet.
+     *  @param timeout_ms the longest time to hold a packet back, in milliseconds
+     *  @return success code -
+     */
+    int beginBatch(unsigned long timeout_ms);
+
+    /** End the batch started by beginBatch, and write out the packets in it
+     *  @return success code - on failure, this means the client has disconnected
+     */
+    int flush();
+
     /** Is the client connected?
      *  @return flag - is the client connected or not?
      */
@@ -234,60 +661,137 @@ public:
         return isconnected;
     }
 
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    /** How many QoS 1 and 2 publishes are waiting for their acks?  The acks are received by yield, and
+     *  by the other methods while they wait for the server.
+     *  @return the number of publishes in flight
+     */
+    int inflightCount()
+    {
+        return inflightUsed;
+    }
+
+    /** Is a QoS 1 or 2 publish still waiting for its acks?
+     *  @param id - the packet id returned by publish
+     *  @return flag - is the publish in flight?
+     */
+    bool isInflight(unsigned short id)
+    {
+        return id != 0 && findInflight(id) != 0;
+    }
+#endif
+
 private:
 
     void closeSession();
     void cleanSession();
     int cycle(Timer& timer);
     int waitfor(int packet_type, Timer& timer);
+    int waitforInflight(int count, Timer& timer);
     int keepalive();
-    int publish(int len, Timer& timer, enum QoS qos);
 
     int decodePacket(int* value, int timeout);
     int readPacket(Timer& timer);
     int sendPacket(int length, Timer& timer);
+    int writeBuffer(unsigned char* buf, int length, Timer& timer);
+    template<class N>
+    int writeBuffers(N& network, IOBuffer* buffers, int count, Timer& timer, Bool<true>);
+    template<class N>
+    int writeBuffers(N&, IOBuffer*, int, Timer&, Bool<false>)
+    {
+        return FAILURE;     // never called, as the publish is copied into sendbuf instead
+    }
+    int writeQueued(Timer& timer);
+    int serializePublishHeader(unsigned char* buf, int buflen, enum QoS qos, bool retained, unsigned short id,
+        MQTTString topicName, size_t payloadlen);
+    bool batchOpen();
     int deliverMessage(MQTTString& topicName, Message& message);
+    int setMessageHandler(const char* topicFilter, const TopicFilter* filter, const MessageDelegate& mh);
+    int subscribe(const char* topicFilter, const TopicFilter* filter, enum QoS qos, const MessageDelegate& mh, subackData& data);
     bool isTopicMatched(char* topicFilter, MQTTString& topicName);
 
     Network& ipstack;
     unsigned long command_timeout_ms;
 
-    unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
-    unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    unsigned char* buffer(int i)    // sendbuf, and one for each Inflight entry, in no order
+    {
+        return (user_sendbufs != 0) ? &user_sendbufs[i * sendbuf_size] : sendbufs.get(i);
+    }
+
+    unsigned char* sendbuf()        // the buffer which packets are serialized into
+    {
+        return buffer(sendbuf_no);
+    }
+
+    unsigned char* readbuf()
+    {
+        if (pooled.buffer != 0)
+            return pooled.buffer;
+        return (user_readbuf != 0) ? user_readbuf : readbufs.get(0);
+    }
+
+    int readbufSize()
+    {
+        return (pooled.pool != 0) ? pooled.pool->size() : readbuf_size;
+    }
 
-    Timer last_sent, last_received;
+    PacketBuffers<MAX_MQTT_PACKET_SIZE, SEND_BUFFERS> sendbufs;
+    PacketBuffers<MAX_READ_PACKET_SIZE, 1> readbufs;
+    unsigned char* user_sendbufs;   // the buffers supplied to the constructor, if any
+    unsigned char* user_readbuf;    // the buffer supplied to the constructor, if any
+    PooledReadBuffer pooled;        // used instead, if a pool is set
+    int sendbuf_size;
+    int readbuf_size;
+    int sendbuf_no;         // the index of sendbuf in the send buffers
+    int queued;             // bytes at the start of sendbuf which are waiting to be written
+    bool batching;          // QoS 0 publishes are held in sendbuf until flush or batch_end expires
+    Timer batch_end;
+
+    Timer last_sent, last_received, ping_sent;
     unsigned int keepAliveInterval;
+    unsigned long keepalive_ms;     // the time without traffic after which a PINGREQ is sent
     bool ping_outstanding;
     bool cleansession;
 
     PacketId packetid;
+    KeepaliveJitter jitter;
 
     struct MessageHandlers
     {
         const char* topicFilter;
-        FP<void, MessageData&> fp;
+        const TopicFilter* filter;  // topicFilter split into levels, if it was subscribed to that way
+        MessageDelegate fp;
     } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
 
-    FP<void, MessageData&> defaultMessageHandler;
+    MessageDelegate defaultMessageHandler;
 
     bool isconnected;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    unsigned char pubbuf[MAX_MQTT_PACKET_SIZE];  // store the last publish for sending on reconnect
-    int inflightLen;
-    unsigned short inflightMsgid;
-    enum QoS inflightQoS;
+    struct Inflight
+    {
+        unsigned short id;      // 0 when the entry is free
+        enum QoS qos;
+        bool pubrel;            // the PUBREC has been received, so it is the PUBREL which is resent
+        int buffer;             // the index of the send buffer this entry holds
+        int offset;             // of the publish, for sending on reconnect, in that buffer
+        int len;                // of the publish, 0 if it was not kept
+    } inflight[MAX_INFLIGHT];   // the publishes waiting for their acks, in no order
+    int inflightUsed;
+
+    Inflight* findInflight(unsigned short id)  // an id of 0 finds a free entry
+    {
+        for (int i = 0; i < MAX_INFLIGHT; ++i)
+        {
+            if (inflight[i].id == id)
+                return &inflight[i];
+        }
+        return 0;
+    }
 #endif
 
 #if MQTTCLIENT_QOS2
-    bool pubrel;
-    #if !defined(MAX_INCOMING_QOS2_MESSAGES)
-        #define MAX_INCOMING_QOS2_MESSAGES 10
-    #endif
-    unsigned short incomingQoS2messages[MAX_INCOMING_QOS2_MESSAGES];
-    bool isQoS2msgidFree(unsigned short id);
-    bool useQoS2msgid(unsigned short id);
-	void freeQoS2msgid(unsigned short id);
+    IncomingQoS2Ids incomingQoS2;
 #endif
 
 };
@@ -295,122 +799,232 @@ private:
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::cleanSession()
 {
     for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         messageHandlers[i].topicFilter = 0;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    inflightMsgid = 0;
-    inflightQoS = QOS0;
+    for (int i = 0; i < MAX_INFLIGHT; ++i)
+        inflight[i].id = 0;
+    inflightUsed = 0;
 #endif
 
 #if MQTTCLIENT_QOS2
-    pubrel = false;
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
-        incomingQoS2messages[i] = 0;
+    incomingQoS2.clear();
 #endif
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::closeSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::closeSession()
 {
     ping_outstanding = false;
     isconnected = false;
+    queued = 0;
+    batching = false;
     if (cleansession)
         cleanSession();
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid(), jitter(this)
 {
     this->command_timeout_ms = command_timeout_ms;
+    user_sendbufs = user_readbuf = 0;
+    sendbuf_size = MAX_MQTT_PACKET_SIZE;
+    readbuf_size = MAX_READ_PACKET_SIZE;
+    sendbuf_no = 0;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    for (int i = 0; i < MAX_INFLIGHT; ++i)
+        inflight[i].buffer = i + 1;
+#endif
     cleansession = true;
 	  closeSession();
 }
 
 
-#if MQTTCLIENT_QOS2
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isQoS2msgidFree(unsigned short id)
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::Client(Network& network, unsigned int command_timeout_ms,
+        unsigned char* send_buffers, int sendbuf_size, unsigned char* read_buffer, int readbuf_size)  : ipstack(network), packetid(), jitter(this)
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
-    {
-        if (incomingQoS2messages[i] == id)
-            return false;
-    }
-    return true;
+    this->command_timeout_ms = command_timeout_ms;
+    user_sendbufs = send_buffers;
+    user_readbuf = read_buffer;
+    this->sendbuf_size = sendbuf_size;
+    this->readbuf_size = readbuf_size;
+    sendbuf_no = 0;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    for (int i = 0; i < MAX_INFLIGHT; ++i)
+        inflight[i].buffer = i + 1;
+#endif
+    cleansession = true;
+	  closeSession();
 }
 
 
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
+// write whole packets from buf
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::writeBuffer(unsigned char* buf, int length, Timer& timer)
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    int rc = SUCCESS,
+        sent = 0;
+
+    while (sent < length)
     {
-        if (incomingQoS2messages[i] == 0)
-        {
-            incomingQoS2messages[i] = id;
-            return true;
-        }
+        rc = ipstack.write(&buf[sent], length - sent, timer.left_ms());
+        if (rc < 0)  // there was an error writing the data
+            break;
+        sent += rc;
+        if (timer.expired()) // only check expiry after at least one attempt to write
+            break;
     }
-    return false;
-}
-
-
-template<class Network, class Timer, int a, int b>
-void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
-{
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    if (sent == length)
     {
-        if (incomingQoS2messages[i] == id)
-        {
-            incomingQoS2messages[i] = 0;
-            return;
-        }
+        if (this->keepAliveInterval > 0 && sent > 0)
+            last_sent.countdown_ms(keepalive_ms); // record the fact that we have successfully sent the packet
+        rc = SUCCESS;
     }
+    else
+        rc = FAILURE;
+    return rc;
 }
-#endif
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+// write whole packets from several buffers, with one call to the network when it can take them all
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+template<class N>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::writeBuffers(N& network, IOBuffer* buffers, int count,
+    Timer& timer, Bool<true>)
 {
-    int rc = FAILURE,
-        sent = 0;
+    int rc = SUCCESS;
 
-    while (sent < length)
+    while (count > 0)
     {
-        rc = ipstack.write(&sendbuf[sent], length - sent, timer.left_ms());
+        rc = network.writev(buffers, count, timer.left_ms());
         if (rc < 0)  // there was an error writing the data
             break;
-        sent += rc;
+        while (count > 0 && rc >= buffers->len)
+        {
+            rc -= buffers->len;
+            ++buffers;
+            --count;
+        }
+        if (count > 0)      // part of this buffer was written
+        {
+            buffers->data += rc;
+            buffers->len -= rc;
+        }
         if (timer.expired()) // only check expiry after at least one attempt to write
             break;
     }
-    if (sent == length)
+    if (count == 0)
     {
         if (this->keepAliveInterval > 0)
-            last_sent.countdown(this->keepAliveInterval); // record the fact that we have successfully sent the packet
+            last_sent.countdown_ms(keepalive_ms); // record the fact that we have successfully sent the packet
         rc = SUCCESS;
     }
     else
         rc = FAILURE;
+    return rc;
+}
+
+
+// the start of a publish, up to its payload, for the payload to be written after it from where it is
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::serializePublishHeader(unsigned char* buf,
+    int buflen, enum QoS qos, bool retained, unsigned short id, MQTTString topicName, size_t payloadlen)
+{
+    unsigned char* ptr = buf;
+    MQTTHeader header = {0};
+    int rem_len = 2 + MQTTstrlen(topicName) + (int)payloadlen + ((qos > 0) ? 2 : 0);
+
+    if (MQTTPacket_len(rem_len) - (int)payloadlen > buflen)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+
+    header.bits.type = PUBLISH;
+    header.bits.qos = qos;
+    header.bits.retain = retained;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    writeMQTTString(&ptr, topicName);
+    if (qos > 0)
+        writeInt(&ptr, id);
+    return (int)(ptr - buf);
+}
+
+
+// write all the packets queued at the start of sendbuf
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::writeQueued(Timer& timer)
+{
+    int rc = writeBuffer(sendbuf(), queued, timer);
+
+    queued = 0;
+    return rc;
+}
+
+
+// is a batch being held back?  Once its deadline has passed, it is written with the next packet
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+bool MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::batchOpen()
+{
+    if (batching && batch_end.expired())
+        batching = false;
+    return batching;
+}
+
+
+// send the packet which has just been serialized, along with any queued before it
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::sendPacket(int length, Timer& timer)
+{
+    int rc;
+#if defined(MQTT_DEBUG) && MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_DEBUG
+    int start = queued;
+#endif
+
+    queued += length;
+    rc = writeQueued(timer);
 
-#if defined(MQTT_DEBUG)
+#if defined(MQTT_DEBUG) && MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_DEBUG
     char printbuf[150];
     DEBUG("Rc %d from sending packet %s\r\n", rc,
-        MQTTFormat_toServerString(printbuf, sizeof(printbuf), sendbuf, length));
+        MQTTFormat_toServerString(printbuf, sizeof(printbuf), &sendbuf()[start], length));
 #endif
     return rc;
 }
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::beginBatch(unsigned long timeout_ms)
+{
+    if (!batching)
+    {
+        batch_end.countdown_ms(timeout_ms);
+        batching = true;
+    }
+    return SUCCESS;
+}
+
+
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::flush()
+{
+    Timer timer(command_timeout_ms);
+    int rc;
+
+    batching = false;
+    if ((rc = writeQueued(timer)) != SUCCESS)
+        closeSession();
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::decodePacket(int* value, int timeout)
 {
     unsigned char c;
     int multiplier = 1;
@@ -444,8 +1058,8 @@ exit:
  * @param timeout the max time to wait for the packet read to complete, in milliseconds
  * @return the MQTT packet type, 0 if none, -1 if error
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::readPacket(Timer& timer)
 {
     int rc = FAILURE;
     MQTTHeader header = {0};
@@ -453,110 +1067,106 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& tim
     int rem_len = 0;
 
     /* 1. read the header byte.  This has the packet type in it */
-    rc = ipstack.read(readbuf, 1, timer.left_ms());
+    rc = ipstack.read(readbuf(), 1, timer.left_ms());
     if (rc != 1)
         goto exit;
 
     len = 1;
     /* 2. read the remaining length.  This is variable in itself */
     decodePacket(&rem_len, timer.left_ms());
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+    len += MQTTPacket_encode(readbuf() + 1, rem_len); /* put the original remaining length into the buffer */
 
-    if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+    if (rem_len > (readbufSize() - len))
     {
         rc = BUFFER_OVERFLOW;
         goto exit;
     }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
+    if (rem_len > 0 && (ipstack.read(readbuf() + len, rem_len, timer.left_ms()) != rem_len))
         goto exit;
 
-    header.byte = readbuf[0];
+    header.byte = readbuf()[0];
     rc = header.bits.type;
     if (this->keepAliveInterval > 0)
-        last_received.countdown(this->keepAliveInterval); // record the fact that we have successfully received a packet
+        last_received.countdown_ms(keepalive_ms); // record the fact that we have successfully received a packet
 exit:
 
-#if defined(MQTT_DEBUG)
+#if defined(MQTT_DEBUG) && MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_DEBUG
     if (rc >= 0)
     {
         char printbuf[50];
         DEBUG("Rc %d receiving packet %s\r\n", rc,
-            MQTTFormat_toClientString(printbuf, sizeof(printbuf), readbuf, len));
+            MQTTFormat_toClientString(printbuf, sizeof(printbuf), readbuf(), len));
     }
 #endif
     return rc;
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isTopicMatched(char* topicFilter, MQTTString& topicName)
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+bool MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::isTopicMatched(char* topicFilter, MQTTString& topicName)
 {
-    char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
-
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
+    return MQTT::isTopicMatched(topicFilter, topicName);
 }
 
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::deliverMessage(MQTTString& topicName, Message& message)
 {
     int rc = FAILURE;
 
     // we have to find the right message handler - indexed by topic
     for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
     {
-        if (messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)messageHandlers[i].topicFilter, topicName)))
+        const TopicFilter* filter = messageHandlers[i].filter;
+
+        if (messageHandlers[i].topicFilter != 0 && (filter ? filter->matches(topicName) :
+                (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
+                isTopicMatched((char*)messageHandlers[i].topicFilter, topicName))))
         {
             if (messageHandlers[i].fp.attached())
             {
-                MessageData md(topicName, message);
+                MessageData md(topicName, message, pooled.pool, &pooled.buffer);
                 messageHandlers[i].fp(md);
                 rc = SUCCESS;
+                if (md.bufferTaken())
+                    goto exit;  // the message is the handler's now
             }
         }
     }
 
     if (rc == FAILURE && defaultMessageHandler.attached())
     {
-        MessageData md(topicName, message);
+        MessageData md(topicName, message, pooled.pool, &pooled.buffer);
         defaultMessageHandler(md);
         rc = SUCCESS;
     }
 
+exit:
     return rc;
 }
 
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::setBufferPool(BufferPool* pool)
+{
+    unsigned char* buf = 0;
+
+    if (pool != 0 && (buf = pool->get()) == 0)
+        return FAILURE;
+    if (pooled.pool != 0)
+        pooled.pool->put(pooled.buffer);
+    pooled.pool = pool;
+    pooled.buffer = buf;
+    return SUCCESS;
+}
+
+
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::yield(unsigned long timeout_ms)
 {
     int rc = SUCCESS;
     Timer timer;
@@ -575,14 +1185,19 @@ int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::cycle(Timer& timer)
 {
     // get one piece of work off the wire and one pass through
     int len = 0,
         rc = SUCCESS;
 
-    int packet_type = readPacket(timer);    // read the socket, see what work is due
+    int packet_type = 0;
+
+    if (queued > 0 && !batchOpen() && (rc = writeQueued(timer)) != SUCCESS)
+        goto exit;  // the batch deadline has passed, but it could not be written
+
+    packet_type = readPacket(timer);    // read the socket, see what work is due
 
     switch (packet_type)
     {
@@ -593,10 +1208,29 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
         case 0: // timed out reading packet
             break;
         case CONNACK:
-        case PUBACK:
         case SUBACK:
         case UNSUBACK:
             break;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+        case PUBACK:
+        case PUBCOMP:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            Inflight* entry;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf(), readbufSize()) != 1)
+            {
+                rc = FAILURE;
+                goto exit;
+            }
+            if (mypacketid != 0 && (entry = findInflight(mypacketid)) != 0)
+            {
+                entry->id = 0;  // the publish is complete
+                --inflightUsed;
+            }
+            break;
+        }
+#endif
         case PUBLISH:
         {
             MQTTString topicName = MQTTString_initializer;
@@ -604,7 +1238,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
             int intQoS;
             msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
             if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
-                                 (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                                 (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf(), readbufSize()) != 1)
                 goto exit;
             msg.qos = (enum QoS)intQoS;
 #if MQTTCLIENT_QOS2
@@ -612,9 +1246,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 #endif
                 deliverMessage(topicName, msg);
 #if MQTTCLIENT_QOS2
-            else if (isQoS2msgidFree(msg.id))
+            else if (incomingQoS2.isFree(msg.id)) // not a duplicate of a message already delivered
             {
-                if (useQoS2msgid(msg.id))
+                if (incomingQoS2.use(msg.id))
                     deliverMessage(topicName, msg);
                 else
                     WARN("Maximum number of incoming QoS2 messages exceeded");
@@ -623,10 +1257,12 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
             if (msg.qos != QOS0)
             {
+                if ((rc = writeQueued(timer)) != SUCCESS) // packets other than publishes are not batched
+                    goto exit;
                 if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBACK, 0, msg.id);
+                    len = MQTTSerialize_ack(sendbuf(), sendbuf_size, PUBACK, 0, msg.id);
                 else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREC, 0, msg.id);
+                    len = MQTTSerialize_ack(sendbuf(), sendbuf_size, PUBREC, 0, msg.id);
                 if (len <= 0)
                     rc = FAILURE;
                 else
@@ -642,9 +1278,11 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
         case PUBREL:
             unsigned short mypacketid;
             unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf(), readbufSize()) != 1)
+                rc = FAILURE;
+            else if ((rc = writeQueued(timer)) != SUCCESS)
                 rc = FAILURE;
-            else if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE,
+            else if ((len = MQTTSerialize_ack(sendbuf(), sendbuf_size,
 						         (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
                 rc = FAILURE;
             else if ((rc = sendPacket(len, timer)) != SUCCESS) // send the PUBREL packet
@@ -652,10 +1290,13 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
             if (rc == FAILURE)
                 goto exit; // there was a problem
             if (packet_type == PUBREL)
-                freeQoS2msgid(mypacketid);
-            break;
-
-        case PUBCOMP:
+                incomingQoS2.release(mypacketid);
+            else
+            {
+                Inflight* entry = findInflight(mypacketid);
+                if (mypacketid != 0 && entry != 0)
+                    entry->pubrel = true;
+            }
             break;
 #endif
         case PINGRESP:
@@ -676,11 +1317,10 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepalive()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::keepalive()
 {
     int rc = SUCCESS;
-    static Timer ping_sent;
 
     if (keepAliveInterval == 0)
         goto exit;
@@ -690,7 +1330,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepalive()
         if (ping_sent.expired())
         {
             rc = FAILURE; // session failure
-            #if defined(MQTT_DEBUG)
+            #if defined(MQTT_DEBUG) && MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_DEBUG
                 DEBUG("PINGRESP not received in keepalive interval\r\n");
             #endif
         }
@@ -698,7 +1338,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepalive()
     else if (last_sent.expired() || last_received.expired())
     {
         Timer timer(1000);
-        int len = MQTTSerialize_pingreq(sendbuf, MAX_MQTT_PACKET_SIZE);
+        int len = 0;
+        if ((rc = writeQueued(timer)) != SUCCESS)
+            goto exit;
+        len = MQTTSerialize_pingreq(sendbuf(), sendbuf_size);
         if (len > 0 && (rc = sendPacket(len, timer)) == SUCCESS) // send the ping packet
         {
             ping_outstanding = true;
@@ -711,8 +1354,8 @@ exit:
 
 
 // only used in single-threaded mode where one command at a time is in process
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::waitfor(int packet_type, Timer& timer)
 {
     int rc = FAILURE;
 
@@ -728,8 +1371,28 @@ int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options, connackData& data)
+// receive acks until fewer than count publishes are waiting for them
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::waitforInflight(int count, Timer& timer)
+{
+    int rc = SUCCESS;
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    while (inflightUsed >= count)
+    {
+        if (timer.expired() || cycle(timer) < 0)
+        {
+            rc = FAILURE;
+            break;
+        }
+    }
+#endif
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::connect(MQTTPacket_connectData& options, connackData& data)
 {
     Timer connect_timer(command_timeout_ms);
     int rc = FAILURE;
@@ -739,21 +1402,22 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
         goto exit;
 
     this->keepAliveInterval = options.keepAliveInterval;
+    keepalive_ms = jitter.apply(keepAliveInterval * 1000L);
     this->cleansession = options.cleansession;
-    if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
+    if ((len = MQTTSerialize_connect(sendbuf(), sendbuf_size, &options)) <= 0)
         goto exit;
     if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
         goto exit; // there was a problem
 
     if (this->keepAliveInterval > 0)
-        last_received.countdown(this->keepAliveInterval);
+        last_received.countdown_ms(keepalive_ms);
     // this will be a blocking call, wait for the connack
     if (waitfor(CONNACK, connect_timer) == CONNACK)
     {
         data.rc = 0;
         data.sessionPresent = false;
         if (MQTTDeserialize_connack((unsigned char*)&data.sessionPresent,
-                            (unsigned char*)&data.rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+                            (unsigned char*)&data.rc, readbuf(), readbufSize()) == 1)
             rc = data.rc;
         else
             rc = FAILURE;
@@ -761,23 +1425,34 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     else
         rc = FAILURE;
 
-#if MQTTCLIENT_QOS2
-    // resend any inflight publish
-    if (inflightMsgid > 0 && inflightQoS == QOS2 && pubrel)
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    // resend the inflight publishes, or their PUBRELs, then wait until there is room for another
+    for (int i = 0; rc == SUCCESS && i < MAX_INFLIGHT; ++i)
     {
-        if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, inflightMsgid)) <= 0)
-            rc = FAILURE;
+        if (inflight[i].id == 0)
+            continue;
+#if MQTTCLIENT_QOS2
+        if (inflight[i].pubrel)
+        {
+            if ((len = MQTTSerialize_ack(sendbuf(), sendbuf_size, PUBREL, 0, inflight[i].id)) <= 0)
+                rc = FAILURE;
+            else
+                rc = sendPacket(len, connect_timer);
+        }
         else
-            rc = publish(len, connect_timer, inflightQoS);
-    }
-    else
 #endif
-#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (inflightMsgid > 0)
-    {
-        memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
-        rc = publish(inflightLen, connect_timer, inflightQoS);
+        if (inflight[i].len > 0)
+        {
+            unsigned char* packet = &buffer(inflight[i].buffer)[inflight[i].offset];
+            MQTTHeader header = {0};
+            header.byte = packet[0];
+            header.bits.dup = 1;
+            packet[0] = header.byte;
+            rc = writeBuffer(packet, inflight[i].len, connect_timer);
+        }
     }
+    if (rc == SUCCESS)
+        rc = waitforInflight(MAX_INFLIGHT, connect_timer);
 #endif
 
 exit:
@@ -790,24 +1465,25 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::connect(MQTTPacket_connectData& options)
 {
     connackData data;
     return connect(options, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::connect()
 {
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
     return connect(default_options);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::setMessageHandler(const char* topicFilter, messageHandler messageHandler)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::setMessageHandler(const char* topicFilter, const TopicFilter* filter,
+    const MessageDelegate& messageHandler)
 {
     int rc = FAILURE;
     int i = -1;
@@ -817,7 +1493,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
     {
         if (messageHandlers[i].topicFilter != 0 && strcmp(messageHandlers[i].topicFilter, topicFilter) == 0)
         {
-            if (messageHandler == 0) // remove existing
+            if (!messageHandler.attached()) // remove existing
             {
                 messageHandlers[i].topicFilter = 0;
                 messageHandlers[i].fp.detach();
@@ -827,7 +1503,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
         }
     }
     // if no existing, look for empty slot (unless we are removing)
-    if (messageHandler != 0) {
+    if (messageHandler.attached()) {
         if (rc == FAILURE)
         {
             for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
@@ -842,16 +1518,17 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
         if (i < MAX_MESSAGE_HANDLERS)
         {
             messageHandlers[i].topicFilter = topicFilter;
-            messageHandlers[i].fp.attach(messageHandler);
+            messageHandlers[i].filter = filter;
+            messageHandlers[i].fp = messageHandler;
         }
     }
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter,
-     enum QoS qos, messageHandler messageHandler, subackData& data)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::subscribe(const char* topicFilter,
+     const TopicFilter* filter, enum QoS qos, const MessageDelegate& messageHandler, subackData& data)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
@@ -861,7 +1538,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
     if (!isconnected)
         goto exit;
 
-    len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
+    if ((rc = writeQueued(timer)) != SUCCESS)
+        goto exit;
+    rc = FAILURE;
+    len = MQTTSerialize_subscribe(sendbuf(), sendbuf_size, 0, packetid.getNext(), 1, &topic, (int*)&qos);
     if (len <= 0)
         goto exit;
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the subscribe packet
@@ -872,10 +1552,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
         int count = 0;
         unsigned short mypacketid;
         data.grantedQoS = 0;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &data.grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &data.grantedQoS, readbuf(), readbufSize()) == 1)
         {
             if (data.grantedQoS != 0x80)
-                rc = setMessageHandler(topicFilter, messageHandler);
+                rc = setMessageHandler(topicFilter, filter, messageHandler);
         }
     }
     else
@@ -888,16 +1568,32 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::subscribe(const char* topicFilter, enum QoS qos, const MessageDelegate& messageHandler)
 {
     subackData data;
     return subscribe(topicFilter, qos, messageHandler, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::unsubscribe(const char* topicFilter)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::subscribe(const char* topicFilter,
+     enum QoS qos, messageHandler messageHandler, subackData& data)
+{
+    return subscribe(topicFilter, qos, MessageDelegate(messageHandler), data);
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
+{
+    subackData data;
+    return subscribe(topicFilter, qos, MessageDelegate(messageHandler), data);
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::unsubscribe(const char* topicFilter)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
@@ -907,7 +1603,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::un
     if (!isconnected)
         goto exit;
 
-    if ((len = MQTTSerialize_unsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic)) <= 0)
+    if ((rc = writeQueued(timer)) != SUCCESS)
+        goto exit;
+    rc = FAILURE;
+    if ((len = MQTTSerialize_unsubscribe(sendbuf(), sendbuf_size, 0, packetid.getNext(), 1, &topic)) <= 0)
         goto exit;
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the unsubscribe packet
         goto exit; // there was a problem
@@ -915,7 +1614,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::un
     if (waitfor(UNSUBACK, timer) == UNSUBACK)
     {
         unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (MQTTDeserialize_unsuback(&mypacketid, readbuf(), readbufSize()) == 1)
         {
             // remove the subscription message handler associated with this topic, if there is one
             setMessageHandler(topicFilter, 0);
@@ -931,62 +1630,19 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
-{
-    int rc;
-
-    if ((rc = sendPacket(len, timer)) != SUCCESS) // send the publish packet
-        goto exit; // there was a problem
-
-#if MQTTCLIENT_QOS1
-    if (qos == QOS1)
-    {
-        if (waitfor(PUBACK, timer) == PUBACK)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
-        }
-        else
-            rc = FAILURE;
-    }
-#endif
-#if MQTTCLIENT_QOS2
-    else if (qos == QOS2)
-    {
-        if (waitfor(PUBCOMP, timer) == PUBCOMP)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
-        }
-        else
-            rc = FAILURE;
-    }
-#endif
-
-exit:
-    if (rc != SUCCESS)
-        closeSession();
-    return rc;
-}
-
-
-
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
     MQTTString topicString = MQTTString_initializer;
     int len = 0;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    Inflight* entry = 0;
+#endif
+    // write the payload from where it is, unless the publish is to be held in a batch or kept for resending
+    bool vectored = HasWritev<Network>::value && (payloadlen >= MQTTCLIENT_WRITEV_PAYLOAD ||
+        payloadlen >= (size_t)sendbuf_size) && (qos == QOS0 ? !batchOpen() : cleansession);
 
     if (!isconnected)
         goto exit;
@@ -995,55 +1651,113 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* t
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
     if (qos == QOS1 || qos == QOS2)
-        id = packetid.getNext();
+    {
+        if (waitforInflight(MAX_INFLIGHT, timer) != SUCCESS) // the publishes resent on connect can fill the table
+        {
+            closeSession();
+            goto exit;
+        }
+        do
+            id = packetid.getNext();
+        while (findInflight(id) != 0);
+    }
 #endif
 
-    len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
-              topicString, (unsigned char*)payload, payloadlen);
+    if (vectored)
+    {
+        // only the header goes into sendbuf, after any batch, which is written first
+        if (queued > 0 && writeQueued(timer) != SUCCESS)
+        {
+            closeSession();
+            goto exit;
+        }
+        len = serializePublishHeader(sendbuf(), sendbuf_size, qos, retained, id, topicString, payloadlen);
+    }
+    else
+    {
+        // add to any batch being built up at the start of sendbuf, writing it out first if there is no room
+        while ((len = MQTTSerialize_publish(&sendbuf()[queued], sendbuf_size - queued, 0, qos, retained, id,
+                  topicString, (unsigned char*)payload, payloadlen)) == MQTTPACKET_BUFFER_TOO_SHORT && queued > 0)
+        {
+            if (writeQueued(timer) != SUCCESS)
+            {
+                closeSession();
+                goto exit;
+            }
+        }
+    }
     if (len <= 0)
         goto exit;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (!cleansession)
+    if (qos == QOS1 || qos == QOS2)
     {
-        memcpy(pubbuf, sendbuf, len);
-        inflightMsgid = id;
-        inflightLen = len;
-        inflightQoS = qos;
-#if MQTTCLIENT_QOS2
-        pubrel = false;
+        entry = findInflight(0);
+        entry->id = id;
+        entry->qos = qos;
+        entry->pubrel = false;
+        entry->offset = queued;
+        entry->len = 0;
+        ++inflightUsed;
+    }
 #endif
+
+    if (vectored)
+    {
+        IOBuffer buffers[2] = {{sendbuf(), len}, {(const unsigned char*)payload, (int)payloadlen}};
+        rc = writeBuffers(ipstack, buffers, 2, timer, Bool<HasWritev<Network>::value>());
     }
+    else if (qos == QOS0 && batchOpen())
+    {
+        queued += len;  // held back until the batch is written
+        rc = SUCCESS;
+    }
+    else
+        rc = sendPacket(len, timer); // send the publish packet
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (entry != 0 && !cleansession)
+    {
+        // the entry keeps the buffer the publish is in, for resending, and gives its own for sendbuf
+        int buffer = entry->buffer;
+        entry->buffer = sendbuf_no;
+        entry->len = len;
+        sendbuf_no = buffer;
+    }
+    if (entry != 0 && rc == SUCCESS)
+        rc = waitforInflight(MAX_INFLIGHT, timer); // receive acks until there is room for another publish
 #endif
 
-    rc = publish(len, timer, qos);
+    if (rc != SUCCESS)
+        closeSession();
 exit:
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
 {
     unsigned short id = 0;  // dummy - not used for anything
     return publish(topicName, payload, payloadlen, id, qos, retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, Message& message)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::publish(const char* topicName, Message& message)
 {
     return publish(topicName, message.payload, message.payloadlen, message.qos, message.retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::disconnect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT, int MAX_READ_PACKET_SIZE>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT, MAX_READ_PACKET_SIZE>::disconnect()
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);     // we might wait for incomplete incoming publishes to complete
-    int len = MQTTSerialize_disconnect(sendbuf, MAX_MQTT_PACKET_SIZE);
-    if (len > 0)
+    int len = 0;
+    batching = false;
+    if (writeQueued(timer) == SUCCESS && (len = MQTTSerialize_disconnect(sendbuf(), sendbuf_size)) > 0)
         rc = sendPacket(len, timer);            // send the disconnect packet
     closeSession();
     return rc;
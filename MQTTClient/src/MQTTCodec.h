@@ -0,0 +1,508 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTCODEC_H)
+#define MQTTCODEC_H
+
+#if __cplusplus < 202002L
+    #error "MQTTCodec.h needs a C++20 compiler, for std::span"
+#endif
+
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <string.h>
+#include "MQTTPacket.h"
+
+/** Example of serializing a publish with the typed codec.  The length of a packet with a fixed
+ *  topic and payload size is known to the compiler.
+ * @code
+ *  constexpr MQTT::Codec::Publish header{.qos = 1, .topic = "sensors/temperature"};
+ *  unsigned char buf[MQTT::Codec::length(header) + 4];
+ *
+ *  MQTT::Codec::Publish publish = header;
+ *  publish.id = 1;
+ *  publish.payload = std::span<const unsigned char>(reading, 4);
+ *  int len = MQTT::Codec::serialize(buf, publish);
+ * @endcode
+ */
+
+namespace MQTT
+{
+
+/**
+ * The MQTT 3.1 and 3.1.1 packets as C++ types, with their serialization and deserialization.
+ * Strings are std::string_views, so their lengths are not found with strlen, and binary data is
+ * a std::span.  Everything is inline, and the serializers are constexpr.  The wire format and
+ * return codes are those of the C functions in MQTTPacket: the length of the packet, or
+ * MQTTPACKET_BUFFER_TOO_SHORT, from serialize, and 1 for success from deserialize.
+ */
+namespace Codec
+{
+
+struct Will
+{
+    std::string_view topicName;
+    std::span<const unsigned char> message;
+    unsigned char qos = 0;
+    bool retained = false;
+};
+
+struct Connect
+{
+    unsigned char MQTTVersion = 4;
+    std::string_view clientID;
+    unsigned short keepAliveInterval = 60;
+    bool cleansession = true;
+    const Will* will = nullptr;
+    std::string_view username;          // a string_view with no data for none
+    std::span<const unsigned char> password;
+};
+
+struct Connack
+{
+    bool sessionPresent = false;
+    unsigned char rc = 0;
+};
+
+struct Publish
+{
+    bool dup = false;
+    unsigned char qos = 0;
+    bool retained = false;
+    unsigned short id = 0;
+    std::string_view topic;
+    std::span<const unsigned char> payload;
+};
+
+// PUBACK, PUBREC, PUBREL, PUBCOMP or UNSUBACK
+struct Ack
+{
+    unsigned char type = PUBACK;
+    bool dup = false;
+    unsigned short id = 0;
+};
+
+struct Subscribe
+{
+    bool dup = false;
+    unsigned short id = 0;
+    std::string_view topicFilter;
+    unsigned char qos = 0;
+};
+
+struct Suback
+{
+    unsigned short id = 0;
+    std::span<const unsigned char> grantedQoSs; // in the buffer it was deserialized from
+};
+
+struct Unsubscribe
+{
+    bool dup = false;
+    unsigned short id = 0;
+    std::string_view topicFilter;
+};
+
+struct Pingreq
+{
+};
+
+struct Disconnect
+{
+};
+
+
+// the number of bytes the remaining length is encoded in
+constexpr int remainingLengthLength(int rem_len)
+{
+    return (rem_len < 128) ? 1 : (rem_len < 16384) ? 2 : (rem_len < 2097152) ? 3 : 4;
+}
+
+constexpr int remainingLength(const Connect& c)
+{
+    int len = ((c.MQTTVersion == 4) ? 6 : 8) + 1 + 1 + 2 + 2 + (int)c.clientID.size();
+
+    if (c.will)
+        len += 2 + (int)c.will->topicName.size() + 2 + (int)c.will->message.size();
+    if (c.username.data())
+        len += 2 + (int)c.username.size();
+    if (c.password.data())
+        len += 2 + (int)c.password.size();
+    return len;
+}
+
+constexpr int remainingLength(const Publish& p)
+{
+    return 2 + (int)p.topic.size() + ((p.qos > 0) ? 2 : 0) + (int)p.payload.size();
+}
+
+constexpr int remainingLength(const Ack&)
+{
+    return 2;
+}
+
+constexpr int remainingLength(const Subscribe& s)
+{
+    return 2 + 2 + (int)s.topicFilter.size() + 1;
+}
+
+constexpr int remainingLength(const Unsubscribe& u)
+{
+    return 2 + 2 + (int)u.topicFilter.size();
+}
+
+constexpr int remainingLength(const Pingreq&)
+{
+    return 0;
+}
+
+constexpr int remainingLength(const Disconnect&)
+{
+    return 0;
+}
+
+/** The length of the whole packet, which for a packet known to the compiler is a constant
+ *  @param packet - the packet to be serialized
+ */
+template<class Packet>
+constexpr int length(const Packet& packet)
+{
+    int rem_len = remainingLength(packet);
+    return 1 + remainingLengthLength(rem_len) + rem_len;
+}
+
+
+class Writer
+{
+public:
+    constexpr Writer(std::span<unsigned char> buf) : buf(buf), pos(0)
+    {
+    }
+
+    constexpr void byte(unsigned char c)
+    {
+        buf[pos++] = c;
+    }
+
+    constexpr void int16(unsigned short value)
+    {
+        buf[pos++] = (unsigned char)(value >> 8);
+        buf[pos++] = (unsigned char)(value & 0xFF);
+    }
+
+    constexpr void remainingLength(int rem_len)
+    {
+        do
+        {
+            unsigned char d = rem_len % 128;
+            rem_len /= 128;
+            if (rem_len > 0)
+                d |= 0x80;
+            buf[pos++] = d;
+        } while (rem_len > 0);
+    }
+
+    constexpr void bytes(const unsigned char* data, size_t len)
+    {
+        if (std::is_constant_evaluated())
+        {
+            for (size_t i = 0; i < len; ++i)
+                buf[pos + i] = data[i];
+        }
+        else if (len > 0)
+            memcpy(&buf[pos], data, len);
+        pos += len;
+    }
+
+    constexpr void string(std::string_view s)
+    {
+        int16((unsigned short)s.size());
+        if (std::is_constant_evaluated())
+        {
+            for (size_t i = 0; i < s.size(); ++i)
+                buf[pos + i] = (unsigned char)s[i];
+        }
+        else if (s.size() > 0)
+            memcpy(&buf[pos], s.data(), s.size());
+        pos += s.size();
+    }
+
+    constexpr void data(std::span<const unsigned char> d)
+    {
+        int16((unsigned short)d.size());
+        bytes(d.data(), d.size());
+    }
+
+    constexpr int length() const
+    {
+        return (int)pos;
+    }
+
+private:
+    std::span<unsigned char> buf;
+    size_t pos;
+};
+
+
+// check the buffer is big enough, and write the fixed header
+template<class Packet>
+constexpr int writeHeader(Writer& w, std::span<unsigned char> buf, const Packet& packet, unsigned char header)
+{
+    int rem_len = remainingLength(packet);
+
+    if (1 + remainingLengthLength(rem_len) + rem_len > (int)buf.size())
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    w.byte(header);
+    w.remainingLength(rem_len);
+    return 0;
+}
+
+
+constexpr int serialize(std::span<unsigned char> buf, const Connect& c)
+{
+    Writer w(buf);
+    unsigned char flags = 0;
+
+    if (writeHeader(w, buf, c, CONNECT << 4) != 0)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    if (c.MQTTVersion == 4)
+        w.string("MQTT");
+    else
+        w.string("MQIsdp");
+    w.byte(c.MQTTVersion);
+    if (c.cleansession)
+        flags |= 0x02;
+    if (c.will)
+        flags |= 0x04 | (c.will->qos << 3) | (c.will->retained ? 0x20 : 0);
+    if (c.password.data())
+        flags |= 0x40;
+    if (c.username.data())
+        flags |= 0x80;
+    w.byte(flags);
+    w.int16(c.keepAliveInterval);
+    w.string(c.clientID);
+    if (c.will)
+    {
+        w.string(c.will->topicName);
+        w.data(c.will->message);
+    }
+    if (c.username.data())
+        w.string(c.username);
+    if (c.password.data())
+        w.data(c.password);
+    return w.length();
+}
+
+
+constexpr int serialize(std::span<unsigned char> buf, const Publish& p)
+{
+    Writer w(buf);
+
+    if (writeHeader(w, buf, p, (PUBLISH << 4) | (p.dup << 3) | (p.qos << 1) | p.retained) != 0)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    w.string(p.topic);
+    if (p.qos > 0)
+        w.int16(p.id);
+    w.bytes(p.payload.data(), p.payload.size());
+    return w.length();
+}
+
+
+constexpr int serialize(std::span<unsigned char> buf, const Ack& a)
+{
+    Writer w(buf);
+
+    if (writeHeader(w, buf, a, (a.type << 4) | (a.dup << 3) | ((a.type == PUBREL) ? 0x02 : 0)) != 0)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    w.int16(a.id);
+    return w.length();
+}
+
+
+constexpr int serialize(std::span<unsigned char> buf, const Subscribe& s)
+{
+    Writer w(buf);
+
+    if (writeHeader(w, buf, s, (SUBSCRIBE << 4) | (s.dup << 3) | 0x02) != 0)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    w.int16(s.id);
+    w.string(s.topicFilter);
+    w.byte(s.qos);
+    return w.length();
+}
+
+
+constexpr int serialize(std::span<unsigned char> buf, const Unsubscribe& u)
+{
+    Writer w(buf);
+
+    if (writeHeader(w, buf, u, (UNSUBSCRIBE << 4) | (u.dup << 3) | 0x02) != 0)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    w.int16(u.id);
+    w.string(u.topicFilter);
+    return w.length();
+}
+
+
+constexpr int serialize(std::span<unsigned char> buf, const Pingreq& p)
+{
+    Writer w(buf);
+
+    if (writeHeader(w, buf, p, PINGREQ << 4) != 0)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    return w.length();
+}
+
+
+constexpr int serialize(std::span<unsigned char> buf, const Disconnect& d)
+{
+    Writer w(buf);
+
+    if (writeHeader(w, buf, d, DISCONNECT << 4) != 0)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+    return w.length();
+}
+
+
+class Reader
+{
+public:
+    Reader(std::span<const unsigned char> buf) : cur(buf.data()), end(buf.data() + buf.size())
+    {
+    }
+
+    // read the fixed header, and limit the reader to the packet
+    bool header(unsigned char* header)
+    {
+        int rem_len = 0, multiplier = 1;
+
+        if (cur == end)
+            return false;
+        *header = *cur++;
+        for (int i = 0; ; ++i)
+        {
+            if (i == 4 || cur == end)
+                return false;
+            rem_len += (*cur & 127) * multiplier;
+            multiplier *= 128;
+            if ((*cur++ & 128) == 0)
+                break;
+        }
+        if (rem_len > end - cur)
+            return false;
+        end = cur + rem_len;
+        return true;
+    }
+
+    bool byte(unsigned char* c)
+    {
+        if (cur == end)
+            return false;
+        *c = *cur++;
+        return true;
+    }
+
+    bool int16(unsigned short* value)
+    {
+        if (end - cur < 2)
+            return false;
+        *value = (unsigned short)(cur[0] << 8 | cur[1]);
+        cur += 2;
+        return true;
+    }
+
+    bool string(std::string_view* s)
+    {
+        unsigned short len = 0;
+
+        if (!int16(&len) || end - cur < len)
+            return false;
+        *s = std::string_view((const char*)cur, len);
+        cur += len;
+        return true;
+    }
+
+    std::span<const unsigned char> rest()
+    {
+        std::span<const unsigned char> r(cur, end - cur);
+        cur = end;
+        return r;
+    }
+
+private:
+    const unsigned char* cur;
+    const unsigned char* end;
+};
+
+
+inline int deserialize(Connack& c, std::span<const unsigned char> buf)
+{
+    Reader r(buf);
+    unsigned char header = 0, flags = 0;
+
+    if (!r.header(&header) || (header >> 4) != CONNACK || !r.byte(&flags) || !r.byte(&c.rc))
+        return 0;
+    c.sessionPresent = flags & 0x01;
+    return 1;
+}
+
+
+inline int deserialize(Publish& p, std::span<const unsigned char> buf)
+{
+    Reader r(buf);
+    unsigned char header = 0;
+
+    if (!r.header(&header) || (header >> 4) != PUBLISH)
+        return 0;
+    p.dup = (header >> 3) & 0x01;
+    p.qos = (header >> 1) & 0x03;
+    p.retained = header & 0x01;
+    if (!r.string(&p.topic))
+        return 0;
+    p.id = 0;
+    if (p.qos > 0 && !r.int16(&p.id))
+        return 0;
+    p.payload = r.rest();
+    return 1;
+}
+
+
+inline int deserialize(Ack& a, std::span<const unsigned char> buf)
+{
+    Reader r(buf);
+    unsigned char header = 0;
+
+    if (!r.header(&header) || !r.int16(&a.id))
+        return 0;
+    a.type = header >> 4;
+    a.dup = (header >> 3) & 0x01;
+    return 1;
+}
+
+
+inline int deserialize(Suback& s, std::span<const unsigned char> buf)
+{
+    Reader r(buf);
+    unsigned char header = 0;
+
+    if (!r.header(&header) || (header >> 4) != SUBACK || !r.int16(&s.id))
+        return 0;
+    s.grantedQoSs = r.rest();
+    return 1;
+}
+
+}
+}
+
+#endif
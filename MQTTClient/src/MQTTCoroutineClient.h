@@ -0,0 +1,842 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTCOROUTINECLIENT_H)
+#define MQTTCOROUTINECLIENT_H
+
+#if !defined(__cpp_impl_coroutine)
+    #error "MQTTCoroutineClient.h needs a C++20 compiler, with coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <string.h>
+#include "MQTTClient.h"
+#include "MQTTCodec.h"
+
+/** Example of a coroutine using the CoroutineClient.  Any number of them can be waiting for
+ *  their operations at once, while one loop calls run.
+ * @code
+ *  MQTT::Task publisher(Client& client, MQTT::Message& message)
+ *  {
+ *      int rc = co_await client.publish("a/topic", message);  // resumed when the PUBACK arrives
+ *      ...
+ *  }
+ *
+ *  publisher(client, message);
+ *  while (...)
+ *      client.run(100);
+ * @endcode
+ */
+
+namespace MQTT
+{
+
+
+/**
+ * @class Task
+ * @brief The return type of a coroutine which starts when it is called, and runs until its end,
+ * to co_await the operations of a CoroutineClient in.  Nothing waits for it to finish.
+ */
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+
+/**
+ * @class CoroutineClient
+ * @brief An MQTT client whose operations are awaited by coroutines, rather than blocking.  Each
+ * operation suspends its coroutine until the packet which completes it arrives, or it times out.
+ * Only run does any I/O: it writes the packets of the operations started, reads the packets which
+ * arrive, and resumes the coroutines whose operations have completed.  Operations are waiting
+ * only for packets, so the number in progress is limited only by the packet ids, not by buffers.
+ *
+ * The Network is read and written as Client does it, with timeouts of 0 when there is other
+ * work to do.
+ */
+template<class Network, class Timer, int MAX_PACKET_SIZE = 1000, int MAX_MESSAGE_HANDLERS = 5>
+class CoroutineClient
+{
+public:
+
+    /**
+     * @class Operation
+     * @brief What an operation of the client returns, to co_await.  The result of the co_await
+     * is the return code of the operation.
+     */
+    class Operation
+    {
+    public:
+        Operation(const Operation&) = delete;
+        Operation& operator=(const Operation&) = delete;
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        // returns false if the operation has already failed, to resume the coroutine at once
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            waiter = handle;
+            return client->start(this);
+        }
+
+        int await_resume() const
+        {
+            return rc;
+        }
+
+    private:
+        friend class CoroutineClient;
+
+        Operation(CoroutineClient* client, int type, const char* topic = 0, Message* message = 0,
+                enum QoS qos = QOS0, const MessageDelegate& handler = MessageDelegate(), MQTTPacket_connectData* options = 0)
+            : client(client), type(type), id(0), rc(FAILURE), topic(topic), message(message), qos(qos),
+            handler(handler), options(options), next(0), older(0), newer(0)
+        {
+        }
+
+        CoroutineClient* client;
+        int type;                           // of the packet which starts the operation
+        unsigned short id;
+        int rc;
+        const char* topic;
+        Message* message;
+        enum QoS qos;
+        MessageDelegate handler;
+        MQTTPacket_connectData* options;
+        Timer deadline;
+        std::coroutine_handle<> waiter;
+        Operation* next;                    // in the list or table the operation is waiting in
+        Operation* older;                   // the operations in progress, in the order they started
+        Operation* newer;
+    };
+
+    /** Construct the client
+     *  @param network - an instance of the Network class - must be connected to the endpoint
+     *      before awaiting connect
+     *  @param command_timeout_ms - how long each operation can wait to complete
+     */
+    CoroutineClient(Network& network, unsigned int command_timeout_ms = 30000);
+
+    /** MQTT Connect - the result is the CONNACK return code, or FAILURE
+     *  @param options - connect options, which must last until the operation completes
+     */
+    Operation connect(MQTTPacket_connectData& options)
+    {
+        return Operation(this, CONNECT, 0, 0, QOS0, MessageDelegate(), &options);
+    }
+
+    /** MQTT Publish - complete when the publish is written for QoS 0, when the PUBACK arrives for
+     *  QoS 1, or the PUBCOMP for QoS 2
+     *  @param topicName - the topic to publish to, which must last until the operation completes
+     *  @param message - the message to send, which must last until the operation completes
+     */
+    Operation publish(const char* topicName, Message& message)
+    {
+        return Operation(this, PUBLISH, topicName, &message);
+    }
+
+    /** MQTT Subscribe - the result is the granted QoS, or FAILURE.  The message handler is set
+     *  for the topic filter when the SUBACK arrives.
+     *  @param topicFilter - a topic pattern which can include wildcards, which must last as long
+     *      as the subscription
+     *  @param qos - the maximum QoS to receive messages at
+     *  @param mh - the callback for messages which match the topic filter
+     */
+    Operation subscribe(const char* topicFilter, enum QoS qos, const MessageDelegate& mh)
+    {
+        return Operation(this, SUBSCRIBE, topicFilter, 0, qos, mh);
+    }
+
+    /** MQTT Unsubscribe - the message handler for the topic filter is removed when the UNSUBACK
+     *  arrives
+     *  @param topicFilter - the topic filter to unsubscribe from
+     */
+    Operation unsubscribe(const char* topicFilter)
+    {
+        return Operation(this, UNSUBSCRIBE, topicFilter);
+    }
+
+    /** MQTT Disconnect - complete when the disconnect is written.  Operations still waiting for
+     *  packets then fail.
+     */
+    Operation disconnect()
+    {
+        return Operation(this, DISCONNECT);
+    }
+
+    /** Set the default message handling callback - used for any message which does not match a subscription message handler
+     *  @param mh - the callback.  Set to 0 to remove.
+     */
+    void setDefaultMessageHandler(const MessageDelegate& mh)
+    {
+        defaultMessageHandler = mh;
+    }
+
+    /** Do the I/O for the operations in progress, and resume the coroutines which were waiting for
+     *  those which complete, until the timeout passes.  If the connection is lost, all operations
+     *  in progress fail.
+     *  @param timeout_ms - the time to run for, in milliseconds
+     *  @return success code, or FAILURE if the connection was lost
+     */
+    int run(unsigned long timeout_ms = 1000L);
+
+    bool isConnected()
+    {
+        return isconnected;
+    }
+
+private:
+
+    static const int BUCKETS = 256;         // of the table of operations waiting for acks, by packet id
+
+    bool start(Operation* op);
+    void finish(Operation* op, int rc);
+    void closeSession();
+    int cycle(Timer& timer);
+    int fill();
+    int serialize(Operation* op, unsigned char* buf, int buflen);
+    int readPacket(int timeout_ms);
+    int decodePacket(int* value, int timeout);
+    int handlePacket(int packet_type);
+    int keepalive();
+    int deliverMessage(MQTTString& topicName, Message& message);
+    int setMessageHandler(const char* topicFilter, const MessageDelegate& mh);
+
+    unsigned short nextId();
+    Operation* findAwaiting(unsigned short id, bool remove);
+    void removeFrom(Operation** list, Operation* op);
+
+    Network& ipstack;
+    unsigned long command_timeout_ms;
+
+    unsigned char sendbuf[MAX_PACKET_SIZE];
+    int queued;                             // the end of the packets in sendbuf
+    int sent;                               // the end of those written
+
+    unsigned char readbuf[MAX_PACKET_SIZE];
+
+    Operation* unsent;                      // waiting to be put in sendbuf, in the order they started
+    Operation* unsent_tail;
+    Operation* written;                     // complete once sendbuf has been written
+    Operation* awaiting[BUCKETS];           // waiting for acks, by packet id
+    int awaiting_count;
+    Operation* connecting;                  // waiting for the CONNACK
+    Operation* done;                        // complete, with coroutines to be resumed
+    Operation* oldest;                      // all those in progress, for their timeouts
+    Operation* newest;
+
+    struct MessageHandlers
+    {
+        const char* topicFilter;
+        MessageDelegate fp;
+    } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
+
+    MessageDelegate defaultMessageHandler;
+
+    IncomingQoS2Ids incomingQoS2;
+
+    PacketId packetid;
+    KeepaliveJitter jitter;
+
+    unsigned int keepAliveInterval;
+    long keepalive_ms;
+    bool ping_outstanding;
+    Timer last_sent, last_received, ping_sent;
+    bool isconnected;
+};
+
+}
+
+
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
+MQTT::CoroutineClient<Network, Timer, a, MAX_MESSAGE_HANDLERS>::CoroutineClient(Network& network, unsigned int command_timeout_ms)
+    : ipstack(network), packetid(), jitter(this)
+{
+    this->command_timeout_ms = command_timeout_ms;
+    queued = sent = 0;
+    unsent = unsent_tail = written = connecting = done = oldest = newest = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+        awaiting[i] = 0;
+    awaiting_count = 0;
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+        messageHandlers[i].topicFilter = 0;
+    keepAliveInterval = 0;
+    keepalive_ms = 0;
+    ping_outstanding = false;
+    isconnected = false;
+}
+
+
+// returns false if the operation has failed already
+template<class Network, class Timer, int a, int b>
+bool MQTT::CoroutineClient<Network, Timer, a, b>::start(Operation* op)
+{
+    if ((op->type == CONNECT) ? (isconnected || connecting != 0) : !isconnected)
+        return false;
+
+    op->deadline.countdown_ms(command_timeout_ms);
+    if ((op->older = newest) != 0)
+        newest->newer = op;
+    else
+        oldest = op;
+    newest = op;
+
+    if (unsent_tail)
+        unsent_tail->next = op;
+    else
+        unsent = op;
+    unsent_tail = op;
+    return true;
+}
+
+
+// take the operation out of every list, and resume its coroutine at the end of the cycle
+template<class Network, class Timer, int a, int b>
+void MQTT::CoroutineClient<Network, Timer, a, b>::finish(Operation* op, int rc)
+{
+    if (op->older)
+        op->older->newer = op->newer;
+    else
+        oldest = op->newer;
+    if (op->newer)
+        op->newer->older = op->older;
+    else
+        newest = op->older;
+
+    op->rc = rc;
+    op->next = done;
+    done = op;
+}
+
+
+template<class Network, class Timer, int a, int b>
+void MQTT::CoroutineClient<Network, Timer, a, b>::removeFrom(Operation** list, Operation* op)
+{
+    while (*list && *list != op)
+        list = &(*list)->next;
+    if (*list)
+        *list = op->next;
+}
+
+
+template<class Network, class Timer, int a, int b>
+typename MQTT::CoroutineClient<Network, Timer, a, b>::Operation*
+MQTT::CoroutineClient<Network, Timer, a, b>::findAwaiting(unsigned short id, bool remove)
+{
+    Operation** cur = &awaiting[id % BUCKETS];
+
+    while (*cur && (*cur)->id != id)
+        cur = &(*cur)->next;
+    Operation* op = *cur;
+    if (op && remove)
+    {
+        *cur = op->next;
+        --awaiting_count;
+    }
+    return op;
+}
+
+
+// a packet id which no operation in progress has, or 0 if they all do
+template<class Network, class Timer, int a, int b>
+unsigned short MQTT::CoroutineClient<Network, Timer, a, b>::nextId()
+{
+    unsigned short id = 0;
+
+    if (awaiting_count < 65535)
+    {
+        do
+            id = packetid.getNext();
+        while (findAwaiting(id, false) != 0);
+    }
+    return id;
+}
+
+
+// the length of the packet for the operation, which is 0 if it must wait for a packet id
+template<class Network, class Timer, int a, int b>
+int MQTT::CoroutineClient<Network, Timer, a, b>::serialize(Operation* op, unsigned char* buf, int buflen)
+{
+    std::span<unsigned char> span(buf, buflen);
+    int len = FAILURE;
+
+    if ((op->type == SUBSCRIBE || op->type == UNSUBSCRIBE || (op->type == PUBLISH && op->message->qos != QOS0)) &&
+            op->id == 0 && (op->id = nextId()) == 0)
+        return 0;
+    switch (op->type)
+    {
+        case CONNECT:
+            len = MQTTSerialize_connect(buf, buflen, op->options);
+            break;
+        case PUBLISH:
+            op->message->id = op->id;
+            len = Codec::serialize(span, Codec::Publish{.qos = (unsigned char)op->message->qos,
+                .retained = op->message->retained, .id = op->id, .topic = op->topic,
+                .payload = std::span((const unsigned char*)op->message->payload, op->message->payloadlen)});
+            break;
+        case SUBSCRIBE:
+            len = Codec::serialize(span, Codec::Subscribe{.id = op->id, .topicFilter = op->topic, .qos = (unsigned char)op->qos});
+            break;
+        case UNSUBSCRIBE:
+            len = Codec::serialize(span, Codec::Unsubscribe{.id = op->id, .topicFilter = op->topic});
+            break;
+        case DISCONNECT:
+            len = Codec::serialize(span, Codec::Disconnect());
+            break;
+    }
+    return len;
+}
+
+
+// put the packets of the operations started into sendbuf, while there is room
+template<class Network, class Timer, int MAX_PACKET_SIZE, int b>
+int MQTT::CoroutineClient<Network, Timer, MAX_PACKET_SIZE, b>::fill()
+{
+    while (unsent)
+    {
+        Operation* op = unsent;
+        int len = serialize(op, &sendbuf[queued], MAX_PACKET_SIZE - queued);
+
+        if (len == 0 || (len == MQTTPACKET_BUFFER_TOO_SHORT && queued > 0))
+            break;  // wait for a packet id, or for sendbuf to be written
+        if ((unsent = op->next) == 0)
+            unsent_tail = 0;
+        if (len < 0)
+        {
+            finish(op, (len == MQTTPACKET_BUFFER_TOO_SHORT) ? BUFFER_OVERFLOW : FAILURE);
+            continue;
+        }
+        queued += len;
+        if (op->type == CONNECT)
+        {
+            keepAliveInterval = op->options->keepAliveInterval;
+            keepalive_ms = jitter.apply(keepAliveInterval * 1000L);
+            if (keepAliveInterval > 0)
+                last_received.countdown_ms(keepalive_ms);
+            op->next = 0;
+            connecting = op;
+        }
+        else if (op->id != 0)
+        {
+            op->next = awaiting[op->id % BUCKETS];
+            awaiting[op->id % BUCKETS] = op;
+            ++awaiting_count;
+        }
+        else
+        {
+            op->next = written;
+            written = op;
+        }
+    }
+    return SUCCESS;
+}
+
+
+template<class Network, class Timer, int a, int b>
+int MQTT::CoroutineClient<Network, Timer, a, b>::decodePacket(int* value, int timeout)
+{
+    unsigned char c;
+    int multiplier = 1;
+    int len = 0;
+    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+
+    *value = 0;
+    do
+    {
+        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+            goto exit; /* bad data */
+        if (ipstack.read(&c, 1, timeout) != 1)
+            goto exit;
+        *value += (c & 127) * multiplier;
+        multiplier *= 128;
+    } while ((c & 128) != 0);
+exit:
+    return len;
+}
+
+
+/**
+ * Wait up to timeout_ms for a packet to start arriving, then read the rest of it.
+ * @return the MQTT packet type, 0 if none, or a negative return code on error
+ */
+template<class Network, class Timer, int MAX_PACKET_SIZE, int b>
+int MQTT::CoroutineClient<Network, Timer, MAX_PACKET_SIZE, b>::readPacket(int timeout_ms)
+{
+    Timer timer(command_timeout_ms);
+    MQTTHeader header = {0};
+    int len = 1;
+    int rem_len = 0;
+    int rc = ipstack.read(readbuf, 1, timeout_ms);
+
+    if (rc != 1)
+        goto exit;
+
+    decodePacket(&rem_len, timer.left_ms());
+    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+    if (rem_len > MAX_PACKET_SIZE - len)
+    {
+        rc = BUFFER_OVERFLOW;
+        goto exit;
+    }
+    if (rem_len > 0 && ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len)
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+
+    header.byte = readbuf[0];
+    rc = header.bits.type;
+    if (keepAliveInterval > 0)
+        last_received.countdown_ms(keepalive_ms);
+exit:
+    return rc;
+}
+
+
+// act on the packet in readbuf.  Any ack it needs is put in sendbuf, which has room for it.
+template<class Network, class Timer, int MAX_PACKET_SIZE, int b>
+int MQTT::CoroutineClient<Network, Timer, MAX_PACKET_SIZE, b>::handlePacket(int packet_type)
+{
+    std::span<const unsigned char> packet(readbuf, MAX_PACKET_SIZE);
+    std::span<unsigned char> ackbuf(&sendbuf[queued], MAX_PACKET_SIZE - queued);
+    int rc = SUCCESS;
+    int len = 0;
+    Codec::Ack ack;
+    Operation* op = 0;
+
+    switch (packet_type)
+    {
+        case CONNACK:
+        {
+            Codec::Connack connack;
+            if (connecting == 0 || Codec::deserialize(connack, packet) != 1)
+                rc = FAILURE;
+            else
+            {
+                isconnected = (connack.rc == 0);
+                ping_outstanding = false;
+                op = connecting;
+                connecting = 0;
+                finish(op, connack.rc);
+            }
+            break;
+        }
+        case SUBACK:
+        {
+            Codec::Suback suback;
+            if (Codec::deserialize(suback, packet) != 1 || suback.grantedQoSs.size() == 0)
+                rc = FAILURE;
+            else if ((op = findAwaiting(suback.id, true)) != 0)
+            {
+                int grantedQoS = suback.grantedQoSs[0];
+                if (grantedQoS == 0x80)
+                    grantedQoS = FAILURE;
+                else if (setMessageHandler(op->topic, op->handler) != SUCCESS)
+                    grantedQoS = FAILURE;
+                finish(op, grantedQoS);
+            }
+            break;
+        }
+        case UNSUBACK:
+            if (Codec::deserialize(ack, packet) != 1)
+                rc = FAILURE;
+            else if ((op = findAwaiting(ack.id, true)) != 0)
+            {
+                setMessageHandler(op->topic, MessageDelegate());
+                finish(op, SUCCESS);
+            }
+            break;
+        case PUBACK:
+        case PUBCOMP:
+            if (Codec::deserialize(ack, packet) != 1)
+                rc = FAILURE;
+            else if ((op = findAwaiting(ack.id, true)) != 0)
+                finish(op, SUCCESS);
+            break;
+        case PUBREC:
+        case PUBREL:
+            if (Codec::deserialize(ack, packet) != 1 ||
+                    (len = Codec::serialize(ackbuf, Codec::Ack{.type = (unsigned char)((packet_type == PUBREC) ? PUBREL : PUBCOMP), .id = ack.id})) <= 0)
+                rc = FAILURE;
+            else
+            {
+                queued += len;
+                if (packet_type == PUBREL)
+                    incomingQoS2.release(ack.id);
+            }
+            break;
+        case PUBLISH:
+        {
+            Codec::Publish publish;
+            MQTTString topicName = MQTTString_initializer;
+            Message msg;
+            if (Codec::deserialize(publish, packet) != 1)
+            {
+                rc = FAILURE;
+                break;
+            }
+            topicName.lenstring.data = (char*)publish.topic.data();
+            topicName.lenstring.len = (int)publish.topic.size();
+            msg.qos = (enum QoS)publish.qos;
+            msg.retained = publish.retained;
+            msg.dup = publish.dup;
+            msg.id = publish.id;
+            msg.payload = (void*)publish.payload.data();
+            msg.payloadlen = publish.payload.size();
+            if (msg.qos != QOS2)
+                deliverMessage(topicName, msg);
+            else if (incomingQoS2.isFree(msg.id)) // not a duplicate of a message already delivered
+            {
+                if (incomingQoS2.use(msg.id))
+                    deliverMessage(topicName, msg);
+                else
+                    WARN("Maximum number of incoming QoS2 messages exceeded");
+            }
+            if (msg.qos != QOS0)
+            {
+                if ((len = Codec::serialize(ackbuf, Codec::Ack{.type = (unsigned char)((msg.qos == QOS1) ? PUBACK : PUBREC), .id = msg.id})) <= 0)
+                    rc = FAILURE;
+                else
+                    queued += len;
+            }
+            break;
+        }
+        case PINGRESP:
+            ping_outstanding = false;
+            break;
+    }
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_PACKET_SIZE, int b>
+int MQTT::CoroutineClient<Network, Timer, MAX_PACKET_SIZE, b>::keepalive()
+{
+    int rc = SUCCESS;
+    int len = 0;
+
+    if (keepAliveInterval == 0 || !isconnected)
+        goto exit;
+
+    if (ping_outstanding)
+    {
+        if (ping_sent.expired())
+            rc = FAILURE; // session failure
+    }
+    else if ((last_sent.expired() || last_received.expired()) &&
+            (len = Codec::serialize(std::span(&sendbuf[queued], MAX_PACKET_SIZE - queued), Codec::Pingreq())) > 0)
+    {
+        queued += len;
+        ping_outstanding = true;
+        ping_sent.countdown_ms(keepalive_ms);
+    }
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
+int MQTT::CoroutineClient<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
+{
+    int rc = FAILURE;
+
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
+                isTopicMatched(messageHandlers[i].topicFilter, topicName)))
+        {
+            if (messageHandlers[i].fp.attached())
+            {
+                MessageData md(topicName, message);
+                messageHandlers[i].fp(md);
+                rc = SUCCESS;
+            }
+        }
+    }
+
+    if (rc == FAILURE && defaultMessageHandler.attached())
+    {
+        MessageData md(topicName, message);
+        defaultMessageHandler(md);
+        rc = SUCCESS;
+    }
+
+    return rc;
+}
+
+
+// set the handler for the topic filter, or remove it if mh has nothing attached
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
+int MQTT::CoroutineClient<Network, Timer, a, MAX_MESSAGE_HANDLERS>::setMessageHandler(const char* topicFilter, const MessageDelegate& mh)
+{
+    int free_slot = -1;
+
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (messageHandlers[i].topicFilter == 0)
+        {
+            if (free_slot == -1)
+                free_slot = i;
+        }
+        else if (strcmp(messageHandlers[i].topicFilter, topicFilter) == 0)
+        {
+            if (mh.attached())
+                messageHandlers[i].fp = mh;
+            else
+            {
+                messageHandlers[i].topicFilter = 0;
+                messageHandlers[i].fp.detach();
+            }
+            return SUCCESS;
+        }
+    }
+    if (!mh.attached())
+        return SUCCESS;
+    if (free_slot == -1)
+        return FAILURE;
+    messageHandlers[free_slot].topicFilter = topicFilter;
+    messageHandlers[free_slot].fp = mh;
+    return SUCCESS;
+}
+
+
+// the connection is lost or closed: every operation in progress fails
+template<class Network, class Timer, int a, int b>
+void MQTT::CoroutineClient<Network, Timer, a, b>::closeSession()
+{
+    while (oldest)
+        finish(oldest, FAILURE);
+    unsent = unsent_tail = written = connecting = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+        awaiting[i] = 0;
+    awaiting_count = 0;
+    queued = sent = 0;
+    ping_outstanding = false;
+    isconnected = false;
+}
+
+
+// one pass of writing, reading and checking timeouts
+template<class Network, class Timer, int MAX_PACKET_SIZE, int b>
+int MQTT::CoroutineClient<Network, Timer, MAX_PACKET_SIZE, b>::cycle(Timer& timer)
+{
+    const int MAX_ACK_LENGTH = 4;
+    int rc = SUCCESS;
+    int packet_type = 0;
+
+    if (sent > 0)
+    {   // move what is still to be written to the start of sendbuf, to make room after it
+        memmove(sendbuf, &sendbuf[sent], queued - sent);
+        queued -= sent;
+        sent = 0;
+    }
+    fill();
+
+    if (queued > sent)
+    {
+        bool disconnected = false;
+        int len = ipstack.write(&sendbuf[sent], queued - sent, timer.left_ms());
+        if (len < 0)
+            goto exit;
+        sent += len;
+        if (len > 0 && keepAliveInterval > 0)
+            last_sent.countdown_ms(keepalive_ms);
+        if (sent == queued)
+        {
+            queued = sent = 0;
+            while (written)
+            {   // QoS 0 publishes and disconnects are complete when they are written
+                Operation* op = written;
+                written = op->next;
+                disconnected |= (op->type == DISCONNECT);
+                finish(op, SUCCESS);
+            }
+        }
+        if (disconnected)
+        {
+            closeSession();
+            return SUCCESS;
+        }
+    }
+
+    // read a packet only if there is room in sendbuf for its ack, so that none is dropped
+    if (MAX_PACKET_SIZE - queued >= MAX_ACK_LENGTH)
+    {
+        bool busy = (queued > sent) || done != 0;
+
+        if ((packet_type = readPacket(busy ? 0 : timer.left_ms())) < 0 || (rc = handlePacket(packet_type)) != SUCCESS)
+            goto exit;
+    }
+
+    if (MAX_PACKET_SIZE - queued >= MAX_ACK_LENGTH && (rc = keepalive()) != SUCCESS)
+        goto exit;
+
+    while (oldest && oldest->deadline.expired())
+    {   // operations start in order, so they time out in order
+        Operation* op = oldest;
+        if (op == connecting)
+            connecting = 0;
+        else if (op->id != 0 && findAwaiting(op->id, false) == op)
+            findAwaiting(op->id, true);
+        else
+        {
+            removeFrom(&unsent, op);
+            removeFrom(&written, op);
+            for (unsent_tail = unsent; unsent_tail && unsent_tail->next; unsent_tail = unsent_tail->next)
+                ;
+        }
+        finish(op, FAILURE);
+    }
+
+    return rc;
+
+exit:
+    closeSession();
+    return FAILURE;
+}
+
+
+template<class Network, class Timer, int a, int b>
+int MQTT::CoroutineClient<Network, Timer, a, b>::run(unsigned long timeout_ms)
+{
+    int rc = SUCCESS;
+    Timer timer;
+
+    timer.countdown_ms(timeout_ms);
+    do
+    {
+        if ((isconnected || oldest != 0) && cycle(timer) != SUCCESS)
+            rc = FAILURE;
+
+        while (done)
+        {   // resuming a coroutine can start more operations, or end it, with its operation
+            Operation* op = done;
+            done = op->next;
+            op->waiter.resume();
+        }
+    } while (rc == SUCCESS && (isconnected || oldest != 0) && !timer.expired());
+    return rc;
+}
+
+#endif
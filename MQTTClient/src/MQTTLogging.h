@@ -17,39 +17,68 @@
 #if !defined(MQTT_LOGGING_H)
 #define MQTT_LOGGING_H
 
+#define MQTT_LOG_LEVEL_NONE     0
+#define MQTT_LOG_LEVEL_ERROR    1
+#define MQTT_LOG_LEVEL_WARN     2
+#define MQTT_LOG_LEVEL_LOG      3
+#define MQTT_LOG_LEVEL_DEBUG    4
+
+/* Levels above MQTT_LOG_LEVEL are left out by the preprocessor, so that their arguments are
+ * not even evaluated */
+#if !defined(MQTT_LOG_LEVEL)
+#define MQTT_LOG_LEVEL MQTT_LOG_LEVEL_DEBUG
+#endif
+
 #define STREAM      stdout
-#if !defined(DEBUG)
-#define DEBUG(...)    \
+
+/* With MQTT_ASYNC_LOGGING defined, records are queued for a logging thread to format and write
+ * out, so that the thread which logs them does not wait for STREAM.  This needs C++11. */
+#if defined(MQTT_ASYNC_LOGGING)
+#include "MQTTAsyncLogging.h"
+#define MQTT_LOG_WRITE(prefix, ...) MQTT_ASYNC_LOG(prefix, __VA_ARGS__)
+#define MQTT_LOG_FLUSH() MQTT::AsyncLogging::Logger::instance().flush()
+#else
+#define MQTT_LOG_WRITE(prefix, ...)    \
     {\
-    fprintf(STREAM, "DEBUG:   %s L#%d ", __PRETTY_FUNCTION__, __LINE__);  \
+    fprintf(STREAM, "%s%s L#%d ", prefix, __PRETTY_FUNCTION__, __LINE__);  \
     fprintf(STREAM, ##__VA_ARGS__); \
     fflush(STREAM); \
     }
+#define MQTT_LOG_FLUSH()
+#endif
+
+#if !defined(DEBUG)
+#if MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_DEBUG
+#define DEBUG(...)  MQTT_LOG_WRITE("DEBUG:   ", __VA_ARGS__)
+#else
+#define DEBUG(...)  {}
+#endif
 #endif
 #if !defined(LOG)
-#define LOG(...)    \
-    {\
-    fprintf(STREAM, "LOG:   %s L#%d ", __PRETTY_FUNCTION__, __LINE__);  \
-    fprintf(STREAM, ##__VA_ARGS__); \
-    fflush(STREAM); \
-    }
+#if MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_LOG
+#define LOG(...)    MQTT_LOG_WRITE("LOG:   ", __VA_ARGS__)
+#else
+#define LOG(...)    {}
+#endif
 #endif
 #if !defined(WARN)
-#define WARN(...)   \
-    { \
-    fprintf(STREAM, "WARN:  %s L#%d ", __PRETTY_FUNCTION__, __LINE__);  \
-    fprintf(STREAM, ##__VA_ARGS__); \
-    fflush(STREAM); \
-    }
-#endif 
+#if MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_WARN
+#define WARN(...)   MQTT_LOG_WRITE("WARN:  ", __VA_ARGS__)
+#else
+#define WARN(...)   {}
+#endif
+#endif
 #if !defined(ERROR)
+#if MQTT_LOG_LEVEL >= MQTT_LOG_LEVEL_ERROR
 #define ERROR(...)  \
     { \
-    fprintf(STREAM, "ERROR: %s L#%d ", __PRETTY_FUNCTION__, __LINE__); \
-    fprintf(STREAM, ##__VA_ARGS__); \
-    fflush(STREAM); \
+    MQTT_LOG_WRITE("ERROR: ", __VA_ARGS__); \
+    MQTT_LOG_FLUSH(); \
     exit(1); \
     }
+#else
+#define ERROR(...)  { exit(1); }    /* the message is left out, but not the exit */
+#endif
 #endif
 
 #endif
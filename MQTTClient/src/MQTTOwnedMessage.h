@@ -0,0 +1,208 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTOWNEDMESSAGE_H)
+#define MQTTOWNEDMESSAGE_H
+
+#if __cplusplus < 201103L
+    #error "MQTTOwnedMessage.h needs a C++11 compiler"
+#endif
+
+#include <mutex>
+#include "MQTTClient.h"
+
+/** Example of passing messages to another thread without copying them
+ * @code
+ *  MQTT::FixedBufferPool<1000, 8> pool;
+ *  client.setBufferPool(&pool);
+ *
+ *  void messageArrived(MQTT::MessageData& md)
+ *  {
+ *      MQTT::OwnedMessage message(md);     // now in a buffer of its own
+ *      if (message)
+ *          queue.push(std::move(message)); // the buffer goes back to the pool when it is destroyed
+ *  }
+ * @endcode
+ */
+
+namespace MQTT
+{
+
+
+/**
+ * @class FixedBufferPool
+ * @brief COUNT buffers of SIZE bytes, with no memory allocated, which can be taken from and put
+ * back from any thread
+ */
+template<int SIZE, int COUNT>
+class FixedBufferPool : public BufferPool
+{
+public:
+    FixedBufferPool() : free_count(COUNT)
+    {
+        for (int i = 0; i < COUNT; ++i)
+            free_list[i] = i;
+    }
+
+    FixedBufferPool(const FixedBufferPool&) = delete;
+    FixedBufferPool& operator=(const FixedBufferPool&) = delete;
+
+    unsigned char* get()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (free_count == 0) ? 0 : buffers[free_list[--free_count]];
+    }
+
+    void put(unsigned char* buffer)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_list[free_count++] = (int)((buffer - buffers[0]) / SIZE);
+    }
+
+    int size()
+    {
+        return SIZE;
+    }
+
+    int available()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return free_count;
+    }
+
+private:
+    std::mutex mutex;
+    int free_count;
+    int free_list[COUNT];   // the indexes of the free buffers
+    unsigned char buffers[COUNT][SIZE];
+};
+
+
+/**
+ * @class OwnedMessage
+ * @brief A message which owns the buffer it is in, taken from the client that read it, so it
+ * can outlive the message handler, and be moved to another thread, without being copied.  It
+ * cannot be copied, only moved, and puts the buffer back in its pool when it is destroyed.
+ */
+class OwnedMessage
+{
+public:
+    OwnedMessage() : pool(0), buffer(0)
+    {
+        clear();
+    }
+
+    /** Take the buffer the message is in from the client, if it reads into buffers from a pool.
+     *  Otherwise, or if the pool has no free buffer, the OwnedMessage is empty.
+     *  @param md - the message data passed to a message handler
+     */
+    explicit OwnedMessage(MessageData& md) : pool(md.pool), buffer(md.takeBuffer())
+    {
+        if (buffer == 0)
+        {
+            pool = 0;
+            clear();
+            return;
+        }
+        msg = md.message;
+        topic_name = md.topicName;
+    }
+
+    OwnedMessage(OwnedMessage&& other) : pool(other.pool), buffer(other.buffer), msg(other.msg),
+        topic_name(other.topic_name)
+    {
+        other.pool = 0;
+        other.buffer = 0;
+        other.clear();
+    }
+
+    OwnedMessage& operator=(OwnedMessage&& other)
+    {
+        if (this != &other)
+        {
+            release();
+            pool = other.pool;
+            buffer = other.buffer;
+            msg = other.msg;
+            topic_name = other.topic_name;
+            other.pool = 0;
+            other.buffer = 0;
+            other.clear();
+        }
+        return *this;
+    }
+
+    OwnedMessage(const OwnedMessage&) = delete;
+    OwnedMessage& operator=(const OwnedMessage&) = delete;
+
+    ~OwnedMessage()
+    {
+        release();
+    }
+
+    explicit operator bool() const
+    {
+        return buffer != 0;
+    }
+
+    const Message& message() const
+    {
+        return msg;
+    }
+
+    const MQTTString& topicName() const
+    {
+        return topic_name;
+    }
+
+#if __cplusplus >= 201703L
+    std::string_view topic() const
+    {
+        return std::string_view(topic_name.lenstring.data, topic_name.lenstring.len);
+    }
+#endif
+#if __cplusplus >= 202002L
+    std::span<const unsigned char> payload() const
+    {
+        return std::span<const unsigned char>((const unsigned char*)msg.payload, msg.payloadlen);
+    }
+#endif
+
+    // put the buffer back in its pool, leaving the message empty
+    void release()
+    {
+        if (buffer != 0)
+            pool->put(buffer);
+        pool = 0;
+        buffer = 0;
+        clear();
+    }
+
+private:
+    void clear()
+    {
+        MQTTString empty = MQTTString_initializer;
+
+        memset(&msg, '\0', sizeof(msg));
+        topic_name = empty;
+    }
+
+    BufferPool* pool;
+    unsigned char* buffer;      // which the topic name and payload are in
+    Message msg;
+    MQTTString topic_name;
+};
+
+}
+
+#endif
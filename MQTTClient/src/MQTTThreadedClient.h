@@ -0,0 +1,866 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTTHREADEDCLIENT_H)
+#define MQTTTHREADEDCLIENT_H
+
+#if __cplusplus < 201103L
+    #error "MQTTThreadedClient.h needs a C++11 compiler"
+#endif
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <string.h>
+#include "MQTTClient.h"
+
+/** Example of publishing from several threads at once
+ * @code
+ *  MQTT::ThreadedClient<IPStack, Countdown> client(ipstack);
+ *
+ *  client.connect(options).get();
+ *  ...
+ *  // on any thread
+ *  std::future<int> rc = client.publish("a/topic", message);   // returns once the publish is queued
+ *  ...
+ *  if (rc.get() != MQTT::SUCCESS)                              // waits for the PUBACK
+ * @endcode
+ */
+
+namespace MQTT
+{
+
+
+/**
+ * @class ThreadedClient
+ * @brief An MQTT client which can be used from any number of threads at once.  A reader thread of
+ * its own, started by connect, reads all the packets which arrive, calls the message handlers,
+ * and completes the operations waiting for acks.  The other operations serialize their packets
+ * into a send queue, and return a future for the result of the operation without waiting for
+ * anything to be read.  Whichever thread finds nobody writing the queue writes it, along with
+ * any packets queued by other threads meanwhile.
+ *
+ * The Network must allow one thread to read while another writes, as sockets do.  Message
+ * handlers are called on the reader thread, so must not wait for the future of an operation,
+ * nor call connect or disconnect.
+ */
+template<class Network, class Timer, int MAX_PACKET_SIZE = 1000, int MAX_MESSAGE_HANDLERS = 5,
+    int SEND_QUEUE_SIZE = 4 * MAX_PACKET_SIZE>
+class ThreadedClient
+{
+public:
+
+    /** Construct the client
+     *  @param network - an instance of the Network class - must be connected to the endpoint
+     *      before calling connect
+     *  @param command_timeout_ms - how long each operation can wait to complete
+     */
+    ThreadedClient(Network& network, unsigned int command_timeout_ms = 30000);
+
+    // stops the reader thread, without disconnecting
+    ~ThreadedClient();
+
+    /** MQTT Connect - starts the reader thread
+     *  @param options - connect options
+     *  @return the CONNACK return code, or FAILURE
+     */
+    std::future<int> connect(MQTTPacket_connectData& options);
+
+    /** MQTT Publish - complete when the publish is written for QoS 0, when the PUBACK arrives for
+     *  QoS 1, or the PUBCOMP for QoS 2.  The topic name and payload are copied into the send
+     *  queue, so need not last until the operation completes.
+     *  @param topicName - the topic to publish to
+     *  @param message - the message to send
+     */
+    std::future<int> publish(const char* topicName, Message& message);
+
+    std::future<int> publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos = QOS0, bool retained = false)
+    {
+        Message message;
+
+        message.qos = qos;
+        message.retained = retained;
+        message.dup = false;
+        message.id = 0;
+        message.payload = payload;
+        message.payloadlen = payloadlen;
+        return publish(topicName, message);
+    }
+
+    /** MQTT Subscribe - the result is the granted QoS, or FAILURE.  The message handler is set
+     *  for the topic filter when the SUBACK arrives.
+     *  @param topicFilter - a topic pattern which can include wildcards, which must last as long
+     *      as the subscription
+     *  @param qos - the maximum QoS to receive messages at
+     *  @param mh - the callback for messages which match the topic filter
+     */
+    std::future<int> subscribe(const char* topicFilter, enum QoS qos, const MessageDelegate& mh);
+
+    /** MQTT Unsubscribe - the message handler for the topic filter is removed when the UNSUBACK
+     *  arrives
+     *  @param topicFilter - the topic filter to unsubscribe from
+     */
+    std::future<int> unsubscribe(const char* topicFilter);
+
+    /** MQTT Disconnect - waits until the disconnect is written, then stops the reader thread.
+     *  Operations still waiting for acks then fail.
+     *  @return success code
+     */
+    int disconnect();
+
+    /** Set the default message handling callback - used for any message which does not match a
+     *  subscription message handler.  Only to be called before connect.
+     *  @param mh - the callback.  Set to 0 to remove.
+     */
+    void setDefaultMessageHandler(const MessageDelegate& mh)
+    {
+        defaultMessageHandler = mh;
+    }
+
+    bool isConnected()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return isconnected;
+    }
+
+private:
+
+    static const int POLL_MS = 100;     // how often the reader thread looks at timeouts and keepalives
+
+    // an operation waiting for an ack
+    struct Pending
+    {
+        Pending() : type(0), sequence(0), topicFilter(0)
+        {
+        }
+
+        int type;                       // of the packet which completes it
+        unsigned long sequence;         // which operation this is, to match its timeout with
+        std::promise<int> promise;
+        const char* topicFilter;        // of a subscribe or unsubscribe
+        MessageDelegate handler;
+    };
+
+    struct Timeout
+    {
+        unsigned short id;
+        unsigned long sequence;
+        Timer deadline;
+    };
+
+    template<class Serialize>
+    std::future<int> start(int type, const char* topicFilter, const MessageDelegate& mh, Serialize serialize);
+    template<class Serialize>
+    int enqueue(std::unique_lock<std::mutex>& lock, Serialize serialize, std::promise<int>* whenWritten);
+    void flush();
+    int writeBuffer(unsigned char* buf, int length, Timer& timer);
+    void complete(unsigned short id, int type, int rc);
+    void stop();
+    void closeSession();
+    void run();
+    int readPacket();
+    int decodePacket(int* value, int timeout);
+    int handlePacket(int packet_type);
+    int sendAck(int type, unsigned short id);
+    int keepalive();
+    void expire();
+    int deliverMessage(MQTTString& topicName, Message& message);
+    int setMessageHandler(const char* topicFilter, const MessageDelegate& mh);
+    unsigned short nextId();
+
+    static std::future<int> failed()
+    {
+        std::promise<int> promise;
+
+        promise.set_value(FAILURE);
+        return promise.get_future();
+    }
+
+    Network& ipstack;
+    unsigned long command_timeout_ms;
+
+    std::mutex mutex;                   // for everything below, except what only the reader thread uses
+    std::condition_variable space;      // in the send queue
+    std::thread reader;
+
+    unsigned char sendbufs[2][SEND_QUEUE_SIZE];  // one is written while packets are queued in the other
+    int active;                         // the one packets are queued in
+    int queued;                         // the end of the packets in it
+    std::vector<std::promise<int> > written[2];  // complete once each buffer has been written
+    bool writing;                       // a thread is writing the send queue
+
+    std::map<unsigned short, Pending> pending;   // operations waiting for acks, by packet id
+    std::deque<Timeout> timeouts;       // of the pending operations, in the order they started
+    unsigned long sequence;
+    PacketId packetid;
+    KeepaliveJitter jitter;
+
+    bool running;                       // the reader thread has been started, and not told to stop
+    bool isconnected;
+    unsigned int keepAliveInterval;
+    long keepalive_ms;
+    bool ping_outstanding;
+    Timer last_sent, ping_sent;
+
+    // only used by the reader thread
+    unsigned char readbuf[MAX_PACKET_SIZE];
+    Timer last_received;
+    struct MessageHandlers
+    {
+        const char* topicFilter;
+        MessageDelegate fp;
+    } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
+    MessageDelegate defaultMessageHandler;
+    IncomingQoS2Ids incomingQoS2;
+};
+
+}
+
+
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int c>
+MQTT::ThreadedClient<Network, Timer, a, MAX_MESSAGE_HANDLERS, c>::ThreadedClient(Network& network, unsigned int command_timeout_ms)
+    : ipstack(network), packetid(), jitter(this)
+{
+    this->command_timeout_ms = command_timeout_ms;
+    active = queued = 0;
+    writing = false;
+    sequence = 0;
+    running = isconnected = false;
+    keepAliveInterval = 0;
+    keepalive_ms = 0;
+    ping_outstanding = false;
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+        messageHandlers[i].topicFilter = 0;
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+MQTT::ThreadedClient<Network, Timer, a, b, c>::~ThreadedClient()
+{
+    stop();
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+std::future<int> MQTT::ThreadedClient<Network, Timer, a, b, c>::connect(MQTTPacket_connectData& options)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::future<int> result;
+
+    if (running)
+        return failed();
+    if (reader.joinable())
+    {
+        lock.unlock();
+        reader.join();  // the reader thread of the last connection, which has stopped
+        lock.lock();
+    }
+
+    keepAliveInterval = options.keepAliveInterval;
+    keepalive_ms = jitter.apply(keepAliveInterval * 1000L);
+    ping_outstanding = false;
+    incomingQoS2.clear();
+    running = true;
+
+    Pending& op = pending[0];   // the CONNACK has no packet id
+    Timeout timeout = {0, ++sequence, Timer(command_timeout_ms)};
+    op.type = CONNACK;
+    op.sequence = timeout.sequence;
+    result = op.promise.get_future();
+    timeouts.push_back(timeout);
+    if (enqueue(lock, [&](unsigned char* buf, int buflen) { return MQTTSerialize_connect(buf, buflen, &options); }, 0) != SUCCESS)
+    {
+        complete(0, CONNACK, FAILURE);
+        running = false;
+        return result;
+    }
+    if (keepAliveInterval > 0)
+        last_received.countdown_ms(keepalive_ms);
+    reader = std::thread(&ThreadedClient::run, this);
+    lock.unlock();
+
+    flush();
+    return result;
+}
+
+
+// start an operation which completes when an ack of type arrives
+template<class Network, class Timer, int a, int b, int c>
+template<class Serialize>
+std::future<int> MQTT::ThreadedClient<Network, Timer, a, b, c>::start(int type, const char* topicFilter,
+    const MessageDelegate& mh, Serialize serialize)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::future<int> result;
+    unsigned short id = 0;
+
+    if (!isconnected || (id = nextId()) == 0)
+        return failed();
+
+    // added before the packet is queued, so the ack can't arrive first.  While enqueue waits for
+    // room, the connection could be lost and the operation failed, so op is not used after it.
+    Pending& op = pending[id];
+    Timeout timeout = {id, ++sequence, Timer(command_timeout_ms)};
+    op.type = type;
+    op.sequence = timeout.sequence;
+    op.topicFilter = topicFilter;
+    op.handler = mh;
+    result = op.promise.get_future();
+    timeouts.push_back(timeout);
+    if (enqueue(lock, [&](unsigned char* buf, int buflen) { return serialize(buf, buflen, id); }, 0) != SUCCESS)
+        complete(id, type, FAILURE);
+    lock.unlock();
+
+    flush();
+    return result;
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+std::future<int> MQTT::ThreadedClient<Network, Timer, a, b, c>::publish(const char* topicName, Message& message)
+{
+    MQTTString topic = MQTTString_initializer;
+
+    topic.cstring = (char*)topicName;
+    if (message.qos != QOS0)
+    {
+        return start((message.qos == QOS1) ? PUBACK : PUBCOMP, 0, MessageDelegate(),
+            [&](unsigned char* buf, int buflen, unsigned short id) {
+                return MQTTSerialize_publish(buf, buflen, 0, message.qos, message.retained, id, topic,
+                    (unsigned char*)message.payload, message.payloadlen);
+            });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    std::promise<int> promise;
+    std::future<int> result = promise.get_future();
+
+    if (!isconnected)
+        return failed();
+    if (enqueue(lock, [&](unsigned char* buf, int buflen) {
+                return MQTTSerialize_publish(buf, buflen, 0, QOS0, message.retained, 0, topic,
+                    (unsigned char*)message.payload, message.payloadlen);
+            }, &promise) != SUCCESS)
+        return failed();
+    lock.unlock();
+
+    flush();
+    return result;
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+std::future<int> MQTT::ThreadedClient<Network, Timer, a, b, c>::subscribe(const char* topicFilter, enum QoS qos, const MessageDelegate& mh)
+{
+    MQTTString topic = MQTTString_initializer;
+    int requestedQoS = qos;
+
+    topic.cstring = (char*)topicFilter;
+    return start(SUBACK, topicFilter, mh, [&](unsigned char* buf, int buflen, unsigned short id) {
+        return MQTTSerialize_subscribe(buf, buflen, 0, id, 1, &topic, &requestedQoS);
+    });
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+std::future<int> MQTT::ThreadedClient<Network, Timer, a, b, c>::unsubscribe(const char* topicFilter)
+{
+    MQTTString topic = MQTTString_initializer;
+
+    topic.cstring = (char*)topicFilter;
+    return start(UNSUBACK, topicFilter, MessageDelegate(), [&](unsigned char* buf, int buflen, unsigned short id) {
+        return MQTTSerialize_unsubscribe(buf, buflen, 0, id, 1, &topic);
+    });
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+int MQTT::ThreadedClient<Network, Timer, a, b, c>::disconnect()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::promise<int> promise;
+    std::future<int> result = promise.get_future();
+    int rc = FAILURE;
+
+    if (!running)
+        return FAILURE;
+    isconnected = false;    // no more operations can start
+    rc = enqueue(lock, [](unsigned char* buf, int buflen) { return MQTTSerialize_disconnect(buf, buflen); }, &promise);
+    lock.unlock();
+
+    if (rc == SUCCESS)
+    {
+        flush();
+        rc = result.get();
+    }
+    stop();
+    return rc;
+}
+
+
+// add a packet to the send queue, waiting for room if other threads' packets fill it
+template<class Network, class Timer, int a, int b, int SEND_QUEUE_SIZE>
+template<class Serialize>
+int MQTT::ThreadedClient<Network, Timer, a, b, SEND_QUEUE_SIZE>::enqueue(std::unique_lock<std::mutex>& lock,
+    Serialize serialize, std::promise<int>* whenWritten)
+{
+    int len = 0;
+
+    while ((len = serialize(&sendbufs[active][queued], SEND_QUEUE_SIZE - queued)) <= 0)
+    {
+        if (queued == 0 || !running)
+            return FAILURE;     // too big for the queue, or the connection has gone
+        space.wait(lock);       // the thread which queued the packets before this one writes them
+    }
+    queued += len;
+    if (whenWritten)
+        written[active].push_back(std::move(*whenWritten));
+    return SUCCESS;
+}
+
+
+// write the send queue, unless another thread is writing it already, until it is empty
+template<class Network, class Timer, int a, int b, int c>
+void MQTT::ThreadedClient<Network, Timer, a, b, c>::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (writing)
+        return;     // the packets just queued will be written by that thread
+    writing = true;
+    while (queued > 0)
+    {
+        int buf = active,
+            len = queued,
+            rc = FAILURE;
+        std::vector<std::promise<int> > done;
+
+        done.swap(written[buf]);
+        active = 1 - active;
+        queued = 0;
+        if (running)
+        {
+            Timer timer(command_timeout_ms);
+
+            lock.unlock();
+            rc = writeBuffer(sendbufs[buf], len, timer);
+            lock.lock();
+        }
+        if (rc == SUCCESS && keepAliveInterval > 0)
+            last_sent.countdown_ms(keepalive_ms);
+        else if (rc != SUCCESS)
+            running = false;    // the reader thread closes the session
+        for (size_t i = 0; i < done.size(); ++i)
+            done[i].set_value(rc);
+        space.notify_all();
+    }
+    writing = false;
+}
+
+
+// write whole packets from buf
+template<class Network, class Timer, int a, int b, int c>
+int MQTT::ThreadedClient<Network, Timer, a, b, c>::writeBuffer(unsigned char* buf, int length, Timer& timer)
+{
+    int rc = SUCCESS,
+        sent = 0;
+
+    while (sent < length)
+    {
+        rc = ipstack.write(&buf[sent], length - sent, timer.left_ms());
+        if (rc < 0)  // there was an error writing the data
+            break;
+        sent += rc;
+        if (timer.expired()) // only check expiry after at least one attempt to write
+            break;
+    }
+    return (sent == length) ? SUCCESS : FAILURE;
+}
+
+
+// called with the mutex held
+template<class Network, class Timer, int a, int b, int c>
+void MQTT::ThreadedClient<Network, Timer, a, b, c>::complete(unsigned short id, int type, int rc)
+{
+    typename std::map<unsigned short, Pending>::iterator it = pending.find(id);
+
+    if (it == pending.end() || it->second.type != type)
+        return;     // a duplicate ack, or one for an operation which has timed out
+    it->second.promise.set_value(rc);
+    pending.erase(it);
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+void MQTT::ThreadedClient<Network, Timer, a, b, c>::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    if (reader.joinable() && reader.get_id() != std::this_thread::get_id())
+        reader.join();
+}
+
+
+// fail the operations waiting for acks.  The reader thread ends after this.
+template<class Network, class Timer, int a, int b, int c>
+void MQTT::ThreadedClient<Network, Timer, a, b, c>::closeSession()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    running = isconnected = false;
+    for (typename std::map<unsigned short, Pending>::iterator it = pending.begin(); it != pending.end(); ++it)
+        it->second.promise.set_value(FAILURE);
+    pending.clear();
+    timeouts.clear();
+    space.notify_all();
+}
+
+
+// the reader thread
+template<class Network, class Timer, int a, int b, int c>
+void MQTT::ThreadedClient<Network, Timer, a, b, c>::run()
+{
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running)
+                break;
+        }
+        int packet_type = readPacket();
+        if (packet_type < 0 || (packet_type > 0 && handlePacket(packet_type) != SUCCESS) || keepalive() != SUCCESS)
+            break;
+        expire();
+    }
+    closeSession();
+}
+
+
+template<class Network, class Timer, int a, int b, int d>
+int MQTT::ThreadedClient<Network, Timer, a, b, d>::decodePacket(int* value, int timeout)
+{
+    unsigned char c;
+    int multiplier = 1;
+    int len = 0;
+    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+
+    *value = 0;
+    do
+    {
+        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+            goto exit; /* bad data */
+        if (ipstack.read(&c, 1, timeout) != 1)
+            goto exit;
+        *value += (c & 127) * multiplier;
+        multiplier *= 128;
+    } while ((c & 128) != 0);
+exit:
+    return len;
+}
+
+
+// @return the MQTT packet type, 0 if none arrived within POLL_MS, or a negative value on error
+template<class Network, class Timer, int MAX_PACKET_SIZE, int b, int c>
+int MQTT::ThreadedClient<Network, Timer, MAX_PACKET_SIZE, b, c>::readPacket()
+{
+    Timer timer(command_timeout_ms);    // once a packet has started, for the rest of it
+    MQTTHeader header = {0};
+    int len = 1;
+    int rem_len = 0;
+    int rc = ipstack.read(readbuf, 1, POLL_MS);
+
+    if (rc != 1)
+        goto exit;
+
+    decodePacket(&rem_len, timer.left_ms());
+    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+    if (rem_len > MAX_PACKET_SIZE - len)
+    {
+        rc = BUFFER_OVERFLOW;
+        goto exit;
+    }
+    if (rem_len > 0 && ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len)
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+
+    header.byte = readbuf[0];
+    rc = header.bits.type;
+    if (keepAliveInterval > 0)
+        last_received.countdown_ms(keepalive_ms);
+exit:
+    return rc;
+}
+
+
+// queue an ack for a packet which has arrived, and write it
+template<class Network, class Timer, int a, int b, int c>
+int MQTT::ThreadedClient<Network, Timer, a, b, c>::sendAck(int type, unsigned short id)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    int rc = enqueue(lock, [&](unsigned char* buf, int buflen) { return MQTTSerialize_ack(buf, buflen, type, 0, id); }, 0);
+
+    lock.unlock();
+    if (rc == SUCCESS)
+        flush();
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_PACKET_SIZE, int b, int c>
+int MQTT::ThreadedClient<Network, Timer, MAX_PACKET_SIZE, b, c>::handlePacket(int packet_type)
+{
+    int rc = SUCCESS;
+
+    switch (packet_type)
+    {
+        case CONNACK:
+        {
+            unsigned char connack_rc = 255;
+            unsigned char sessionPresent = 0;
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, readbuf, MAX_PACKET_SIZE) != 1)
+                rc = FAILURE;
+            else if (connack_rc == 0)
+                isconnected = true;
+            else
+                running = false;
+            complete(0, CONNACK, (rc == SUCCESS) ? connack_rc : rc);
+            break;
+        }
+        case PUBACK:
+        case PUBCOMP:
+        case UNSUBACK:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+
+            if (packet_type == UNSUBACK)
+            {
+                if (MQTTDeserialize_unsuback(&mypacketid, readbuf, MAX_PACKET_SIZE) != 1)
+                    return FAILURE;
+            }
+            else if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_PACKET_SIZE) != 1)
+                return FAILURE;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            typename std::map<unsigned short, Pending>::iterator it = pending.find(mypacketid);
+            if (packet_type == UNSUBACK && it != pending.end() && it->second.type == UNSUBACK)
+                setMessageHandler(it->second.topicFilter, MessageDelegate());
+            complete(mypacketid, packet_type, SUCCESS);
+            break;
+        }
+        case SUBACK:
+        {
+            int count = 0;
+            int grantedQoS = -1;
+            unsigned short mypacketid;
+
+            if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, MAX_PACKET_SIZE) != 1)
+                return FAILURE;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            typename std::map<unsigned short, Pending>::iterator it = pending.find(mypacketid);
+            if (it == pending.end() || it->second.type != SUBACK)
+                break;
+            if (grantedQoS == 0x80 || setMessageHandler(it->second.topicFilter, it->second.handler) != SUCCESS)
+                grantedQoS = FAILURE;
+            complete(mypacketid, SUBACK, grantedQoS);
+            break;
+        }
+        case PUBLISH:
+        {
+            MQTTString topicName = MQTTString_initializer;
+            Message msg;
+            int intQoS;
+
+            msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
+            if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+                                 (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf, MAX_PACKET_SIZE) != 1)
+                return FAILURE;
+            msg.qos = (enum QoS)intQoS;
+            if (msg.qos != QOS2)
+                deliverMessage(topicName, msg);
+            else if (incomingQoS2.isFree(msg.id)) // not a duplicate of a message already delivered
+            {
+                if (incomingQoS2.use(msg.id))
+                    deliverMessage(topicName, msg);
+                else
+                    WARN("Maximum number of incoming QoS2 messages exceeded");
+            }
+            if (msg.qos != QOS0)
+                rc = sendAck((msg.qos == QOS1) ? PUBACK : PUBREC, msg.id);
+            break;
+        }
+        case PUBREC:
+        case PUBREL:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_PACKET_SIZE) != 1)
+                return FAILURE;
+            if (packet_type == PUBREL)
+                incomingQoS2.release(mypacketid);
+            rc = sendAck((packet_type == PUBREC) ? PUBREL : PUBCOMP, mypacketid);
+            break;
+        }
+        case PINGRESP:
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ping_outstanding = false;
+            break;
+        }
+    }
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+int MQTT::ThreadedClient<Network, Timer, a, b, c>::keepalive()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    int rc = SUCCESS;
+
+    if (keepAliveInterval == 0)
+        goto exit;
+
+    if (ping_outstanding)
+    {
+        if (ping_sent.expired())
+            rc = FAILURE; // session failure
+    }
+    else if (last_sent.expired() || last_received.expired())
+    {
+        rc = enqueue(lock, [](unsigned char* buf, int buflen) { return MQTTSerialize_pingreq(buf, buflen); }, 0);
+        if (rc == SUCCESS)
+        {
+            ping_outstanding = true;
+            ping_sent.countdown(keepAliveInterval);
+            lock.unlock();
+            flush();
+        }
+    }
+exit:
+    return rc;
+}
+
+
+// fail the operations whose acks have not arrived in time
+template<class Network, class Timer, int a, int b, int c>
+void MQTT::ThreadedClient<Network, Timer, a, b, c>::expire()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    while (!timeouts.empty() && timeouts.front().deadline.expired())
+    {
+        typename std::map<unsigned short, Pending>::iterator it = pending.find(timeouts.front().id);
+
+        if (it != pending.end() && it->second.sequence == timeouts.front().sequence)
+        {
+            it->second.promise.set_value(FAILURE);
+            pending.erase(it);
+        }
+        timeouts.pop_front();
+    }
+}
+
+
+template<class Network, class Timer, int a, int b, int c>
+unsigned short MQTT::ThreadedClient<Network, Timer, a, b, c>::nextId()
+{
+    unsigned short id = 0;
+
+    if (pending.size() < 65535)
+    {
+        do
+            id = packetid.getNext();
+        while (pending.count(id) != 0);
+    }
+    return id;
+}
+
+
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int c>
+int MQTT::ThreadedClient<Network, Timer, a, MAX_MESSAGE_HANDLERS, c>::deliverMessage(MQTTString& topicName, Message& message)
+{
+    int rc = FAILURE;
+
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
+                isTopicMatched(messageHandlers[i].topicFilter, topicName)))
+        {
+            if (messageHandlers[i].fp.attached())
+            {
+                MessageData md(topicName, message);
+                messageHandlers[i].fp(md);
+                rc = SUCCESS;
+            }
+        }
+    }
+
+    if (rc == FAILURE && defaultMessageHandler.attached())
+    {
+        MessageData md(topicName, message);
+        defaultMessageHandler(md);
+        rc = SUCCESS;
+    }
+
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int c>
+int MQTT::ThreadedClient<Network, Timer, a, MAX_MESSAGE_HANDLERS, c>::setMessageHandler(const char* topicFilter, const MessageDelegate& mh)
+{
+    int free_slot = -1;
+
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (messageHandlers[i].topicFilter == 0)
+        {
+            if (free_slot == -1)
+                free_slot = i;
+        }
+        else if (strcmp(messageHandlers[i].topicFilter, topicFilter) == 0)
+        {
+            if (mh.attached())
+                messageHandlers[i].fp = mh;
+            else
+            {
+                messageHandlers[i].topicFilter = 0;
+                messageHandlers[i].fp.detach();
+            }
+            return SUCCESS;
+        }
+    }
+    if (!mh.attached())
+        return SUCCESS;
+    if (free_slot == -1)
+        return FAILURE;
+    messageHandlers[free_slot].topicFilter = topicFilter;
+    messageHandlers[free_slot].fp = mh;
+    return SUCCESS;
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(TOPICFILTER_H)
+#define TOPICFILTER_H
+
+#include <string.h>
+#include "MQTTPacket.h"
+
+#if !defined(MQTT_TOPIC_FILTER_LEVELS)
+    #define MQTT_TOPIC_FILTER_LEVELS 8  // the most levels a TopicFilter can have
+#endif
+
+#if __cplusplus >= 201402L
+    #define TOPICFILTER_CONSTEXPR constexpr
+#else
+    #define TOPICFILTER_CONSTEXPR
+#endif
+
+/** Example of a topic filter which is checked and split into levels by the compiler.  If the
+ *  filter were not valid, such as "sport/tennis#", the compiler would reject it, with an error
+ *  naming invalidTopicFilter.
+ * @code
+ *  static constexpr MQTT::TopicFilter scores("sport/+/scores");
+ *
+ *  client.subscribe(scores, MQTT::QOS1, messageArrived);
+ * @endcode
+ */
+
+namespace MQTT
+{
+
+
+/**
+ * @class TopicFilter
+ * @brief A topic filter split into its levels, so that a topic name is matched against it with
+ * a memcmp for each level, rather than by scanning the filter character by character.  With
+ * C++14 or later, a TopicFilter declared constexpr is checked and split by the compiler.
+ * Otherwise, it is when it is constructed, and an invalid filter matches nothing.
+ */
+class TopicFilter
+{
+public:
+    /** Split the topic filter into its levels
+     *  @param topicFilter - the filter, which must last as long as the TopicFilter
+     */
+    explicit TOPICFILTER_CONSTEXPR TopicFilter(const char* topicFilter) : filter(topicFilter), count(0), levels()
+    {
+        int start = 0;
+
+        if (filter[0] == '\0')
+        {
+            invalidTopicFilter();   // a filter must be at least one character
+            return;
+        }
+        for (int i = 0; ; ++i)
+        {
+            if (filter[i] != '/' && filter[i] != '\0')
+                continue;
+            if (count == MQTT_TOPIC_FILTER_LEVELS)
+            {
+                invalidTopicFilter();   // more levels than MQTT_TOPIC_FILTER_LEVELS
+                return;
+            }
+            levels[count].offset = (unsigned short)start;
+            if (i - start == 1 && filter[start] == '+')
+                levels[count].length = PLUS;
+            else if (i - start == 1 && filter[start] == '#' && filter[i] == '\0')
+                levels[count].length = HASH;
+            else
+            {
+                for (int j = start; j < i; ++j)
+                {
+                    if (filter[j] == '+' || filter[j] == '#')
+                    {
+                        invalidTopicFilter();   // a wildcard must be a whole level, and # the last
+                        return;
+                    }
+                }
+                levels[count].length = (unsigned short)(i - start);
+            }
+            ++count;
+            if (filter[i] == '\0')
+                break;
+            start = i + 1;
+        }
+    }
+
+    /** Does the topic name match the filter, as isTopicMatched would find it?
+     *  @param topicName - the topic name of a received message
+     */
+    bool matches(const MQTTString& topicName) const
+    {
+        const char* cur = topicName.lenstring.data;
+        const char* end = cur + topicName.lenstring.len;
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (i > 0)
+            {
+                if (cur == end)
+                    return false;   // the topic name has fewer levels
+                ++cur;              // the separator
+            }
+            const char* level_end = (const char*)memchr(cur, '/', end - cur);
+            if (level_end == 0)
+                level_end = end;
+            if (levels[i].length == HASH)
+                return level_end > cur;
+            else if (levels[i].length == PLUS)
+            {
+                if (level_end == cur)
+                    return false;
+            }
+            else if (level_end - cur != levels[i].length || memcmp(cur, &filter[levels[i].offset], levels[i].length) != 0)
+                return false;
+            cur = level_end;
+        }
+        return count > 0 && cur == end;
+    }
+
+    TOPICFILTER_CONSTEXPR bool valid() const
+    {
+        return count > 0;
+    }
+
+    TOPICFILTER_CONSTEXPR const char* c_str() const
+    {
+        return filter;
+    }
+
+private:
+
+    enum { PLUS = 0xFFFF, HASH = 0xFFFE };  // the lengths of wildcard levels
+
+    // not constexpr, so a constexpr TopicFilter which gets here is rejected by the compiler
+    void invalidTopicFilter()
+    {
+        count = -1;
+    }
+
+    struct Level
+    {
+        TOPICFILTER_CONSTEXPR Level() : offset(0), length(0)
+        {
+        }
+
+        unsigned short offset;
+        unsigned short length;
+    };
+
+    const char* filter;
+    int count;
+    Level levels[MQTT_TOPIC_FILTER_LEVELS];
+};
+
+}
+
+#endif
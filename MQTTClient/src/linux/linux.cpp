@@ -15,11 +15,16 @@
  *    Ian Craggs - ensure read returns if no bytes read
  *******************************************************************************/
 
+#if !defined(MQTT_LINUX_CPP)
+#define MQTT_LINUX_CPP
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -28,6 +33,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -37,63 +44,111 @@
 class IPStack
 {
 public:
-  IPStack()
+  // socket options for connect.  0 leaves the system default.
+  struct Options
+  {
+    Options() : nodelay(false), quickack(false), sndbuf(0), rcvbuf(0), busy_poll_us(0), user_timeout_ms(0),
+      keepalive_idle_s(0), keepalive_interval_s(0), keepalive_count(0), connect_timeout_ms(0)
+    { }
+
+    bool nodelay;             // TCP_NODELAY: write small packets at once rather than waiting for acks (Nagle)
+    bool quickack;            // TCP_QUICKACK: ack incoming data at once rather than delaying the ack
+    int sndbuf;               // SO_SNDBUF, in bytes
+    int rcvbuf;               // SO_RCVBUF, in bytes
+    int busy_poll_us;         // SO_BUSY_POLL: time to busy wait for data on a blocking read
+    int user_timeout_ms;      // TCP_USER_TIMEOUT: how long written data can stay unacked before the connection fails
+    int keepalive_idle_s;     // TCP keepalive probes start after this much idle time...
+    int keepalive_interval_s; // ...are sent this often...
+    int keepalive_count;      // ...and this many can be unanswered before the connection fails
+    int connect_timeout_ms;   // time allowed for the TCP connect to all the addresses, 0 for 30 seconds
+  };
+
+  static const int MAX_ADDRESSES = 16;              // addresses of a host name which are tried in a connect
+  static const int CONNECT_ATTEMPT_DELAY_MS = 250;  // RFC 8305: before starting the connect to the next address
+  static const int WRITEV_BUFFERS = 8;              // the most buffers written by one call to writev
+
+  IPStack() : mysock(-1), quickack(false)
   {
 		signal(SIGPIPE, SIG_IGN);
   }
 
-  int connect(const char* hostname, int port)
+  // Happy Eyeballs (RFC 8305): start a connect to each address of the host in turn, without waiting for
+  // the one before to fail for longer than CONNECT_ATTEMPT_DELAY_MS, and keep the first to succeed.
+  // The connect fails if an option can't be set: SO_BUSY_POLL, for instance, can need CAP_NET_ADMIN.
+  // A hostname of "unix:" and a path connects over a unix domain socket instead, and the port is not used
+  int connect(const char* hostname, int port, const Options& options = Options())
   {
-		int type = SOCK_STREAM;
-		struct sockaddr_in address;
-		int rc = -1;
-		sa_family_t family = AF_INET;
-		struct addrinfo *result = NULL;
-		struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
-
-		if ((rc = getaddrinfo(hostname, NULL, &hints, &result)) == 0)
+		if (strncmp(hostname, "unix:", 5) == 0)
+			return connectUnix(hostname + 5, options);
+
+		struct addrinfo hints = {AI_NUMERICSERV, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+		struct addrinfo* result = NULL;
+		struct addrinfo* addresses[MAX_ADDRESSES];
+		struct pollfd fds[MAX_ADDRESSES];
+		int count = 0, started = 0, pending = 0;
+		char service[8];
+
+		snprintf(service, sizeof(service), "%d", port);
+		if (getaddrinfo(hostname, service, &hints, &result) != 0)
+			return -1;
+		count = orderAddresses(result, addresses);
+
+		long deadline = now_ms() + ((options.connect_timeout_ms > 0) ? options.connect_timeout_ms : 30000);
+		long next_attempt = 0;
+		mysock = -1;
+		while (mysock == -1 && (started < count || pending > 0) && now_ms() < deadline)
 		{
-			struct addrinfo* res = result;
-
-			/* prefer ip4 addresses */
-			while (res)
+			if (started < count && (pending == 0 || now_ms() >= next_attempt))
 			{
-				if (res->ai_family == AF_INET)
+				bool connected = false;
+				int attempt = startConnect(addresses[started++], options, connected);
+
+				if (connected)
+					mysock = attempt;
+				else if (attempt != -1)
 				{
-					result = res;
-					break;
+					fds[pending].fd = attempt;
+					fds[pending].events = POLLOUT;
+					fds[pending++].revents = 0;
+					next_attempt = now_ms() + CONNECT_ATTEMPT_DELAY_MS;
 				}
-				res = res->ai_next;
+				else
+					next_attempt = 0; // failed already, so go straight on to the next
+				continue;
 			}
-
-			if (result->ai_family == AF_INET)
+			long wait_ms = deadline - now_ms();
+			if (started < count && next_attempt - now_ms() < wait_ms)
+				wait_ms = next_attempt - now_ms();
+			if (poll(fds, pending, (wait_ms > 0) ? (int)wait_ms : 0) == -1 && errno != EINTR)
+				break;
+			for (int i = 0; i < pending && mysock == -1; ++i)
 			{
-				address.sin_port = htons(port);
-				address.sin_family = family = AF_INET;
-				address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
+				int error = 0;
+				socklen_t len = sizeof(error);
+
+				if (fds[i].revents == 0)
+					continue;
+				if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+					mysock = fds[i].fd;
+				else
+					::close(fds[i].fd);
+				fds[i--] = fds[--pending]; // this attempt has finished
 			}
-			else
-				rc = -1;
-
-			freeaddrinfo(result);
+			if (mysock == -1 && pending == 0)
+				next_attempt = 0; // they have all failed, so start the next one now
 		}
-
-		if (rc == 0)
-		{
-			mysock = socket(family, type, 0);
-			if (mysock != -1)
-			{
-				int opt = 1;
-
-				//if (setsockopt(mysock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
-				//	printf("Could not set SO_NOSIGPIPE for socket %d", mysock);
-
-				rc = ::connect(mysock, (struct sockaddr*)&address, sizeof(address));
-			}
-		}
-
-        return rc;
-    }
+		for (int i = 0; i < pending; ++i)
+			::close(fds[i].fd);
+		freeaddrinfo(result);
+
+		if (mysock == -1)
+			return -1;
+		fcntl(mysock, F_SETFL, fcntl(mysock, F_GETFL) & ~O_NONBLOCK); // the read and write timeouts rely on blocking mode
+#if defined(TCP_QUICKACK)
+		quickack = options.quickack;
+#endif
+		return 0;
+  }
 
   // return -1 on error, or the number of bytes read
   // which could be 0 on a read timeout
@@ -126,6 +181,10 @@ public:
       if (rc == 0)
         break;
 		}
+#if defined(TCP_QUICKACK)
+		if (quickack) // has to be set again after each read
+			setOption(mysock, IPPROTO_TCP, TCP_QUICKACK, 1);
+#endif
 		return bytes;
   }
 
@@ -142,14 +201,185 @@ public:
 		return rc;
   }
 
+  // write several buffers with one system call - any type with data and len members, such as MQTT::IOBuffer
+  template<class Buffer>
+  int writev(const Buffer* buffers, int count, int timeout_ms)
+  {
+		struct iovec iov[WRITEV_BUFFERS];
+		struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+		if (count > WRITEV_BUFFERS)
+			count = WRITEV_BUFFERS;   // the rest are written by the next call
+		for (int i = 0; i < count; ++i)
+		{
+			iov[i].iov_base = (void*)buffers[i].data;
+			iov[i].iov_len = (size_t)buffers[i].len;
+		}
+		setsockopt(mysock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(struct timeval));
+		return (int)::writev(mysock, iov, count);
+  }
+
 	int disconnect()
 	{
 		return ::close(mysock);
 	}
 
+  // the process, user and group of the other end of a unix domain socket, which fails for TCP
+  int peerCredentials(pid_t& pid, uid_t& uid, gid_t& gid)
+  {
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+
+		// a TCP socket has no credentials, which it returns as a pid of 0
+		if (getsockopt(mysock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.pid == 0)
+			return -1;
+		pid = cred.pid;
+		uid = cred.uid;
+		gid = cred.gid;
+		return 0;
+  }
+
+  // give up the connected socket, to another transport, which closes it
+  int release()
+  {
+		int sock = mysock;
+
+		mysock = -1;
+		return sock;
+  }
+
 private:
 
+  // a server on this host, with no TCP/IP: "unix:/path", or "unix:@name" in the abstract namespace.  Only
+  // the buffer sizes and the connect timeout apply, which is how long to wait if the listen backlog is full
+  int connectUnix(const char* path, const Options& options)
+  {
+		struct sockaddr_un address;
+		size_t pathlen = strlen(path);
+		int timeout_ms = (options.connect_timeout_ms > 0) ? options.connect_timeout_ms : 30000;
+		struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+		if (pathlen == 0 || pathlen >= sizeof(address.sun_path))
+			return -1;
+		memset(&address, '\0', sizeof(address));
+		address.sun_family = AF_UNIX;
+		memcpy(address.sun_path, path, pathlen);
+		if (path[0] == '@')
+			address.sun_path[0] = '\0'; // abstract names are not null terminated
+		socklen_t len = offsetof(struct sockaddr_un, sun_path) + pathlen + (path[0] != '@');
+
+		if ((mysock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			return -1;
+		if (setOption(mysock, SOL_SOCKET, SO_SNDBUF, options.sndbuf) != 0 ||
+			setOption(mysock, SOL_SOCKET, SO_RCVBUF, options.rcvbuf) != 0 ||
+			setsockopt(mysock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv)) != 0 ||
+			::connect(mysock, (struct sockaddr*)&address, len) != 0)
+		{
+			::close(mysock);
+			mysock = -1;
+			return -1;
+		}
+#if defined(TCP_QUICKACK)
+		quickack = false;
+#endif
+		return 0;
+  }
+
+  // set one socket option if it is wanted
+  static int setOption(int sock, int level, int name, int value)
+  {
+		if (value == 0)
+			return 0;
+		return setsockopt(sock, level, name, &value, sizeof(value));
+  }
+
+  // options which this platform does not have are ignored
+  static int setOptions(int sock, const Options& options)
+  {
+		int rc = 0;
+
+		rc |= setOption(sock, IPPROTO_TCP, TCP_NODELAY, options.nodelay);
+		rc |= setOption(sock, SOL_SOCKET, SO_SNDBUF, options.sndbuf);
+		rc |= setOption(sock, SOL_SOCKET, SO_RCVBUF, options.rcvbuf);
+#if defined(TCP_QUICKACK)
+		rc |= setOption(sock, IPPROTO_TCP, TCP_QUICKACK, options.quickack);
+#endif
+#if defined(SO_BUSY_POLL)
+		rc |= setOption(sock, SOL_SOCKET, SO_BUSY_POLL, options.busy_poll_us);
+#endif
+#if defined(TCP_USER_TIMEOUT)
+		rc |= setOption(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, options.user_timeout_ms);
+#endif
+		if (options.keepalive_idle_s > 0)
+		{
+			rc |= setOption(sock, SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+			rc |= setOption(sock, IPPROTO_TCP, TCP_KEEPIDLE, options.keepalive_idle_s);
+			rc |= setOption(sock, IPPROTO_TCP, TCP_KEEPINTVL, options.keepalive_interval_s);
+			rc |= setOption(sock, IPPROTO_TCP, TCP_KEEPCNT, options.keepalive_count);
+#endif
+		}
+		return rc;
+  }
+
+  // start a non-blocking connect: returns the socket, or -1 if this address has failed already
+  static int startConnect(struct addrinfo* address, const Options& options, bool& connected)
+  {
+		int sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+
+		if (sock == -1)
+			return -1;
+		// options before connect, so that the buffer sizes set the window
+		if (setOptions(sock, options) != 0 || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+		{
+			::close(sock);
+			return -1;
+		}
+		connected = (::connect(sock, address->ai_addr, address->ai_addrlen) == 0);
+		if (!connected && errno != EINPROGRESS)
+		{
+			::close(sock);
+			sock = -1;
+		}
+		return sock;
+  }
+
+  // RFC 8305 ordering: alternate the address families, starting with the one that getaddrinfo prefers
+  static int orderAddresses(struct addrinfo* result, struct addrinfo** addresses)
+  {
+		struct addrinfo* preferred[MAX_ADDRESSES];
+		struct addrinfo* other[MAX_ADDRESSES];
+		int npreferred = 0, nother = 0, count = 0;
+
+		for (struct addrinfo* res = result; res; res = res->ai_next)
+		{
+			if (res->ai_family == result->ai_family)
+			{
+				if (npreferred < MAX_ADDRESSES)
+					preferred[npreferred++] = res;
+			}
+			else if (nother < MAX_ADDRESSES)
+				other[nother++] = res;
+		}
+		for (int i = 0; i < npreferred || i < nother; ++i)
+		{
+			if (i < npreferred && count < MAX_ADDRESSES)
+				addresses[count++] = preferred[i];
+			if (i < nother && count < MAX_ADDRESSES)
+				addresses[count++] = other[i];
+		}
+		return count;
+  }
+
+  static long now_ms()
+  {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		return now.tv_sec * 1000L + now.tv_usec / 1000;
+  }
+
     int mysock;
+    bool quickack;
 };
 
 
@@ -211,3 +441,5 @@ private:
 
 	struct timeval end_time;
 };
+
+#endif
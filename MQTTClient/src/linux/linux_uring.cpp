@@ -0,0 +1,909 @@
+/*******************************************************************************
+ * Copyright (c) 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+/*
+ An io_uring transport, for many clients in one thread, such as a gateway's.  Needs Linux 6.0 or
+ later, and 6.1 for zero copy sends.  The system calls are made directly, so liburing is not needed.
+
+ All the connections of an IOUring share its submission queue, so what they write is submitted
+ together, with one system call.  Each connection has a multishot receive, which stays armed for all
+ the data that arrives, into buffers the kernel picks from a ring of them shared by all the
+ connections.  So one system call both submits the writes of all the connections and collects what
+ all of them have received.
+
+ Example of many clients using one IOUring:
+
+	IOUring ring;
+	IOUringStack stacks[N] = ...;                  // each IOUringStack(ring)
+	MQTT::Client<IOUringStack, Countdown> clients[N] = ...;
+
+	stacks[i].connect(host, port);
+	clients[i].connect(data);
+	...
+	clients[i].publish(...);                      // QoS 0 publishes are copied, not yet written
+	...
+	ring.poll(100);                               // written and read, for all the clients at once
+	for (int i = 0; i < N; ++i)
+		if (stacks[i].readable())
+			clients[i].yield(0);
+
+ Neither class is thread safe: all the clients on an IOUring must be used from one thread.
+*/
+
+#if !defined(MQTT_LINUX_URING_CPP)
+#define MQTT_LINUX_URING_CPP
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "linux.cpp"
+
+class IOUringStack;
+
+
+class IOUring
+{
+public:
+  struct Options
+  {
+    Options() : entries(256), connections(64), sendbuf_size(8192), recv_buffers(512), recv_buffer_size(4096),
+      zerocopy_size(16384) { }
+
+    unsigned int entries;     // in the submission queue
+    int connections;          // the most IOUringStacks at once
+    int sendbuf_size;         // of each of the two registered send buffers of each connection
+    int recv_buffers;         // shared by all the connections for their receives, a power of 2
+    int recv_buffer_size;
+    int zerocopy_size;        // writes of at least this many bytes are sent with zero copy, 0 for never
+  };
+
+  IOUring(const Options& options = Options()) : opts(options)
+  {
+		signal(SIGPIPE, SIG_IGN);   // writes to sockets closed by the other end fail, rather than ending the program
+		init();
+		if (setup() != 0)
+			cleanup();
+  }
+
+  ~IOUring()
+  {
+		cleanup();
+  }
+
+  // false if this kernel has no io_uring, or not the features used
+  bool valid() const
+  {
+		return ring_fd != -1;
+  }
+
+  // submit what the connections have written, without waiting
+  int submit()
+  {
+		return enter(0, 0);
+  }
+
+  /** Submit what the connections have written, and wait for something to complete
+   *  @param timeout_ms - the longest time to wait, 0 not to wait
+   *  @return the number of completions, or -1 on error
+   */
+  int poll(int timeout_ms)
+  {
+		return enter(1, timeout_ms);
+  }
+
+  unsigned long systemCalls() const
+  {
+		return enters;
+  }
+
+  unsigned long zeroCopySends() const
+  {
+		return zerocopy_sends;
+  }
+
+  bool zeroCopy(int length) const
+  {
+		return zerocopy && opts.zerocopy_size > 0 && length >= opts.zerocopy_size;
+  }
+
+private:
+  friend class IOUringStack;
+
+  enum { RECV = 1, SEND = 2, ZEROCOPY = 3 };    // in the low bits of the user_data of each operation
+  static const int BUFFER_GROUP = 0;
+
+  void init()
+  {
+		ring_fd = -1;
+		sq_ring = cq_ring = MAP_FAILED;
+		sq_ring_size = cq_ring_size = 0;
+		sqes = (struct io_uring_sqe*)MAP_FAILED;
+		sqes_size = 0;
+		sendbufs = recvbufs = (unsigned char*)MAP_FAILED;
+		buf_ring = (struct io_uring_buf_ring*)MAP_FAILED;
+		buf_next = 0;
+		free_slots = 0;
+		free_count = 0;
+		dirty = starved = 0;
+		fixed_buffers = zerocopy = false;
+		enters = zerocopy_sends = 0;
+  }
+
+  int setup()
+  {
+		struct io_uring_params params;
+		struct iovec sendmem;
+		struct io_uring_buf_reg reg;
+		int rc = -1;
+
+		memset(&params, '\0', sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = opts.entries * 4;   // each multishot receive can complete many times
+		if ((ring_fd = (int)syscall(__NR_io_uring_setup, opts.entries, &params)) < 0)
+		{
+			ring_fd = -1;
+			goto exit;
+		}
+		if ((params.features & IORING_FEAT_EXT_ARG) == 0)
+			goto exit;  // for the timeout of io_uring_enter
+
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			sq_ring_size = cq_ring_size = (sq_ring_size > cq_ring_size) ? sq_ring_size : cq_ring_size;
+		sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ring == MAP_FAILED)
+			goto exit;
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ring = sq_ring;
+		else if ((cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+				IORING_OFF_CQ_RING)) == MAP_FAILED)
+			goto exit;
+		sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = (struct io_uring_sqe*)mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			goto exit;
+
+		sq_head = (unsigned*)((char*)sq_ring + params.sq_off.head);
+		sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+		sq_mask = *(unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+		sq_entries = params.sq_entries;
+		sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+		sqe_tail = *sq_tail;
+		cq_head = (unsigned*)((char*)cq_ring + params.cq_off.head);
+		cq_tail = (unsigned*)((char*)cq_ring + params.cq_off.tail);
+		cq_mask = *(unsigned*)((char*)cq_ring + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+
+		// the send buffers, registered so that the kernel need not map them for each write
+		sendbufs = (unsigned char*)mmap(0, (size_t)opts.connections * 2 * opts.sendbuf_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (sendbufs == MAP_FAILED)
+			goto exit;
+		sendmem.iov_base = sendbufs;
+		sendmem.iov_len = (size_t)opts.connections * 2 * opts.sendbuf_size;
+		fixed_buffers = (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &sendmem, 1) == 0);
+		free_slots = new int[opts.connections];
+		for (int i = 0; i < opts.connections; ++i)
+			free_slots[free_count++] = opts.connections - 1 - i;
+
+		// the receive buffers, in a ring which the kernel takes them from
+		if (opts.recv_buffers <= 0 || (opts.recv_buffers & (opts.recv_buffers - 1)) != 0)
+			goto exit;
+		recvbufs = (unsigned char*)mmap(0, (size_t)opts.recv_buffers * opts.recv_buffer_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		buf_ring = (struct io_uring_buf_ring*)mmap(0, opts.recv_buffers * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (recvbufs == MAP_FAILED || buf_ring == MAP_FAILED)
+			goto exit;
+		memset(&reg, '\0', sizeof(reg));
+		reg.ring_addr = (unsigned long)buf_ring;
+		reg.ring_entries = opts.recv_buffers;
+		reg.bgid = BUFFER_GROUP;
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+			goto exit;
+		buf_next = new int[opts.recv_buffers];
+		buf_len = new int[opts.recv_buffers];
+		buf_tail = 0;
+		for (int i = 0; i < opts.recv_buffers; ++i)
+			addBuffer(i);
+		publishBuffers();
+
+		zerocopy = probe(IORING_OP_SENDMSG_ZC);
+		rc = 0;
+exit:
+		return rc;
+  }
+
+  void cleanup()
+  {
+		if (ring_fd != -1)
+			::close(ring_fd);
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_size);
+		if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+			munmap(cq_ring, cq_ring_size);
+		if (sq_ring != MAP_FAILED)
+			munmap(sq_ring, sq_ring_size);
+		if (sendbufs != MAP_FAILED)
+			munmap(sendbufs, (size_t)opts.connections * 2 * opts.sendbuf_size);
+		if (recvbufs != MAP_FAILED)
+			munmap(recvbufs, (size_t)opts.recv_buffers * opts.recv_buffer_size);
+		if (buf_ring != MAP_FAILED)
+			munmap(buf_ring, opts.recv_buffers * sizeof(struct io_uring_buf));
+		if (buf_next)
+		{
+			delete [] buf_next;
+			delete [] buf_len;
+		}
+		delete [] free_slots;
+		init();
+  }
+
+  bool probe(int op)
+  {
+		size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+		struct io_uring_probe* p = (struct io_uring_probe*)calloc(1, size);
+		bool supported = false;
+
+		if (p && syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, p, 256) == 0)
+			supported = op <= p->last_op && (p->ops[op].flags & IO_URING_OP_SUPPORTED);
+		free(p);
+		return supported;
+  }
+
+  // a receive buffer is given back to the kernel, which sees it when publishBuffers is called
+  void addBuffer(int bid)
+  {
+		// not buf_ring->bufs, which the empty struct before it moves in C++
+		struct io_uring_buf* buf = (struct io_uring_buf*)buf_ring + (buf_tail & (opts.recv_buffers - 1));
+
+		buf->addr = (unsigned long)&recvbufs[(size_t)bid * opts.recv_buffer_size];
+		buf->len = opts.recv_buffer_size;
+		buf->bid = (unsigned short)bid;
+		++buf_tail;
+  }
+
+  // the receives which stopped for want of buffers are started again
+  void publishBuffers();
+
+  unsigned char* recvbuf(int bid)
+  {
+		return &recvbufs[(size_t)bid * opts.recv_buffer_size];
+  }
+
+  unsigned char* sendbuf(int slot, int half)
+  {
+		return &sendbufs[((size_t)slot * 2 + half) * opts.sendbuf_size];
+  }
+
+  int allocSlot()
+  {
+		return (free_count == 0) ? -1 : free_slots[--free_count];
+  }
+
+  void freeSlot(int slot)
+  {
+		free_slots[free_count++] = slot;
+  }
+
+  struct io_uring_sqe* getSqe()
+  {
+		if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			enter(0, 0);    // the queue is full, so submit what is in it
+		if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			return 0;
+
+		unsigned index = sqe_tail & sq_mask;
+		struct io_uring_sqe* sqe = &sqes[index];
+
+		memset(sqe, '\0', sizeof(*sqe));
+		sq_array[index] = index;
+		++sqe_tail;
+		return sqe;
+  }
+
+  void markDirty(IOUringStack* stack);
+  int enter(unsigned int wait, int timeout_ms);
+  void complete(struct io_uring_cqe* cqe);
+
+  Options opts;
+  int ring_fd;
+  void* sq_ring;
+  void* cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_array;
+  unsigned sq_mask, sq_entries;
+  unsigned sqe_tail;          // of the entries filled in, which are submitted from sq_tail up to it
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  unsigned char* sendbufs;    // two for each connection, in its slot
+  bool fixed_buffers;         // sendbufs are registered
+  int* free_slots;
+  int free_count;
+
+  unsigned char* recvbufs;
+  struct io_uring_buf_ring* buf_ring;
+  unsigned short buf_tail;
+  int* buf_next;              // the buffers received into, in a list for each connection
+  int* buf_len;
+
+  IOUringStack* dirty;        // connections with something to submit
+  IOUringStack* starved;      // connections whose receives stopped when the buffers ran out
+  bool zerocopy;              // IORING_OP_SENDMSG_ZC is supported
+  unsigned long enters;
+  unsigned long zerocopy_sends;
+};
+
+
+class IOUringStack
+{
+public:
+  IOUringStack(IOUring& aRing) : ring(aRing), sock(-1), slot(-1), ops(0), dirty(false), next_dirty(0),
+    starved(false), next_starved(0)
+  {
+		reset();
+  }
+
+  ~IOUringStack()
+  {
+		if (slot != -1)
+			disconnect();
+  }
+
+  // connect with IPStack, then take over its socket
+  int connect(const char* hostname, int port, const IPStack::Options& options = IPStack::Options())
+  {
+		IPStack ipstack;
+		int rc = ipstack.connect(hostname, port, options);
+
+		if (rc == 0 && (rc = attach(ipstack.release())) != 0)
+			ipstack.disconnect();
+		return rc;
+  }
+
+  // use a socket which is already connected
+  int attach(int aSock)
+  {
+		if (slot != -1 || !ring.valid() || (slot = ring.allocSlot()) == -1)
+			return -1;
+		sock = aSock;
+		reset();
+		ring.markDirty(this);   // to arm the receive
+		return 0;
+  }
+
+  // has data been received, or the connection closed, so that a read will not wait?
+  bool readable() const
+  {
+		return recv_head != -1 || closed || error != 0;
+  }
+
+  // return -1 on error, or the number of bytes read, which could be 0 on a read timeout
+  int read(unsigned char* buffer, int len, int timeout_ms)
+  {
+		Countdown timer(timeout_ms);
+		int bytes = 0;
+
+		while (true)
+		{
+			bytes += take(&buffer[bytes], len - bytes);
+			if (bytes == len || closed || error != 0 || sock == -1)
+				break;
+			if (ring.poll(timer.left_ms()) < 0 || timer.expired())
+			{
+				bytes += take(&buffer[bytes], len - bytes);
+				break;
+			}
+		}
+		return (bytes == 0 && (closed || error != 0 || sock == -1)) ? -1 : bytes;
+  }
+
+  // copy into the send buffer, to be written with the other connections' writes
+  int write(unsigned char* buffer, int len, int timeout_ms)
+  {
+		Countdown timer(timeout_ms);
+		int bytes = 0;
+
+		while (bytes < len && error == 0 && sock != -1)
+		{
+			bytes += append(&buffer[bytes], len - bytes);
+			if (bytes == len || timer.expired())
+				break;
+			ring.poll(timer.left_ms());     // until a send completes, to make room
+		}
+		return (bytes == 0 && (error != 0 || sock == -1)) ? -1 : bytes;
+  }
+
+  // large writes are sent from where they are, without being copied
+  template<class Buffer>
+  int writev(const Buffer* buffers, int count, int timeout_ms)
+  {
+		struct iovec iov[WRITEV_BUFFERS];
+		int total = 0;
+
+		if (count > WRITEV_BUFFERS)
+			count = WRITEV_BUFFERS;   // the rest are written by the next call
+		for (int i = 0; i < count; ++i)
+		{
+			iov[i].iov_base = (void*)buffers[i].data;
+			iov[i].iov_len = (size_t)buffers[i].len;
+			total += buffers[i].len;
+		}
+		if (ring.zeroCopy(total))
+			return sendZeroCopy(iov, count, timeout_ms);
+
+		int bytes = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			int rc = write((unsigned char*)iov[i].iov_base, (int)iov[i].iov_len, timeout_ms);
+			if (rc < 0)
+				return (bytes == 0) ? -1 : bytes;
+			bytes += rc;
+			if (rc < (int)iov[i].iov_len)
+				break;
+		}
+		return bytes;
+  }
+
+  // write what is waiting to be sent, cancel what the kernel is still doing, and close the socket
+  int disconnect()
+  {
+		Countdown timer(1000);
+		struct io_uring_sqe* sqe;
+		bool cancelled = (sock == -1);   // the connection was reset, after a zero copy send timed out
+		int rc = -1;
+
+		if (slot == -1)
+			return -1;
+		while ((sending || filled > 0) && error == 0 && sock != -1 && !timer.expired())
+			ring.poll(timer.left_ms());
+		closing = true;
+		while (ops > 0)     // until the kernel has finished with this connection's memory
+		{
+			// the receive, and any send the other end has stopped reading.  If the submission
+			// queue is full, the cancel is tried again after the next poll
+			if (!cancelled && (sqe = ring.getSqe()) != 0)
+			{
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->fd = sock;
+				sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+				sqe->user_data = 0;
+				cancelled = true;
+			}
+			ring.poll(100);
+		}
+		while (recv_head != -1)
+			releaseBuffer();
+		ring.publishBuffers();
+		if (dirty)
+			remove(&ring.dirty, &IOUringStack::next_dirty);
+		if (starved)
+			remove(&ring.starved, &IOUringStack::next_starved);
+		dirty = starved = false;
+		ring.freeSlot(slot);
+		slot = -1;
+		if (sock != -1)
+			rc = ::close(sock);
+		sock = -1;
+		return rc;
+  }
+
+private:
+  friend class IOUring;
+
+  static const int WRITEV_BUFFERS = 8;
+
+  void reset()
+  {
+		fill = 0;
+		filled = 0;
+		sending = send_submitted = false;
+		send_half = send_off = send_len = 0;
+		recv_armed = false;
+		recv_head = recv_tail = -1;
+		recv_off = 0;
+		closed = closing = false;
+		error = 0;
+		zc_res = 0;
+		zc_done = zc_notif = false;
+  }
+
+  unsigned long long userData(int op)
+  {
+		return (unsigned long long)(unsigned long)this | op;
+  }
+
+  void remove(IOUringStack** list, IOUringStack* IOUringStack::*next)
+  {
+		for (IOUringStack** p = list; *p; p = &((*p)->*next))
+		{
+			if (*p == this)
+			{
+				*p = this->*next;
+				break;
+			}
+		}
+  }
+
+  // copy data received out of the receive buffers, giving them back to the kernel when emptied
+  int take(unsigned char* buffer, int len)
+  {
+		int bytes = 0;
+
+		while (bytes < len && recv_head != -1)
+		{
+			int n = ring.buf_len[recv_head] - recv_off;
+
+			if (n > len - bytes)
+				n = len - bytes;
+			memcpy(&buffer[bytes], ring.recvbuf(recv_head) + recv_off, n);
+			bytes += n;
+			recv_off += n;
+			if (recv_off == ring.buf_len[recv_head])
+				releaseBuffer();
+		}
+		if (bytes > 0)
+			ring.publishBuffers();
+		return bytes;
+  }
+
+  void releaseBuffer()
+  {
+		int bid = recv_head;
+
+		if ((recv_head = ring.buf_next[bid]) == -1)
+			recv_tail = -1;
+		recv_off = 0;
+		ring.addBuffer(bid);
+  }
+
+  int append(unsigned char* buffer, int len)
+  {
+		int n = ring.opts.sendbuf_size - filled;
+
+		if (n > len)
+			n = len;
+		memcpy(ring.sendbuf(slot, fill) + filled, buffer, n);
+		filled += n;
+		if (n > 0 && !sending)
+			ring.markDirty(this);
+		return n;
+  }
+
+  // called by the ring before it submits.  If the submission queue is full, the stack stays dirty,
+  // for the next submit
+  void prepare()
+  {
+		struct io_uring_sqe* sqe;
+
+		if (!recv_armed && !closed && !closing && error == 0)
+		{
+			if ((sqe = ring.getSqe()) == 0)
+			{
+				ring.markDirty(this);
+				return;
+			}
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = sock;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = IOUring::BUFFER_GROUP;
+			sqe->user_data = userData(IOUring::RECV);
+			recv_armed = true;
+			++ops;
+		}
+		if (!sending && filled > 0 && error == 0)
+		{
+			send_half = fill;
+			send_len = filled;
+			send_off = 0;
+			fill = 1 - fill;
+			filled = 0;
+			sending = true;
+		}
+		if (sending && !send_submitted && error == 0)
+		{
+			if ((sqe = ring.getSqe()) == 0)
+				ring.markDirty(this);
+			else
+				prepareSend(sqe);
+		}
+  }
+
+  // the rest of the send buffer being sent
+  void prepareSend(struct io_uring_sqe* sqe)
+  {
+		sqe->fd = sock;
+		sqe->addr = (unsigned long)(ring.sendbuf(slot, send_half) + send_off);
+		sqe->len = send_len - send_off;
+		if (ring.fixed_buffers)
+		{
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = 0;
+		}
+		else
+		{
+			sqe->opcode = IORING_OP_SEND;
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		}
+		sqe->user_data = userData(IOUring::SEND);
+		send_submitted = true;
+		++ops;
+  }
+
+  // the writes before it are sent first, then it is sent from where it is, and waited for, as the
+  // kernel uses the memory until it says it has finished with it.  If it is not sent in time, it is
+  // cancelled, and as part of a packet may have been written, the connection fails
+  int sendZeroCopy(struct iovec* iov, int count, int timeout_ms)
+  {
+		Countdown timer(timeout_ms);
+		struct msghdr msg;
+		struct io_uring_sqe* sqe;
+
+		while ((sending || filled > 0) && error == 0 && sock != -1 && !timer.expired())
+			ring.poll(timer.left_ms());
+		if (error != 0 || sock == -1)
+			return -1;
+		if (sending || filled > 0)
+			return 0;
+
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		if ((sqe = ring.getSqe()) == 0)
+			return 0;
+		sqe->opcode = IORING_OP_SENDMSG_ZC;
+		sqe->fd = sock;
+		sqe->addr = (unsigned long)&msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = userData(IOUring::ZEROCOPY);
+		++ops;
+		zc_done = zc_notif = false;
+		ring.submit();
+		while ((!zc_done || zc_notif) && !timer.expired())
+			ring.poll(timer.left_ms());
+		if (!zc_done || zc_notif)
+		{
+			reset_connection();
+			zc_res = -ETIMEDOUT;
+		}
+		++ring.zerocopy_sends;
+		if (zc_res < 0)
+			error = zc_res;
+		return (zc_res < 0) ? -1 : zc_res;
+  }
+
+  // The memory of a zero copy send is only given back when the other end has acked it, which it
+  // may never do.  So cancel what the kernel is doing on the socket, then close it with no linger,
+  // which resets the connection and discards what is waiting to be sent
+  void reset_connection()
+  {
+		struct linger linger = {1, 0};
+		struct io_uring_sqe* sqe;
+		bool cancelled = false;
+
+		while (!zc_done || ops > (zc_notif ? 1 : 0))
+		{
+			if (!cancelled && (sqe = ring.getSqe()) != 0)
+			{
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->fd = sock;
+				sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+				sqe->user_data = 0;
+				cancelled = true;
+			}
+			ring.poll(100);
+		}
+		setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		::close(sock);
+		sock = -1;          // the slot and receive buffers are kept until disconnect
+		closing = true;
+		while (zc_notif)
+			ring.poll(100);
+  }
+
+  void completed(int op, struct io_uring_cqe* cqe)
+  {
+		if (op == IOUring::RECV)
+		{
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+			{
+				int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+				if (cqe->res > 0)
+				{
+					ring.buf_len[bid] = cqe->res;
+					ring.buf_next[bid] = -1;
+					if (recv_tail == -1)
+						recv_head = bid;
+					else
+						ring.buf_next[recv_tail] = bid;
+					recv_tail = bid;
+				}
+				else
+				{
+					ring.addBuffer(bid);
+					ring.publishBuffers();
+				}
+			}
+			if (cqe->res == 0)
+				closed = true;
+			else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+				error = cqe->res;
+			if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+			{
+				recv_armed = false;
+				--ops;
+				if (cqe->res == -ENOBUFS && !starved)
+				{
+					starved = true;     // re-armed when buffers are given back
+					next_starved = ring.starved;
+					ring.starved = this;
+				}
+				else if (cqe->res > 0)
+					ring.markDirty(this);
+			}
+		}
+		else if (op == IOUring::SEND)
+		{
+			--ops;
+			send_submitted = false;
+			if (cqe->res < 0)
+			{
+				error = cqe->res;
+				sending = false;
+			}
+			else if ((send_off += cqe->res) < send_len)
+				ring.markDirty(this);   // to send the rest of it
+			else
+			{
+				sending = false;
+				if (filled > 0)
+					ring.markDirty(this);
+			}
+		}
+		else if (op == IOUring::ZEROCOPY)
+		{
+			if (cqe->flags & IORING_CQE_F_NOTIF)
+			{
+				zc_notif = false;
+				--ops;
+			}
+			else
+			{
+				zc_res = cqe->res;
+				zc_done = true;
+				if (cqe->flags & IORING_CQE_F_MORE)
+					zc_notif = true;    // the notification that the memory is free follows
+				else
+					--ops;
+			}
+		}
+  }
+
+  IOUring& ring;
+  int sock;
+  int slot;                   // of the send buffers in the ring
+  int ops;                    // operations the kernel has not finished
+  bool dirty;                 // in the ring's list of connections with something to submit
+  IOUringStack* next_dirty;
+  bool starved;               // in the ring's list of connections waiting for receive buffers
+  IOUringStack* next_starved;
+
+  int fill;                   // the send buffer being written into, while the other is sent
+  int filled;
+  bool sending;
+  bool send_submitted;        // the kernel has been given the rest of the buffer being sent
+  int send_half, send_off, send_len;
+
+  bool recv_armed;
+  int recv_head, recv_tail;   // the receive buffers with data, in the order they were filled
+  int recv_off;               // of the data not yet read in the first
+  bool closed;                // by the other end
+  bool closing;
+  int error;
+
+  int zc_res;
+  bool zc_done, zc_notif;
+};
+
+
+inline void IOUring::markDirty(IOUringStack* stack)
+{
+	if (!stack->dirty)
+	{
+		stack->dirty = true;
+		stack->next_dirty = dirty;
+		dirty = stack;
+	}
+}
+
+
+inline void IOUring::publishBuffers()
+{
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+	while (starved)
+	{
+		IOUringStack* stack = starved;
+
+		starved = stack->next_starved;
+		stack->starved = false;
+		markDirty(stack);
+	}
+}
+
+
+// submit what the connections have to submit, and handle what has completed
+inline int IOUring::enter(unsigned int wait, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct timespec ts;
+	unsigned int flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	unsigned head, tail;
+	int rc = 0;
+	int count = 0;
+
+	if (ring_fd == -1)
+		return -1;
+	IOUringStack* list = dirty;     // stacks which can't be prepared now go on a new list
+	dirty = 0;
+	while (list)
+	{
+		IOUringStack* stack = list;
+
+		list = stack->next_dirty;
+		stack->dirty = false;
+		stack->prepare();
+	}
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+	unsigned int to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	head = *cq_head;
+	if (to_submit > 0 || (wait > 0 && timeout_ms > 0 && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)))
+	{
+		memset(&arg, '\0', sizeof(arg));
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		arg.ts = (unsigned long)&ts;
+		++enters;
+		rc = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, (timeout_ms > 0) ? wait : 0, flags, &arg, sizeof(arg));
+		if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+			return -1;
+	}
+
+	tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (head = *cq_head; head != tail; ++head, ++count)
+		complete(&cqes[head & cq_mask]);
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+
+inline void IOUring::complete(struct io_uring_cqe* cqe)
+{
+	IOUringStack* stack = (IOUringStack*)(unsigned long)(cqe->user_data & ~3ULL);
+
+	if (stack != 0)
+		stack->completed((int)(cqe->user_data & 3), cqe);
+}
+
+#endif
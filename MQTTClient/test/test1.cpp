@@ -25,12 +25,29 @@
  #include <memory.h>
  //#define MQTT_DEBUG
  #include "MQTTClient.h"
+#if defined(__cpp_impl_coroutine)
+ #include "MQTTCoroutineClient.h"
+#endif
+#if __cplusplus >= 202002L
+ #include <array>
+ #include "MQTTCodec.h"
+#endif
+ #include "MQTTOwnedMessage.h"
+ #include "MQTTAsyncLogging.h"
+ #include "MQTTThreadedClient.h"
+ #include <atomic>
+ #include <future>
+ #include <condition_variable>
+ #include <deque>
+ #include <thread>
 
  #define DEFAULT_STACK_SIZE -1
 
  #include "linux.cpp"
+ #include "linux_uring.cpp"
 
  #include <sys/time.h>
+ #include <sys/wait.h>
  #include <stdlib.h>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
@@ -762,6 +779,1496 @@ exit:
 }
 
 
+/*********************************************************************
+
+Test 4: batching
+
+*********************************************************************/
+static volatile int test4_arrived = 0;
+
+void test4_messageArrived(MQTT::MessageData& md)
+{
+  test4_arrived = test4_arrived + 1; // ++ on a volatile is deprecated in C++20
+}
+
+
+int test4(struct Options options)
+{
+  int rc = 0;
+  int i = 0;
+  int wait_seconds;
+  const char* test_topic = "C client test4";
+
+  fprintf(xml, "<testcase classname=\"test4\" name=\"batching\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 4 - batching");
+
+  IPStack ipstack = IPStack();
+  MQTT::Client<IPStack, Countdown, 1000> client = MQTT::Client<IPStack, Countdown, 1000>(ipstack);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"batching-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client.subscribe(test_topic, MQTT::QOS0, test4_messageArrived);
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = (void*)"a much longer message that we can shorten to the extent that we need to payload up to 11";
+  pubmsg.payloadlen = 11;
+  pubmsg.qos = MQTT::QOS0;
+
+  test4_arrived = 0;
+  rc = client.beginBatch(10000);
+  assert("Good rc from beginBatch", rc == MQTT::SUCCESS, "rc was %d", rc);
+  for (i = 0; i < 5; ++i)
+  {
+    rc = client.publish(test_topic, pubmsg);
+    assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  }
+  client.yield(500);
+  assert("Messages held back in the batch", test4_arrived == 0, "arrived was %d", test4_arrived);
+
+  rc = client.flush();
+  assert("Good rc from flush", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while (test4_arrived < 5 && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("Messages arrived after the flush", test4_arrived == 5, "arrived was %d", test4_arrived);
+
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+exit:
+  MyLog(LOGA_INFO, "TEST4: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 5: more than one publish in flight
+
+*********************************************************************/
+int test5(struct Options options)
+{
+  int rc = 0;
+  int i = 0;
+  int wait_seconds;
+  int most_inflight = 0;
+  const char* test_topic = "C client test5";
+
+  fprintf(xml, "<testcase classname=\"test5\" name=\"publishes in flight\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 5 - publishes in flight");
+
+  IPStack ipstack = IPStack();
+  MQTT::Client<IPStack, Countdown, 1000, 5, 10> client = MQTT::Client<IPStack, Countdown, 1000, 5, 10>(ipstack);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"inflight-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 0;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client.subscribe(test_topic, MQTT::QOS2, test4_messageArrived);
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  memset(&pubmsg, '\0', sizeof(pubmsg));
+  pubmsg.payload = (void*)"a much longer message that we can shorten to the extent that we need to payload up to 11";
+  pubmsg.payloadlen = 11;
+
+  // publish returns as soon as there is room for another, so the acks are received out of step
+  test4_arrived = 0;
+  for (i = 0; i < 40; ++i)
+  {
+    pubmsg.qos = (i % 2) ? MQTT::QOS2 : MQTT::QOS1;
+    rc = client.publish(test_topic, pubmsg);
+    assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+    if (client.inflightCount() > most_inflight)
+      most_inflight = client.inflightCount();
+  }
+  assert("More than one publish in flight", most_inflight > 1 && most_inflight < 10, "most in flight was %d", most_inflight);
+  wait_seconds = 10;
+  while ((test4_arrived < 40 || client.inflightCount() > 0) && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("Messages arrived", test4_arrived == 40, "arrived was %d", test4_arrived);
+  assert("All acks received", client.inflightCount() == 0, "in flight was %d", client.inflightCount());
+
+  // the publishes in flight when the connection is lost are resent when it is made again
+  for (i = 0; i < 5; ++i)
+  {
+    pubmsg.qos = (i % 2) ? MQTT::QOS2 : MQTT::QOS1;
+    rc = client.publish(test_topic, pubmsg);
+    assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  }
+  assert("Publishes in flight", client.inflightCount() == 5, "in flight was %d", client.inflightCount());
+  ipstack.disconnect();
+  rc = client.yield(100);
+  assert("Connection loss detected", rc == MQTT::FAILURE && !client.isConnected(), "rc was %d", rc);
+  assert("Publishes kept", client.inflightCount() == 5, "in flight was %d", client.inflightCount());
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while (client.inflightCount() > 0 && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("Resent publishes completed", client.inflightCount() == 0, "in flight was %d", client.inflightCount());
+
+  rc = client.unsubscribe(test_topic);
+  assert("Unsubscribe successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+exit:
+  MyLog(LOGA_INFO, "TEST5: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 6: buffers supplied at run time
+
+*********************************************************************/
+int test6(struct Options options)
+{
+  typedef MQTT::Client<IPStack, Countdown, 0, 5, 2, 0> RuntimeClient;
+  int rc = 0;
+  int wait_seconds;
+  const char* test_topic = "C client test6";
+  static char payload[500];
+  unsigned char* sendbufs = (unsigned char*)malloc(RuntimeClient::SEND_BUFFERS * 100);
+  unsigned char* readbuf = (unsigned char*)malloc(1000);
+
+  fprintf(xml, "<testcase classname=\"test6\" name=\"buffers supplied at run time\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 6 - buffers supplied at run time");
+
+  IPStack ipstack = IPStack();
+  RuntimeClient client = RuntimeClient(ipstack, 30000, sendbufs, 100, readbuf, 1000);
+  IPStack ipstack2 = IPStack();
+  MQTT::Client<IPStack, Countdown, 1000> publisher = MQTT::Client<IPStack, Countdown, 1000>(ipstack2);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"runtime-buffers-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client.subscribe(test_topic, MQTT::QOS1, test4_messageArrived);
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  data.clientID.cstring = (char*)"runtime-buffers-test publisher";
+  rc = ipstack2.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = publisher.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  // a message larger than the send buffer can be received into the larger read buffer
+  memset(payload, 'x', sizeof(payload));
+  test4_arrived = 0;
+  rc = publisher.publish(test_topic, payload, sizeof(payload), MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.publish(test_topic, payload, 50, MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while (test4_arrived < 2 && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("Messages arrived", test4_arrived == 2, "arrived was %d", test4_arrived);
+
+  // IPStack has writev, so the payload is written from where it is, not copied (see test 15)
+  rc = client.publish(test_topic, payload, sizeof(payload), MQTT::QOS1);
+  assert("Publish larger than the send buffer is written with writev", rc == MQTT::SUCCESS, "rc was %d", rc);
+  assert("Still connected", client.isConnected(), "isConnected was %d", client.isConnected());
+
+  rc = publisher.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack2.disconnect();
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+exit:
+  free(sendbufs);
+  free(readbuf);
+  MyLog(LOGA_INFO, "TEST6: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 7: member function and lambda message handlers
+
+*********************************************************************/
+class Test7Subscriber
+{
+public:
+  Test7Subscriber() : arrived(0) { }
+
+  void messageArrived(MQTT::MessageData& md)
+  {
+    ++arrived;
+  }
+
+  int arrived;
+};
+
+
+int test7(struct Options options)
+{
+  int rc = 0;
+  int wait_seconds;
+  int lambda_arrived = 0;
+  Test7Subscriber subscriber;
+  const char* test_topic = "C client test7";
+  const char* test_topic2 = "C client test7 lambda";
+
+  fprintf(xml, "<testcase classname=\"test7\" name=\"member function and lambda handlers\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 7 - member function and lambda handlers");
+
+  IPStack ipstack = IPStack();
+  MQTT::Client<IPStack, Countdown, 1000> client = MQTT::Client<IPStack, Countdown, 1000>(ipstack);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"handlers-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client.subscribe(test_topic, MQTT::QOS1, MQTT::MessageDelegate(&subscriber, &Test7Subscriber::messageArrived));
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.subscribe(test_topic2, MQTT::QOS1, [&lambda_arrived](MQTT::MessageData& md) { ++lambda_arrived; });
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  rc = client.publish(test_topic, (void*)"member function", 15, MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.publish(test_topic2, (void*)"lambda", 6, MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while ((subscriber.arrived == 0 || lambda_arrived == 0) && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("Message arrived at the member function", subscriber.arrived == 1, "arrived was %d", subscriber.arrived);
+  assert("Message arrived at the lambda", lambda_arrived == 1, "arrived was %d", lambda_arrived);
+
+  {
+    MQTT::MessageDelegate none(0);   // 0 is nothing, not a function object
+    MQTT::MessageDelegate member(&subscriber, &Test7Subscriber::messageArrived);
+
+    assert("Delegate of 0 has nothing attached", !none.attached(), "attached was %d", none.attached());
+    member.attach(0);
+    assert("Attaching 0 detaches", !member.attached(), "attached was %d", member.attached());
+  }
+  client.setDefaultMessageHandler(0);
+
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+exit:
+  MyLog(LOGA_INFO, "TEST7: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 8: keepalive in many clients
+
+*********************************************************************/
+int test8(struct Options options)
+{
+  const int CLIENTS = 5;
+  int rc = 0;
+  int i = 0;
+  int connected = 0;
+  char clientids[CLIENTS][30];
+  IPStack ipstacks[CLIENTS];
+  MQTT::Client<IPStack, Countdown, 100>* clients[CLIENTS];
+
+  fprintf(xml, "<testcase classname=\"test8\" name=\"keepalive in many clients\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 8 - keepalive in many clients");
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.keepAliveInterval = 2;
+  data.cleansession = 1;
+
+  for (i = 0; i < CLIENTS; ++i)
+  {
+    clients[i] = new MQTT::Client<IPStack, Countdown, 100>(ipstacks[i]);
+    sprintf(clientids[i], "keepalive-test %d", i);
+    data.clientID.cstring = clientids[i];
+    rc = ipstacks[i].connect(options.host, options.port);
+    assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+    rc = clients[i]->connect(data);
+    assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  }
+
+  // each client has its own ping deadline, so none misses a PINGRESP which another was waiting for
+  START_TIME_TYPE start = start_clock();
+  while (elapsed(start) < 5000)
+  {
+    for (i = 0; i < CLIENTS; ++i)
+      clients[i]->yield(20);
+  }
+  for (i = 0; i < CLIENTS; ++i)
+    connected += clients[i]->isConnected();
+  assert("All clients still connected", connected == CLIENTS, "connected were %d", connected);
+
+  for (i = 0; i < CLIENTS; ++i)
+  {
+    clients[i]->disconnect();
+    ipstacks[i].disconnect();
+    delete clients[i];
+  }
+
+  MyLog(LOGA_INFO, "TEST8: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+#if defined(__cpp_impl_coroutine)
+/*********************************************************************
+
+Test 9: coroutine client, with many publishes awaited at once
+
+*********************************************************************/
+typedef MQTT::CoroutineClient<IPStack, Countdown, 1000> Test9Client;
+
+MQTT::Task test9_connect(Test9Client& client, MQTTPacket_connectData& data, int* rc)
+{
+  *rc = co_await client.connect(data);
+}
+
+MQTT::Task test9_subscribe(Test9Client& client, const char* topic, MQTT::MessageDelegate mh, int* rc)
+{
+  *rc = co_await client.subscribe(topic, MQTT::QOS2, mh);
+}
+
+MQTT::Task test9_publish(Test9Client& client, const char* topic, int i, int* completed)
+{
+  MQTT::Message message;
+  char payload[30];
+
+  message.qos = (enum MQTT::QoS)(i % 3);
+  message.retained = false;
+  message.dup = false;
+  message.payload = payload;
+  message.payloadlen = sprintf(payload, "coroutine publish %d", i);
+  if (co_await client.publish(topic, message) == MQTT::SUCCESS)
+    ++*completed;
+}
+
+MQTT::Task test9_finish(Test9Client& client, const char* topic, int* rc)
+{
+  *rc = co_await client.unsubscribe(topic);
+  if (*rc == MQTT::SUCCESS)
+    *rc = co_await client.disconnect();
+}
+
+int test9(struct Options options)
+{
+  const int PUBLISHES = 3000;
+  int rc = 0;
+  int completed = 0;
+  int arrived = 0;
+  const char* test_topic = "C client test9";
+
+  fprintf(xml, "<testcase classname=\"test9\" name=\"coroutine client\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 9 - coroutine client");
+
+  IPStack ipstack = IPStack();
+  Test9Client client(ipstack);
+  client.setDefaultMessageHandler(0);   // none
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"coroutine-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = MQTT::FAILURE - 1;
+  test9_connect(client, data, &rc);
+  while (rc == MQTT::FAILURE - 1 && client.run(100) == MQTT::SUCCESS)
+    ;
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = MQTT::FAILURE - 1;
+  test9_subscribe(client, test_topic, [&arrived](MQTT::MessageData& md) { ++arrived; }, &rc);
+  while (rc == MQTT::FAILURE - 1 && client.run(100) == MQTT::SUCCESS)
+    ;
+  assert("Good rc from subscribe", rc == MQTT::QOS2, "rc was %d", rc);
+
+  // every publish is in progress at once, each in its own coroutine
+  for (int i = 0; i < PUBLISHES; ++i)
+    test9_publish(client, test_topic, i, &completed);
+  for (int wait_seconds = 20; (completed < PUBLISHES || arrived < PUBLISHES) && wait_seconds > 0; --wait_seconds)
+  {
+    if (client.run(1000) != MQTT::SUCCESS)
+      break;
+  }
+  assert("All publishes completed", completed == PUBLISHES, "completed were %d", completed);
+  assert("All messages arrived", arrived == PUBLISHES, "arrived were %d", arrived);
+
+  rc = MQTT::FAILURE - 1;
+  test9_finish(client, test_topic, &rc);
+  while (rc == MQTT::FAILURE - 1 && client.run(100) == MQTT::SUCCESS)
+    ;
+  assert("Good rc from unsubscribe and disconnect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  assert("Disconnected", !client.isConnected(), "isConnected was %d", client.isConnected());
+  ipstack.disconnect();
+
+exit:
+  MyLog(LOGA_INFO, "TEST9: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#else
+int test9(struct Options options)
+{
+  fprintf(xml, "<testcase classname=\"test9\" name=\"coroutine client\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Skipping test 9 - coroutine client, which needs C++20");
+  write_test_result();
+  return failures;
+}
+#endif
+
+
+/*********************************************************************
+
+Test 10: topic filters split into levels
+
+*********************************************************************/
+#if __cplusplus >= 201402L
+static constexpr MQTT::TopicFilter test10_filter("C client test10/+/scores/#"); // checked by the compiler
+#else
+static MQTT::TopicFilter test10_filter("C client test10/+/scores/#");
+#endif
+
+int test10_arrived = 0;
+
+void test10_messageArrived(MQTT::MessageData& md)
+{
+  ++test10_arrived;
+}
+
+int test10(struct Options options)
+{
+  const char* filters[] = {"a", "a/b", "+", "#", "a/+", "a/#", "+/b", "+/+", "a/+/c", "a/#",
+      "/a", "a/", "/", "+/", "/+", "/#", "a//b", "a/+/+", "b/#"};
+  const char* topics[] = {"a", "b", "a/b", "a/c", "/a", "a/", "/", "//", "a/b/c", "a//c", "a//b",
+      "a/bc/c", "ab", "b/a", "a/b/", "/a/b"};
+  const char* invalid[] = {"", "a+", "a/b#", "#/a", "a/#/b", "+a/b", "a/1/2/3/4/5/6/7/8"};
+  int rc = 0;
+  int mismatches = 0;
+  int wait_seconds;
+
+  fprintf(xml, "<testcase classname=\"test10\" name=\"topic filters split into levels\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 10 - topic filters split into levels");
+
+  // a filter split into levels matches the same topic names as the client matches against the string
+  for (unsigned int f = 0; f < ARRAY_SIZE(filters); ++f)
+  {
+    MQTT::TopicFilter filter(filters[f]);
+
+    assert("Filter is valid", filter.valid(), "filter was %s", filters[f]);
+    for (unsigned int t = 0; t < ARRAY_SIZE(topics); ++t)
+    {
+      MQTTString topicName = MQTTString_initializer;
+      topicName.lenstring.data = (char*)topics[t];
+      topicName.lenstring.len = strlen(topics[t]);
+      bool expected = MQTTPacket_equals(&topicName, (char*)filters[f]) || MQTT::isTopicMatched(filters[f], topicName);
+      if (filter.matches(topicName) != expected)
+      {
+        MyLog(LOGA_INFO, "Filter %s, topic %s: expected %d", filters[f], topics[t], expected);
+        ++mismatches;
+      }
+    }
+  }
+  assert("Matches as isTopicMatched does", mismatches == 0, "mismatches were %d", mismatches);
+  for (unsigned int f = 0; f < ARRAY_SIZE(invalid); ++f)
+  {
+    MQTT::TopicFilter filter(invalid[f]);
+    assert("Filter is not valid", !filter.valid(), "filter was %s", invalid[f]);
+  }
+
+  IPStack ipstack = IPStack();
+  MQTT::Client<IPStack, Countdown, 1000> client = MQTT::Client<IPStack, Countdown, 1000>(ipstack);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"topic-filter-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client.subscribe(test10_filter, MQTT::QOS1, test10_messageArrived);
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  rc = client.publish("C client test10/tennis/scores/today", (void*)"match", 5, MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.publish("C client test10/tennis/results/today", (void*)"no match", 8, MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.publish("C client test10/golf/scores/final", (void*)"match", 5, MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while (test10_arrived < 2 && wait_seconds-- > 0)
+    client.yield(1000);
+  client.yield(500);
+  assert("Messages arrived for the filter", test10_arrived == 2, "arrived was %d", test10_arrived);
+
+  rc = client.unsubscribe(test10_filter);
+  assert("Good rc from unsubscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+exit:
+  MyLog(LOGA_INFO, "TEST10: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 11: typed codec
+
+*********************************************************************/
+#if __cplusplus >= 202002L
+// serialized by the compiler
+constexpr std::array<unsigned char, 9> test11_packet = []()
+{
+  std::array<unsigned char, 9> buf{};
+  MQTT::Codec::serialize(buf, MQTT::Codec::Publish{.qos = 1, .id = 10, .topic = "a/b", .payload = {}});
+  return buf;
+}();
+static_assert(test11_packet[0] == 0x32 && test11_packet[1] == 7 && test11_packet[2] == 0 && test11_packet[3] == 3 &&
+    test11_packet[4] == 'a' && test11_packet[7] == 0 && test11_packet[8] == 10, "publish serialized by the compiler");
+static_assert(MQTT::Codec::length(MQTT::Codec::Publish{.qos = 1, .topic = "sensors/temperature", .payload = {}}) == 25,
+    "length of a publish with a fixed topic");
+
+// compare a packet serialized by the codec with one serialized by the C function
+int test11_compare(const char* what, int len, unsigned char* buf, int c_len, unsigned char* c_buf)
+{
+  int same = (len == c_len && (len <= 0 || memcmp(buf, c_buf, len) == 0));
+
+  assert("Same packet as the C function", same, "packet was %s", what);
+  return same;
+}
+
+int test11(struct Options options)
+{
+  static unsigned char buf[20000], c_buf[20000];
+  static unsigned char payload[17000];
+  const int payloadlens[] = {0, 1, 100, 200, 16000, 17000};
+  int len = 0, c_len = 0;
+
+  fprintf(xml, "<testcase classname=\"test11\" name=\"typed codec\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 11 - typed codec");
+
+  for (unsigned int i = 0; i < sizeof(payload); ++i)
+    payload[i] = (unsigned char)i;
+
+  // connect, with and without a will and user name and password
+  for (int version = 3; version <= 4; ++version)
+  {
+    for (int extras = 0; extras <= 1; ++extras)
+    {
+      MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+      MQTT::Codec::Will will{.topicName = "will topic", .message = std::span<const unsigned char>(payload, 10), .qos = 1, .retained = true};
+      MQTT::Codec::Connect connect{.MQTTVersion = (unsigned char)version, .clientID = "codec-test", .keepAliveInterval = 30,
+          .username = {}, .password = {}};
+
+      data.MQTTVersion = version;
+      data.clientID.cstring = (char*)"codec-test";
+      data.keepAliveInterval = 30;
+      if (extras)
+      {
+        data.willFlag = 1;
+        data.will.topicName.cstring = (char*)"will topic";
+        data.will.message.lenstring.data = (char*)payload;
+        data.will.message.lenstring.len = 10;
+        data.will.qos = 1;
+        data.will.retained = 1;
+        data.username.cstring = (char*)"user";
+        data.password.cstring = (char*)"password";
+        connect.will = &will;
+        connect.username = "user";
+        connect.password = std::span<const unsigned char>((const unsigned char*)"password", 8);
+      }
+      len = MQTT::Codec::serialize(buf, connect);
+      c_len = MQTTSerialize_connect(c_buf, sizeof(c_buf), &data);
+      test11_compare("connect", len, buf, c_len, c_buf);
+    }
+  }
+
+  // publishes with remaining lengths of 1, 2 and 3 bytes, at each QoS
+  for (unsigned int i = 0; i < ARRAY_SIZE(payloadlens); ++i)
+  {
+    for (int qos = 0; qos <= 2; ++qos)
+    {
+      MQTTString topic = MQTTString_initializer;
+      MQTT::Codec::Publish publish{.dup = (qos == 2), .qos = (unsigned char)qos, .retained = (qos == 1), .id = 65535,
+          .topic = "codec/test", .payload = std::span<const unsigned char>(payload, payloadlens[i])};
+      MQTT::Codec::Publish received;
+
+      topic.cstring = (char*)"codec/test";
+      len = MQTT::Codec::serialize(buf, publish);
+      c_len = MQTTSerialize_publish(c_buf, sizeof(c_buf), qos == 2, qos, qos == 1, 65535, topic, payload, payloadlens[i]);
+      test11_compare("publish", len, buf, c_len, c_buf);
+
+      int rc = MQTT::Codec::deserialize(received, std::span<const unsigned char>(c_buf, c_len));
+      assert("Publish deserialized", rc == 1 && received.qos == qos && received.dup == (qos == 2) &&
+          received.retained == (qos == 1) && received.id == ((qos > 0) ? 65535 : 0) && received.topic == "codec/test" &&
+          received.payload.size() == (size_t)payloadlens[i] && memcmp(received.payload.data(), payload, payloadlens[i]) == 0,
+          "rc was %d", rc);
+    }
+  }
+
+  // too short a buffer
+  len = MQTT::Codec::serialize(std::span<unsigned char>(buf, 10), MQTT::Codec::Publish{.topic = "codec/test", .payload = std::span<const unsigned char>(payload, 1)});
+  assert("Buffer too short", len == MQTTPACKET_BUFFER_TOO_SHORT, "len was %d", len);
+
+  for (int type = PUBACK; type <= PUBCOMP; ++type)
+  {
+    MQTT::Codec::Ack ack;
+
+    len = MQTT::Codec::serialize(buf, MQTT::Codec::Ack{.type = (unsigned char)type, .id = 1234});
+    c_len = MQTTSerialize_ack(c_buf, sizeof(c_buf), type, 0, 1234);
+    test11_compare("ack", len, buf, c_len, c_buf);
+    int rc = MQTT::Codec::deserialize(ack, std::span<const unsigned char>(c_buf, c_len));
+    assert("Ack deserialized", rc == 1 && ack.type == type && ack.id == 1234, "rc was %d", rc);
+  }
+
+  {
+    MQTTString topic = MQTTString_initializer;
+    int qos = 2;
+    topic.cstring = (char*)"codec/+/test";
+
+    len = MQTT::Codec::serialize(buf, MQTT::Codec::Subscribe{.id = 7, .topicFilter = "codec/+/test", .qos = 2});
+    c_len = MQTTSerialize_subscribe(c_buf, sizeof(c_buf), 0, 7, 1, &topic, &qos);
+    test11_compare("subscribe", len, buf, c_len, c_buf);
+    len = MQTT::Codec::serialize(buf, MQTT::Codec::Unsubscribe{.id = 8, .topicFilter = "codec/+/test"});
+    c_len = MQTTSerialize_unsubscribe(c_buf, sizeof(c_buf), 0, 8, 1, &topic);
+    test11_compare("unsubscribe", len, buf, c_len, c_buf);
+    len = MQTT::Codec::serialize(buf, MQTT::Codec::Pingreq());
+    c_len = MQTTSerialize_pingreq(c_buf, sizeof(c_buf));
+    test11_compare("pingreq", len, buf, c_len, c_buf);
+    len = MQTT::Codec::serialize(buf, MQTT::Codec::Disconnect());
+    c_len = MQTTSerialize_disconnect(c_buf, sizeof(c_buf));
+    test11_compare("disconnect", len, buf, c_len, c_buf);
+  }
+
+  {
+    MQTT::Codec::Connack connack;
+    MQTT::Codec::Suback suback;
+    int grantedQoS = 0x80;
+
+    c_len = MQTTSerialize_connack(c_buf, sizeof(c_buf), 5, 1);
+    int rc = MQTT::Codec::deserialize(connack, std::span<const unsigned char>(c_buf, c_len));
+    assert("Connack deserialized", rc == 1 && connack.rc == 5 && connack.sessionPresent, "rc was %d", rc);
+    c_len = MQTTSerialize_suback(c_buf, sizeof(c_buf), 9, 1, &grantedQoS);
+    rc = MQTT::Codec::deserialize(suback, std::span<const unsigned char>(c_buf, c_len));
+    assert("Suback deserialized", rc == 1 && suback.id == 9 && suback.grantedQoSs.size() == 1 &&
+        suback.grantedQoSs[0] == 0x80, "rc was %d", rc);
+    rc = MQTT::Codec::deserialize(suback, std::span<const unsigned char>(c_buf, c_len - 1));
+    assert("Truncated packet not deserialized", rc == 0, "rc was %d", rc);
+  }
+
+  MyLog(LOGA_INFO, "TEST11: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+#else
+int test11(struct Options options)
+{
+  fprintf(xml, "<testcase classname=\"test11\" name=\"typed codec\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Skipping test 11 - typed codec, which needs C++20");
+  write_test_result();
+  return failures;
+}
+#endif
+
+
+/*********************************************************************
+
+Test 12: messages kept by their handlers, and passed to another thread
+
+*********************************************************************/
+struct Test12Queue
+{
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<MQTT::OwnedMessage> messages;
+  bool finished = false;
+  const char* topic = "C client test12";
+  int arrived = 0, not_taken = 0, views_ok = 0;
+};
+
+int test12(struct Options options)
+{
+  const int MESSAGES = 20;
+  int rc = 0;
+  int wait_seconds;
+  int received = 0, payloads_ok = 0;
+  MQTT::FixedBufferPool<1000, 4> pool;
+  Test12Queue queue;
+
+  fprintf(xml, "<testcase classname=\"test12\" name=\"messages kept by their handlers\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 12 - messages kept by their handlers, and passed to another thread");
+
+  IPStack ipstack = IPStack();
+  MQTT::Client<IPStack, Countdown, 1000> client = MQTT::Client<IPStack, Countdown, 1000>(ipstack);
+
+  // the worker, which gets the messages without them being copied
+  std::thread worker([&]() {
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    while (true)
+    {
+      queue.ready.wait(lock, [&]() { return queue.finished || !queue.messages.empty(); });
+      if (queue.messages.empty())
+        break;
+      MQTT::OwnedMessage message = std::move(queue.messages.front());
+      queue.messages.pop_front();
+      lock.unlock();
+      const MQTT::Message& m = message.message();
+      if (m.payloadlen >= 8 && memcmp(m.payload, "message ", 8) == 0)
+        ++payloads_ok;
+      ++received;
+      message.release();
+      lock.lock();
+    }
+  });
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"owned-message-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = client.setBufferPool(&pool);
+  assert("Good rc from setBufferPool", rc == MQTT::SUCCESS, "rc was %d", rc);
+  assert("Client has a buffer from the pool", pool.available() == 3, "available was %d", pool.available());
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  // the handler captures only the queue, to fit in a MessageDelegate
+  rc = client.subscribe(queue.topic, MQTT::QOS1, [&queue](MQTT::MessageData& md) {
+    ++queue.arrived;
+#if __cplusplus >= 202002L
+    if (md.topic() == queue.topic && md.payload().size() == md.message.payloadlen)
+      ++queue.views_ok;
+#else
+    ++queue.views_ok;
+#endif
+    MQTT::OwnedMessage message(md);
+    if (!message)
+      ++queue.not_taken;  // the pool was empty, so it would have to be copied
+    else
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.messages.push_back(std::move(message));
+      queue.ready.notify_one();
+    }
+  });
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  for (int i = 0; i < MESSAGES; ++i)
+  {
+    char payload[30];
+    int payloadlen = sprintf(payload, "message %d", i);
+    rc = client.publish(queue.topic, payload, payloadlen, MQTT::QOS1);
+    assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  }
+  wait_seconds = 10;
+  while (queue.arrived < MESSAGES && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("All messages arrived", queue.arrived == MESSAGES, "arrived was %d", queue.arrived);
+  assert("Views of the messages", queue.views_ok == MESSAGES, "views_ok was %d", queue.views_ok);
+
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+exit:
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.finished = true;
+    queue.ready.notify_one();
+  }
+  worker.join();
+  assert("Messages taken were received by the worker", received == queue.arrived - queue.not_taken && received > 0,
+      "received was %d", received);
+  assert("Payloads intact in the worker", payloads_ok == received, "payloads_ok was %d", payloads_ok);
+  assert("Buffers back in the pool", pool.available() == 3, "available was %d", pool.available());
+  rc = client.setBufferPool(0);
+  assert("All buffers back in the pool", rc == MQTT::SUCCESS && pool.available() == 4, "available was %d", pool.available());
+  {
+    MQTT::Client<IPStack, Countdown, 1000> other(ipstack);
+    other.setBufferPool(&pool);
+    {
+      MQTT::Client<IPStack, Countdown, 1000> copy(other);
+    }
+    assert("A copy of the client does not put the buffer back", pool.available() == 3, "available was %d", pool.available());
+  }
+  assert("Buffer back in the pool when the client is destroyed", pool.available() == 4, "available was %d", pool.available());
+
+  MyLog(LOGA_INFO, "TEST12: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 13: asynchronous logging, from several threads
+
+*********************************************************************/
+int test13(struct Options options)
+{
+  const int THREADS = 4, RECORDS = 100;
+  MQTT::AsyncLogging::Logger& logger = MQTT::AsyncLogging::Logger::instance();
+  unsigned long dropped = logger.droppedRecords();
+  std::vector<std::thread> threads;
+  FILE* file = tmpfile();
+  int lines = 0, in_order = 0, strings_ok = 0;
+  int next[THREADS] = {0};
+  char line[300];
+
+  fprintf(xml, "<testcase classname=\"test13\" name=\"asynchronous logging\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 13 - asynchronous logging, from several threads");
+
+  assert("Temporary file created", file != NULL, "file was %p", file);
+  if (file == NULL)
+    goto exit;
+  logger.flush();
+  logger.setStream(file);
+
+  for (int t = 0; t < THREADS; ++t)
+    threads.push_back(std::thread([t]() {
+      for (int i = 0; i < RECORDS; ++i)
+      {
+        char name[20];
+
+        sprintf(name, "thread-%d", t);
+        MQTT_ASYNC_LOG("TEST13: ", "%s record %d of %d\n", name, i, RECORDS);
+        strcpy(name, "overwritten");  // the record has its own copy
+      }
+    }));
+  for (size_t t = 0; t < threads.size(); ++t)
+    threads[t].join();
+  logger.flush();
+  logger.setStream(stdout);
+  dropped = logger.droppedRecords() - dropped;
+
+  rewind(file);
+  while (fgets(line, sizeof(line), file))
+  {
+    const char* record = strstr(line, "thread-");
+    int t = -1, i = -1, count = 0;
+
+    if (strncmp(line, "TEST13: ", 8) != 0 || record == NULL)
+      continue;
+    ++lines;
+    if (sscanf(record, "thread-%d record %d of %d", &t, &i, &count) == 3 && t >= 0 && t < THREADS
+        && count == RECORDS)
+    {
+      ++strings_ok;
+      if (i >= next[t])  // records from each thread in the order they were logged
+      {
+        ++in_order;
+        next[t] = i + 1;
+      }
+    }
+  }
+  fclose(file);
+  // each thread logs fewer records than its queue holds, so none should be dropped
+  assert("No records dropped", dropped == 0, "dropped was %d", (int)dropped);
+  assert("Each record written out", lines == THREADS * RECORDS, "lines was %d", lines);
+  assert("Strings copied into the records", strings_ok == lines, "strings_ok was %d", strings_ok);
+  assert("Records of each thread in order", in_order == lines, "in_order was %d", in_order);
+
+exit:
+  MyLog(LOGA_INFO, "TEST13: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 14: threaded client, publishing from several threads at once
+
+*********************************************************************/
+int test14(struct Options options)
+{
+  const int THREADS = 4, PUBLISHES = 250;
+  int rc = 0;
+  int wait_seconds;
+  int succeeded = 0;
+  std::atomic<int> arrived(0);
+  const char* test_topic = "C client test14";
+  std::vector<std::thread> threads;
+  std::vector<std::future<int> > results[THREADS];
+
+  fprintf(xml, "<testcase classname=\"test14\" name=\"threaded client\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 14 - threaded client, publishing from several threads at once");
+
+  IPStack ipstack = IPStack();
+  MQTT::ThreadedClient<IPStack, Countdown>* client = new MQTT::ThreadedClient<IPStack, Countdown>(ipstack);
+  client->setDefaultMessageHandler(0);   // none
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"threaded-client-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client->connect(data).get();
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client->subscribe(test_topic, MQTT::QOS2, [&arrived](MQTT::MessageData& md) {
+    ++arrived;
+  }).get();
+  assert("Good rc from subscribe", rc == MQTT::QOS2, "rc was %d", rc);
+
+  // each thread publishes at its own QoS, without waiting for the acks until it has sent them all
+  for (int t = 0; t < THREADS; ++t)
+    threads.push_back(std::thread([&, t]() {
+      for (int i = 0; i < PUBLISHES; ++i)
+      {
+        char payload[30];
+        int payloadlen = sprintf(payload, "thread %d message %d", t, i);
+        results[t].push_back(client->publish(test_topic, payload, payloadlen, (enum MQTT::QoS)(t % 3)));
+      }
+    }));
+  for (size_t t = 0; t < threads.size(); ++t)
+    threads[t].join();
+  for (int t = 0; t < THREADS; ++t)
+  {
+    for (size_t i = 0; i < results[t].size(); ++i)
+      if (results[t][i].get() == MQTT::SUCCESS)
+        ++succeeded;
+  }
+  assert("All publishes completed", succeeded == THREADS * PUBLISHES, "succeeded was %d", succeeded);
+
+  wait_seconds = 10;
+  while (arrived < THREADS * PUBLISHES && wait_seconds-- > 0)
+    mqsleep(1);
+  assert("All messages arrived", arrived == THREADS * PUBLISHES, "arrived was %d", (int)arrived);
+
+  rc = client->unsubscribe(test_topic).get();
+  assert("Good rc from unsubscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client->disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  assert("Disconnected", !client->isConnected(), "isConnected was %d", client->isConnected());
+  rc = client->publish(test_topic, (void*)"late", 4, MQTT::QOS1).get();
+  assert("Publish after disconnect fails", rc == MQTT::FAILURE, "rc was %d", rc);
+
+exit:
+  delete client;
+  ipstack.disconnect();
+  MyLog(LOGA_INFO, "TEST14: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 15: publishes written from their payloads with writev
+
+*********************************************************************/
+// a network without writev, for the client to copy publishes into its send buffer for
+class Test15Stack
+{
+public:
+  Test15Stack(IPStack& stack) : stack(stack) { }
+  int read(unsigned char* buffer, int len, int timeout_ms) { return stack.read(buffer, len, timeout_ms); }
+  int write(unsigned char* buffer, int len, int timeout_ms) { return stack.write(buffer, len, timeout_ms); }
+private:
+  IPStack& stack;
+};
+
+static_assert(MQTT::HasWritev<IPStack>::value, "IPStack has writev");
+static_assert(!MQTT::HasWritev<Test15Stack>::value, "Test15Stack has no writev");
+
+struct Test15Arrived
+{
+  int count = 0;
+  int intact = 0;
+  size_t payloadlen = 0;
+};
+
+int test15(struct Options options)
+{
+  const size_t LARGE = 5000;    // more than the send buffer
+  int rc = 0;
+  int wait_seconds;
+  const char* test_topic = "C client test15";
+  static unsigned char payload[LARGE];
+  Test15Arrived arrived;
+
+  fprintf(xml, "<testcase classname=\"test15\" name=\"publishes written with writev\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 15 - publishes written from their payloads with writev");
+
+  for (size_t i = 0; i < LARGE; ++i)
+    payload[i] = (unsigned char)(i * 7);
+
+  IPStack ipstack = IPStack();
+  Test15Stack plainstack(ipstack);
+  MQTT::Client<IPStack, Countdown, 100, 5, 1, 6000> client(ipstack);
+  MQTT::Client<Test15Stack, Countdown, 100, 5, 1, 6000> plainclient(plainstack);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"writev-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+
+  rc = client.subscribe(test_topic, MQTT::QOS2, [&arrived](MQTT::MessageData& md) {
+    ++arrived.count;
+    arrived.payloadlen = md.message.payloadlen;
+    if (md.message.payloadlen == LARGE && memcmp(md.message.payload, payload, LARGE) == 0)
+      ++arrived.intact;
+  });
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  // the payloads are larger than the send buffer, so could not be copied into it
+  for (int qos = 0; qos <= 2; ++qos)
+  {
+    rc = client.publish(test_topic, payload, LARGE, (enum MQTT::QoS)qos);
+    assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  }
+  wait_seconds = 10;
+  while (arrived.count < 3 && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("All messages arrived", arrived.count == 3, "count was %d", arrived.count);
+  assert("Payloads intact", arrived.intact == 3, "intact was %d", arrived.intact);
+
+  // a small publish is still copied into the send buffer
+  rc = client.publish(test_topic, payload, 10, MQTT::QOS1);
+  assert("Good rc from small publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while (arrived.count < 4 && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("Small message arrived", arrived.count == 4 && arrived.payloadlen == 10, "payloadlen was %d", (int)arrived.payloadlen);
+
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+  // without writev, a payload larger than the send buffer can't be published
+  rc = ipstack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = plainclient.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = plainclient.publish(test_topic, payload, LARGE, MQTT::QOS1);
+  assert("Large publish fails without writev", rc == MQTT::FAILURE, "rc was %d", rc);
+  rc = plainclient.publish(test_topic, payload, 10, MQTT::QOS1);
+  assert("Good rc from small publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = plainclient.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+exit:
+  MyLog(LOGA_INFO, "TEST15: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 16: many clients sharing one io_uring
+
+*********************************************************************/
+struct Test16Arrived
+{
+  int count = 0;
+  int large = 0;
+  int intact = 0;
+};
+
+int test16(struct Options options)
+{
+  const int PUBLISHERS = 20;
+  const int PUBLISHES = 10;     // by each publisher
+  const size_t LARGE = 65536;   // sent with zero copy, from where it is
+  int rc = 0;
+  int wait_seconds;
+  int connected = 0;
+  const char* test_topic = "C client test16";
+  static unsigned char payload[LARGE];
+  char clientids[PUBLISHERS][30];
+  Test16Arrived arrived;
+  unsigned long systemCalls = 0;
+  IOUringStack* stacks[PUBLISHERS];
+  MQTT::Client<IOUringStack, Countdown, 100>* clients[PUBLISHERS];
+  typedef MQTT::Client<IOUringStack, Countdown, 100, 5, 1, LARGE + 100> Subscriber;
+
+  fprintf(xml, "<testcase classname=\"test16\" name=\"io_uring transport\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 16 - many clients sharing one io_uring");
+
+  for (size_t i = 0; i < LARGE; ++i)
+    payload[i] = (unsigned char)(i * 13);
+
+  IOUring ring;
+  if (!ring.valid())
+  {
+    MyLog(LOGA_INFO, "io_uring is not available, so test 16 is skipped");
+    write_test_result();
+    return failures;
+  }
+  IOUringStack substack(ring);
+  Subscriber* subscriber = new Subscriber(substack);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"io_uring-test subscriber";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  rc = substack.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = subscriber->connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = subscriber->subscribe(test_topic, MQTT::QOS1, [&arrived](MQTT::MessageData& md) {
+    ++arrived.count;
+    if (md.message.payloadlen == LARGE)
+    {
+      ++arrived.large;
+      if (memcmp(md.message.payload, payload, LARGE) == 0)
+        ++arrived.intact;
+    }
+  });
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+
+  for (int i = 0; i < PUBLISHERS; ++i)
+  {
+    stacks[i] = new IOUringStack(ring);
+    clients[i] = new MQTT::Client<IOUringStack, Countdown, 100>(*stacks[i]);
+    sprintf(clientids[i], "io_uring-test %d", i);
+    data.clientID.cstring = clientids[i];
+    rc = stacks[i]->connect(options.host, options.port);
+    assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+    rc = clients[i]->connect(data);
+    connected += (rc == MQTT::SUCCESS);
+  }
+  assert("All publishers connected", connected == PUBLISHERS, "connected were %d", connected);
+
+  // the QoS 0 publishes are copied, and written by all the publishers with one system call
+  systemCalls = ring.systemCalls();
+  for (int j = 0; j < PUBLISHES; ++j)
+  {
+    for (int i = 0; i < PUBLISHERS; ++i)
+    {
+      rc = clients[i]->publish(test_topic, payload, 20, MQTT::QOS0);
+      assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+    }
+  }
+  ring.submit();
+  systemCalls = ring.systemCalls() - systemCalls;
+  assert("One system call for all the publishes", systemCalls == 1, "system calls were %lu", systemCalls);
+
+  wait_seconds = 10;
+  while (arrived.count < PUBLISHERS * PUBLISHES && wait_seconds-- > 0)
+    subscriber->yield(1000);
+  assert("All messages arrived", arrived.count == PUBLISHERS * PUBLISHES, "count was %d", arrived.count);
+
+  // a large publish is sent with zero copy, if the kernel can
+  rc = clients[0]->publish(test_topic, payload, LARGE, MQTT::QOS1);
+  assert("Good rc from large publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while (arrived.large < 1 && wait_seconds-- > 0)
+    subscriber->yield(1000);
+  assert("Large message arrived", arrived.large == 1, "large was %d", arrived.large);
+  assert("Large payload intact", arrived.intact == 1, "intact was %d", arrived.intact);
+  if (ring.zeroCopy(LARGE))
+    assert("Large publish sent with zero copy", ring.zeroCopySends() == 1, "zero copy sends were %lu", ring.zeroCopySends());
+
+  for (int i = 0; i < PUBLISHERS; ++i)
+  {
+    clients[i]->disconnect();
+    stacks[i]->disconnect();
+    delete clients[i];
+    delete stacks[i];
+  }
+  rc = subscriber->disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  substack.disconnect();
+  delete subscriber;
+
+  MyLog(LOGA_INFO, "TEST16: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
+/*********************************************************************
+
+Test 17: unix domain socket transport
+
+*********************************************************************/
+// a child process relays one connection from a unix domain socket to the server
+pid_t test17_relay(int listener, int server)
+{
+  pid_t pid = fork();
+
+  if (pid == 0)
+  {
+    unsigned char buf[1024];
+    struct pollfd fds[2];
+    bool done = false;
+
+    fds[0].fd = listener;
+    fds[0].events = fds[1].events = POLLIN;
+    fds[0].fd = (poll(fds, 1, 10000) == 1) ? accept(listener, NULL, NULL) : -1;
+    fds[1].fd = server;
+    while (!done && fds[0].fd != -1 && poll(fds, 2, 10000) > 0)
+    {
+      for (int i = 0; i < 2 && !done; ++i)
+      {
+        if (fds[i].revents == 0)
+          continue;
+        int rc = read(fds[i].fd, buf, sizeof(buf));
+        done = (rc <= 0 || write(fds[1 - i].fd, buf, rc) != rc);
+      }
+    }
+    _exit(0);
+  }
+  return pid;
+}
+
+int test17(struct Options options)
+{
+  int rc = 0;
+  int wait_seconds;
+  int arrived = 0;
+  int listener = -1;
+  int server_sock;
+  pid_t relay = -1, pid;
+  uid_t uid;
+  gid_t gid;
+  struct sockaddr_un address;
+  const char* test_topic = "C client test17";
+  const char* path = "/tmp/paho-cpp-test17.sock";
+  char host[100];
+
+  fprintf(xml, "<testcase classname=\"test17\" name=\"unix domain socket\"");
+  global_start_time = start_clock();
+  failures = 0;
+  MyLog(LOGA_INFO, "Starting test 17 - unix domain socket transport");
+
+  IPStack server = IPStack();
+  IPStack ipstack = IPStack();
+  MQTT::Client<IPStack, Countdown> client(ipstack);
+
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = options.MQTTVersion;
+  data.clientID.cstring = (char*)"unix-domain-socket-test";
+  data.keepAliveInterval = 20;
+  data.cleansession = 1;
+
+  unlink(path);
+  memset(&address, '\0', sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  rc = bind(listener, (struct sockaddr*)&address, sizeof(address));
+  assert("Good rc from bind", rc == 0, "rc was %d", rc);
+  if (rc != 0)
+    goto exit;
+  listen(listener, 1);
+
+  rc = server.connect(options.host, options.port);
+  assert("Good rc from TCP connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = server.peerCredentials(pid, uid, gid);
+  assert("No peer credentials over TCP", rc == -1, "rc was %d", rc);
+  server_sock = server.release();
+  relay = test17_relay(listener, server_sock);
+  close(server_sock);   // the relay has its own copy
+
+  // the credentials are of the process which listened, this one
+  sprintf(host, "unix:%s", path);
+  rc = ipstack.connect(host, 0);
+  assert("Good rc from unix domain socket connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = ipstack.peerCredentials(pid, uid, gid);
+  assert("Good rc from peer credentials", rc == 0, "rc was %d", rc);
+  assert("Peer credentials", pid == getpid() && uid == getuid() && gid == getgid(), "pid was %d", (int)pid);
+
+  rc = client.connect(data);
+  assert("Good rc from connect", rc == MQTT::SUCCESS, "rc was %d", rc);
+  if (rc != MQTT::SUCCESS)
+    goto exit;
+  rc = client.subscribe(test_topic, MQTT::QOS1, [&arrived](MQTT::MessageData&) { ++arrived; });
+  assert("Good rc from subscribe", rc == MQTT::SUCCESS, "rc was %d", rc);
+  rc = client.publish(test_topic, (void*)"unix domain socket test", 23, MQTT::QOS1);
+  assert("Good rc from publish", rc == MQTT::SUCCESS, "rc was %d", rc);
+  wait_seconds = 10;
+  while (arrived == 0 && wait_seconds-- > 0)
+    client.yield(1000);
+  assert("Message arrived", arrived == 1, "arrived was %d", arrived);
+  rc = client.disconnect();
+  assert("Disconnect successful", rc == MQTT::SUCCESS, "rc was %d", rc);
+  ipstack.disconnect();
+
+  // too long for a unix domain socket address
+  memset(host, 'a', sizeof(host) - 1);
+  host[sizeof(host) - 1] = '\0';
+  memcpy(host, "unix:", 5);
+  rc = ipstack.connect(host, 0);
+  assert("Path too long", rc == -1, "rc was %d", rc);
+
+exit:
+  if (relay > 0)
+    waitpid(relay, NULL, 0);
+  if (listener != -1)
+    close(listener);
+  unlink(path);
+  MyLog(LOGA_INFO, "TEST17: test %s. %d tests run, %d failures.",
+      (failures == 0) ? "passed" : "failed", tests, failures);
+  write_test_result();
+  return failures;
+}
+
+
 #if 0
 /*********************************************************************
 
@@ -910,7 +2417,7 @@ exit:
 int main(int argc, char** argv)
 {
 	int rc = 0;
- 	int (*tests[])(Options) = {NULL, test1, test2, test3, /*test4, test5, test6, test6a*/};
+ 	int (*tests[])(Options) = {NULL, test1, test2, test3, test4, test5, test6, test7, test8, test9, test10, test11, test12, test13, test14, test15, test16, test17, /*test6a*/};
 	int i;
 
 	xml = fopen("TEST-test1.xml", "w");